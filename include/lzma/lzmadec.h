@@ -227,6 +227,33 @@ SRes LzmaDecode(Byte *dest, SizeT *destLen, const Byte *src, SizeT *srcLen,
     const Byte *propData, unsigned propSize, ELzmaFinishMode finishMode,
     ELzmaStatus *status, ISzAlloc *alloc);
 
+/* ---------- Streaming .lzma decoding ---------- */
+
+/* Same input as unlzma_decompress (LZMA_PROPS_SIZE bytes of properties, the 64-bit unpacked size,
+   then the stream), but fed in chunks of any size as they arrive. Output goes to dest, which must
+   stay valid for the lifetime of the stream; each call decodes at most up to dest_limit bytes of
+   it, so the caller can grow dest as it goes. */
+
+typedef struct
+{
+  CLzmaDec dec;
+  Byte header[LZMA_PROPS_SIZE + 8];
+  unsigned headerLen;
+  UInt64 unpackSize; /* (UInt64)-1 if the header doesn't say */
+  ELzmaStatus status;
+} unlzma_stream;
+
+void unlzma_stream_init(unlzma_stream *s, uint8_t *dest, size_t dest_size);
+
+/* *src_size: in - bytes available at src, out - bytes consumed (less only if dest_limit was hit) */
+int unlzma_stream_feed(unlzma_stream *s, const uint8_t *src, size_t *src_size, size_t dest_limit);
+
+/* decoded size so far, and whether the stream is complete */
+size_t unlzma_stream_out(unlzma_stream *s);
+int unlzma_stream_finished(unlzma_stream *s);
+
+void unlzma_stream_free(unlzma_stream *s);
+
 #ifdef __cplusplus
 }
 #endif
@@ -30,4 +30,21 @@ if dev is None:
 dev.set_configuration()
 
 #dev.ctrl_transfer(0x21, 4, 0, 0, 0)
-print("".join(chr (x) for x in dev.ctrl_transfer(0xa1, 1, 0, 0, 512)))
+out = bytearray(dev.ctrl_transfer(0xa1, 1, 0, 0, 0x1000))
+try:
+    # Stream over bulk endpoint 0x83 while we're here, so large outputs aren't capped at one control transfer
+    dev.ctrl_transfer(0x21, 4, 2, 0, 0)
+except usb.core.USBError:
+    pass # older pongoOS, polling only
+else:
+    try:
+        while True:
+            chunk = dev.read(0x83, 0x10000, timeout=100)
+            if len(chunk) == 0:
+                break
+            out += chunk
+    except usb.core.USBTimeoutError:
+        pass
+    dev.ctrl_transfer(0x21, 4, 3, 0, 0)
+    out += bytearray(dev.ctrl_transfer(0xa1, 1, 0, 0, 0x1000))
+sys.stdout.write(out.decode("utf-8", "replace"))
@@ -11,6 +11,7 @@ parser.add_argument('-k', '--kernel', dest='kernel', help='path to kernel image'
 parser.add_argument('-d', '--dtbpack', dest='dtbpack', help='path to dtbpack')
 parser.add_argument('-r', '--initrd', dest='initrd', help='path to initial ramdisk')
 parser.add_argument('-c', '--cmdline', dest='cmdline', help='custom kernel command line')
+parser.add_argument('-z', '--lzma', dest='lzma', action='store_true', help='kernel is .lzma, have pongoOS decompress it while it uploads')
 
 args = parser.parse_args()
 
@@ -42,33 +43,31 @@ if args.cmdline is not None:
     dev.ctrl_transfer(0x21, 4, 0, 0, 0)
     dev.ctrl_transfer(0x21, 3, 0, 0, f"linux_cmdline {args.cmdline}\n")
 
+# The kernel goes to its own upload slot, which bootl takes over without a copy; an empty slot name
+# selects the default buffer, which the ramdisk and fdt commands copy out of
+def upload(slot, data, mode=0):
+    dev.ctrl_transfer(0x21, 5, 0, 0, slot)
+    dev.ctrl_transfer(0x21, 2, 0, 0, 0)
+    dev.ctrl_transfer(0x21, 1, mode, 0, struct.pack('I', len(data)))
+    dev.write(2, data, 1000000)
+
 if args.initrd is not None:
     print("Loading initial ramdisk...")
     initrd = open(args.initrd, "rb").read()
-    initrd_size = len(initrd)
-    dev.ctrl_transfer(0x21, 2, 0, 0, 0)
-    dev.ctrl_transfer(0x21, 1, 0, 0, struct.pack('I', initrd_size))
-
-    dev.write(2, initrd, 1000000)
+    upload("", initrd)
     dev.ctrl_transfer(0x21, 4, 0, 0, 0)
     dev.ctrl_transfer(0x21, 3, 0, 0, "ramdisk\n")
     print("Initial ramdisk loaded successfully.")
 
 print("Loading device tree...")
-dev.ctrl_transfer(0x21, 2, 0, 0, 0)
-dev.ctrl_transfer(0x21, 1, 0, 0, 0)
-dev.write(2, fdt)
+upload("", fdt)
 
 dev.ctrl_transfer(0x21, 4, 0, 0, 0)
 dev.ctrl_transfer(0x21, 3, 0, 0, "fdt\n")
 print("Device tree loaded successfully.")
 
 print("Loading kernel...")
-kernel_size = len(kernel)
-dev.ctrl_transfer(0x21, 2, 0, 0, 0)
-dev.ctrl_transfer(0x21, 1, 0, 0, struct.pack('I', kernel_size))
-
-dev.write(2, kernel, 1000000)
+upload("kernel", kernel, 1 if args.lzma else 0)
 print("Kernel loaded successfully.")
 
 dev.ctrl_transfer(0x21, 4, 0, 0, 0)
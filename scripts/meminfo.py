@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+#
+#  Copyright (C) 2019-2021 checkra1n team
+#  This file is part of pongoOS.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+# 
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+# 
+
+import struct
+import usb.core
+
+# Keep in sync with struct pongo_meminfo in src/kernel/pongo.h
+RUN_BUCKETS = 16
+FIELDS_PRE = ["version", "page_size", "total_pages", "free_pages", "wired_pages", "referenced_pages", "free_runs", "largest_free_run"]
+FIELDS_POST = ["paging_requests", "static_used", "static_size", "heap_used", "heap_mapped", "linear_kvm_used", "linear_kvm_size", "jit_pages", "module_count", "module_bytes"]
+FORMAT = "<II6Q%dQ10Q" % RUN_BUCKETS
+
+dev = usb.core.find(idVendor=0x05ac, idProduct=0x4141)
+if dev is None:
+    raise ValueError('Device not found')
+dev.set_configuration()
+
+raw = bytes(dev.ctrl_transfer(0xa1, 3, 0, 0, struct.calcsize(FORMAT)))
+values = struct.unpack(FORMAT, raw)
+pre = len(FIELDS_PRE)
+info = dict(zip(FIELDS_PRE, values[:pre]))
+info["free_run_histogram"] = list(values[pre:pre + RUN_BUCKETS])
+info.update(zip(FIELDS_POST, values[pre + RUN_BUCKETS:]))
+
+for key in FIELDS_PRE + ["free_run_histogram"] + FIELDS_POST:
+    print("%s: %s" % (key, info[key]))
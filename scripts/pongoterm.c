@@ -47,6 +47,7 @@
 #define UPLOADSZ_MAX        (1024 * 1024 * 128)
 
 static uint8_t gBlockIO = 1;
+static bool gStream = false;
 
 typedef struct stuff stuff_t;
 
@@ -64,6 +65,7 @@ static void io_stop(stuff_t *stuff);
  *   and "th", but may contain more than just that.
  * - USBControlTransfer
  * - USBBulkUpload
+ * - USBBulkRead
  * - pongoterm_main
  ********** ********** ********** ********** **********/
 
@@ -144,6 +146,17 @@ static usb_ret_t USBBulkUpload(usb_device_handle_t handle, void *data, uint32_t
     return LIBUSB_SUCCESS;
 }
 
+// Reads whatever the device has on the stdout stream endpoint (0x83), up to len bytes.
+// Running into the timeout just means there was nothing (more) to read.
+static usb_ret_t USBBulkRead(usb_device_handle_t handle, void *data, uint32_t len, uint32_t *lenDone, uint32_t timeoutMs)
+{
+    int transferred = 0;
+    usb_ret_t r = libusb_bulk_transfer(handle, 0x83, data, len, &transferred, timeoutMs);
+    *lenDone = transferred;
+    if(r == LIBUSB_ERROR_TIMEOUT) r = LIBUSB_SUCCESS;
+    return r;
+}
+
 struct stuff
 {
     pthread_t th;
@@ -339,6 +352,20 @@ static usb_ret_t USBBulkUpload(usb_device_handle_t handle, void *data, uint32_t
     return (*handle)->WritePipe(handle, 2, data, len);
 }
 
+// Pipe 3 is the stdout stream endpoint (0x83), see USBBulkRead for libusb.
+static usb_ret_t USBBulkRead(usb_device_handle_t handle, void *data, uint32_t len, uint32_t *lenDone, uint32_t timeoutMs)
+{
+    UInt32 size = len;
+    usb_ret_t ret = (*handle)->ReadPipeTO(handle, 3, data, &size, timeoutMs, timeoutMs);
+    if(ret == kIOUSBTransactionTimedOut)
+    {
+        size = 0;
+        ret = KERN_SUCCESS;
+    }
+    *lenDone = ret == KERN_SUCCESS ? size : 0;
+    return ret;
+}
+
 struct stuff
 {
     pthread_t th;
@@ -571,6 +598,16 @@ static void write_stdout(char *buf, uint32_t len)
     }
 }
 
+// Hand stdout back to EP0 so the device doesn't keep queueing it for a bulk reader that is gone.
+static void io_stream_stop(stuff_t *stuff)
+{
+    if(gStream)
+    {
+        gStream = false;
+        USBControlTransfer(stuff->handle, 0x21, 4, 3, 0, 0, NULL, NULL);
+    }
+}
+
 static void* io_main(void *arg)
 {
     stuff_t *stuff = arg;
@@ -584,6 +621,9 @@ static void* io_main(void *arg)
     usb_ret_t ret = USB_RET_SUCCESS;
     char prompt[64] = "> ";
     uint32_t plen = 2;
+    // Have stdout streamed over the bulk endpoint if the device supports it, otherwise keep polling it via EP0.
+    bool stream = USBControlTransfer(stuff->handle, 0x21, 4, 2, 0, 0, NULL, NULL) == USB_RET_SUCCESS;
+    gStream = stream;
     while(1)
     {
         char buf[0x2000] = {};
@@ -593,9 +633,17 @@ static void* io_main(void *arg)
         while(in_progress)
         {
             ret = USBControlTransfer(stuff->handle, 0xa1, 2, 0, 0, (uint32_t)sizeof(in_progress), &in_progress, NULL);
-            if(ret == USB_RET_SUCCESS)
+            // When streaming, drain the endpoint until it runs dry, which also paces the status polling.
+            while(ret == USB_RET_SUCCESS)
             {
-                ret = USBControlTransfer(stuff->handle, 0xa1, 1, 0, 0, 0x1000, buf + outpos, &outlen);
+                if(stream)
+                {
+                    ret = USBBulkRead(stuff->handle, buf + outpos, 0x1000, &outlen, 10);
+                }
+                else
+                {
+                    ret = USBControlTransfer(stuff->handle, 0xa1, 1, 0, 0, 0x1000, buf + outpos, &outlen);
+                }
                 if(ret == USB_RET_SUCCESS)
                 {
                     write_stdout(buf + outpos, outlen);
@@ -606,6 +654,10 @@ static void* io_main(void *arg)
                         outpos = 0x1000;
                     }
                 }
+                if(!stream || outlen == 0)
+                {
+                    break;
+                }
             }
             if(ret != USB_RET_SUCCESS)
             {
@@ -655,6 +707,7 @@ static void* io_main(void *arg)
             {
                 if(errno == EINTR)
                 {
+                    io_stream_stop(stuff);
                     return NULL;
                 }
                 ERR("read: %s", strerror(errno));
@@ -678,6 +731,7 @@ static void* io_main(void *arg)
         }
         if(len == 0)
         {
+            io_stream_stop(stuff);
             exit(0); // TODO: ok with libusb?
         }
         if(len > sizeof(buf))
@@ -815,6 +869,7 @@ static void io_stop(stuff_t *stuff)
         ERR("pthread_join: %s", strerror(r));
         exit(-1); // TODO: ok with libusb?
     }
+    io_stream_stop(stuff);
 }
 
 int main(int argc, const char **argv)
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+#
+#  Copyright (C) 2019-2021 checkra1n team
+#  This file is part of pongoOS.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+# 
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+# 
+
+# Pulls the pongoOS sampling profiler table over USB, symbolizes it and prints folded stacks
+# (one "frame;frame;frame count" line per distinct stack) for flamegraph.pl or speedscope.
+#
+#   profile.py build/Pongo [--module name=path/to/module.macho ...] [--start] [--clear]
+#
+# Run "profile on" (or pass --start) before the workload and this script afterwards.
+
+import argparse
+import bisect
+import struct
+import sys
+import usb.core
+
+# Keep in sync with struct pongo_profile_header / pongo_profile_bucket / pongo_module_map_entry in src/kernel/pongo.h
+HEADER = "<IHHIIIIQQQ"
+MAGIC = 0x464f5250
+VERSION = 1
+MODMAP = "<QQ48s"
+
+LC_SEGMENT_64 = 0x19
+LC_SYMTAB = 0x2
+
+class MachO:
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            data = f.read()
+        magic, _, _, _, ncmds, _, _, _ = struct.unpack_from("<IiiIIIII", data, 0)
+        if magic != 0xfeedfacf:
+            raise ValueError("%s is not a 64-bit Mach-O" % path)
+        self.text_base = 0
+        symbols = []
+        off = 32
+        for _ in range(ncmds):
+            cmd, cmdsize = struct.unpack_from("<II", data, off)
+            if cmd == LC_SEGMENT_64:
+                segname = data[off + 8:off + 24].split(b"\0")[0]
+                vmaddr, = struct.unpack_from("<Q", data, off + 24)
+                if segname == b"__TEXT":
+                    self.text_base = vmaddr
+            elif cmd == LC_SYMTAB:
+                symoff, nsyms, stroff, _ = struct.unpack_from("<IIII", data, off + 8)
+                for i in range(nsyms):
+                    strx, ntype, _, _, value = struct.unpack_from("<IBBHQ", data, symoff + i * 16)
+                    if ntype & 0xe0 or (ntype & 0x0e) != 0x0e:
+                        continue  # stabs and undefined symbols
+                    end = data.index(b"\0", stroff + strx)
+                    symbols.append((value, data[stroff + strx:end].decode("ascii", "replace")))
+            off += cmdsize
+        symbols.sort()
+        self.addrs = [s[0] for s in symbols]
+        self.names = [s[1] for s in symbols]
+
+    def lookup(self, addr):
+        i = bisect.bisect_right(self.addrs, addr) - 1
+        if i < 0:
+            return None
+        name = self.names[i]
+        return name[1:] if name.startswith("_") else name
+
+    def address_of(self, name):
+        for addr, sym in zip(self.addrs, self.names):
+            if sym == name:
+                return addr
+        raise ValueError("symbol %s not found" % name)
+
+def fetch_buckets(dev):
+    buckets = []
+    cursor = 0
+    hdr = None
+    while True:
+        raw = bytes(dev.ctrl_transfer(0xa1, 5, cursor, 0, 0x1000))
+        hdr = struct.unpack_from(HEADER, raw)
+        magic, version, depth, count, nxt, total, _, samples, overflow, anchor = hdr
+        if magic != MAGIC or version != VERSION:
+            raise ValueError("unexpected profile header %#x v%d" % (magic, version))
+        bucket = "<IIII%dQ" % depth
+        off = struct.calcsize(HEADER)
+        for i in range(count):
+            b = struct.unpack_from(bucket, raw, off + i * struct.calcsize(bucket))
+            buckets.append((b[0], b[1], b[4:4 + b[2]]))
+        if nxt >= total:
+            return buckets, samples, overflow, anchor
+        cursor = nxt
+
+def fetch_modules(dev):
+    raw = bytes(dev.ctrl_transfer(0xa1, 6, 0, 0, 0x1000))
+    size = struct.calcsize(MODMAP)
+    mods = []
+    for i in range(len(raw) // size):
+        base, end, name = struct.unpack_from(MODMAP, raw, i * size)
+        mods.append((base, end, name.split(b"\0")[0].decode("ascii", "replace")))
+    return mods
+
+def main():
+    parser = argparse.ArgumentParser(description="symbolize the pongoOS profiler table into folded stacks")
+    parser.add_argument("pongo", help="unstripped Pongo Mach-O (build/Pongo)")
+    parser.add_argument("--module", action="append", default=[], metavar="NAME=PATH", help="Mach-O for a loaded module")
+    parser.add_argument("--start", action="store_true", help="send 'profile on' and exit")
+    parser.add_argument("--clear", action="store_true", help="send 'profile clear' after reading")
+    args = parser.parse_args()
+
+    dev = usb.core.find(idVendor=0x05ac, idProduct=0x4141)
+    if dev is None:
+        raise ValueError('Device not found')
+    dev.set_configuration()
+
+    if args.start:
+        dev.ctrl_transfer(0x21, 3, 0, 0, "profile on\n")
+        return
+
+    pongo = MachO(args.pongo)
+    buckets, samples, overflow, anchor = fetch_buckets(dev)
+    slide = anchor - pongo.address_of("_pongo_profile_read")
+
+    images = {}
+    for spec in args.module:
+        name, path = spec.split("=", 1)
+        images[name] = MachO(path)
+    modules = [(base, end, name, images.get(name)) for base, end, name in fetch_modules(dev)]
+
+    def symbolize(pc):
+        for base, end, name, image in modules:
+            if base <= pc < end:
+                sym = image.lookup(pc - base + image.text_base) if image else None
+                return "%s`%s" % (name, sym) if sym else "%s+%#x" % (name, pc - base)
+        sym = pongo.lookup(pc - slide)
+        return sym if sym else "%#x" % pc
+
+    for count, pid, frames in sorted(buckets, key=lambda b: -b[0]):
+        # frames[0] is the interrupted PC, folded stacks want outermost first
+        stack = ["pid %d" % pid] + [symbolize(pc) for pc in reversed(frames)]
+        print("%s %d" % (";".join(stack), count))
+
+    if args.clear:
+        dev.ctrl_transfer(0x21, 3, 0, 0, "profile clear\n")
+    sys.stderr.write("%d samples, %d distinct stacks, %d dropped\n" % (samples, len(buckets), overflow))
+
+if __name__ == "__main__":
+    main()
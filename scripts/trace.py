@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+#
+#  Copyright (C) 2019-2021 checkra1n team
+#  This file is part of pongoOS.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+# 
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+# 
+
+# Drains the pongoOS trace ring over USB and converts it to Chrome trace / Perfetto JSON.
+#
+#   trace.py [-o trace.json] [--start] [--follow SECONDS]
+#
+# --start sends "trace on" first, --follow keeps polling for the given time instead of
+# stopping once the ring is empty. Load the result in chrome://tracing or ui.perfetto.dev.
+
+import argparse
+import json
+import struct
+import time
+import usb.core
+
+# Keep in sync with struct pongo_trace_header / pongo_trace_event in src/kernel/pongo.h
+HEADER = "<IHHII"
+EVENT = "<QIIQQ"
+MAGIC = 0x43525450
+VERSION = 1
+
+SWITCH, IRQ_ENTER, IRQ_EXIT, FIQ_ENTER, FIQ_EXIT, LOCK_CONTENDED, FAULT, MODULE_LOAD = range(1, 9)
+USER = 0x100
+
+IRQ_TID = -1
+FIQ_TID = -2
+
+def fetch(dev):
+    raw = bytes(dev.ctrl_transfer(0xa1, 4, 0, 0, 0x1000))
+    magic, version, count, dropped, tick_hz = struct.unpack_from(HEADER, raw)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("unexpected trace header %#x v%d" % (magic, version))
+    off = struct.calcsize(HEADER)
+    size = struct.calcsize(EVENT)
+    events = [struct.unpack_from(EVENT, raw, off + i * size) for i in range(count)]
+    return events, dropped, tick_hz
+
+def convert(events, tick_hz):
+    out = []
+    names = {IRQ_TID: "irq", FIQ_TID: "fiq"}
+    base = events[0][0] if events else 0
+    us = lambda ticks: (ticks - base) * 1000000.0 / tick_hz
+
+    def complete(tid, name, start, end, args=None):
+        ev = {"name": name, "ph": "X", "pid": 0, "tid": tid, "ts": us(start), "dur": max(us(end) - us(start), 0)}
+        if args:
+            ev["args"] = args
+        out.append(ev)
+
+    def instant(tid, name, ticks, args):
+        out.append({"name": name, "ph": "i", "s": "t", "pid": 0, "tid": tid, "ts": us(ticks), "args": args})
+
+    running = None  # (pid, since)
+    irq_open = {}
+    fiq_open = None
+    for ticks, kind, pid, arg0, arg1 in events:
+        if kind == SWITCH:
+            name = arg1.to_bytes(8, "little").split(b"\0")[0].decode("ascii", "replace")
+            if name:
+                names[arg0] = name
+            if running is not None:
+                complete(running[0], names.get(running[0], "pid %d" % running[0]), running[1], ticks)
+            running = (arg0, ticks)
+        elif kind == IRQ_ENTER:
+            irq_open[arg0] = ticks
+        elif kind == IRQ_EXIT:
+            if arg0 in irq_open:
+                complete(IRQ_TID, "irq %d" % arg0, irq_open.pop(arg0), ticks)
+        elif kind == FIQ_ENTER:
+            fiq_open = ticks
+        elif kind == FIQ_EXIT:
+            if fiq_open is not None:
+                complete(FIQ_TID, "fiq", fiq_open, ticks, {"preempt": arg0})
+                fiq_open = None
+        elif kind == LOCK_CONTENDED:
+            waited = arg1 * 1000000.0 / tick_hz
+            instant(pid, "lock contended", ticks, {"lock": hex(arg0), "wait_us": waited})
+        elif kind == FAULT:
+            instant(pid, "fault", ticks, {"far": hex(arg0), "esr": hex(arg1)})
+        elif kind == MODULE_LOAD:
+            instant(pid, "module load", ticks, {"base": hex(arg0), "size": hex(arg1)})
+        else:
+            instant(pid, "user %#x" % kind if kind >= USER else "event %d" % kind, ticks, {"arg0": hex(arg0), "arg1": hex(arg1)})
+
+    if running is not None and events:
+        complete(running[0], names.get(running[0], "pid %d" % running[0]), running[1], events[-1][0])
+
+    for tid, name in names.items():
+        out.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": tid, "args": {"name": name}})
+    out.append({"name": "process_name", "ph": "M", "pid": 0, "args": {"name": "pongoOS"}})
+    return out
+
+def main():
+    parser = argparse.ArgumentParser(description="dump the pongoOS trace ring as Chrome trace JSON")
+    parser.add_argument("-o", "--output", default="pongo-trace.json")
+    parser.add_argument("--start", action="store_true", help="enable tracing before reading")
+    parser.add_argument("--follow", type=float, default=0, help="keep polling for this many seconds")
+    args = parser.parse_args()
+
+    dev = usb.core.find(idVendor=0x05ac, idProduct=0x4141)
+    if dev is None:
+        raise ValueError('Device not found')
+    dev.set_configuration()
+
+    if args.start:
+        dev.ctrl_transfer(0x21, 3, 0, 0, "trace on\n")
+
+    events = []
+    dropped = 0
+    tick_hz = 24000000
+    deadline = time.time() + args.follow
+    while True:
+        batch, lost, tick_hz = fetch(dev)
+        events += batch
+        dropped += lost
+        if not batch:
+            if time.time() >= deadline:
+                break
+            time.sleep(0.01)
+
+    with open(args.output, "w") as f:
+        json.dump({"traceEvents": convert(events, tick_hz), "displayTimeUnit": "ns"}, f)
+    print("%d events, %d dropped, written to %s" % (len(events), dropped, args.output))
+
+if __name__ == "__main__":
+    main()
@@ -25,6 +25,7 @@
  * 
  */
 #include <pongo.h>
+#include <arm_neon.h>
 #include "font8x8_basic.h"
 
 uint32_t* gFramebuffer;
@@ -36,15 +37,117 @@ uint32_t y_cursor;
 uint32_t x_cursor;
 uint8_t scale_factor;
 uint32_t bannerHeight = 0;
-char overflow_mode = 0;
+char overflow_mode = FB_OVERFLOW_SCROLL;
 uint32_t basecolor = 0x41414141;
-void screen_fill(uint32_t color) {
-    for (int y = 0; y < gHeight; y++) {
-        for (int x = 0; x < gWidth; x++) {
-            gFramebuffer[x + y * gRowPixels] = color;
+
+/*
+
+    Name: text cells
+    Description: the character drawn in every text cell below the banner, so scrolling can redraw the text one row
+                 up over the backdrop in gFramebufferCopy, which never moves
+
+*/
+
+static uint8_t* screen_cells;
+static uint32_t screen_cell_cols;
+static uint32_t screen_cell_rows;
+
+static uint8_t* screen_cell(uint32_t x, uint32_t y)
+{
+    if (!screen_cells || x < LEFT_MARGIN || y < bannerHeight) return NULL;
+    uint32_t col = (x - LEFT_MARGIN) / (8 * SCALE_FACTOR);
+    uint32_t row = (y - bannerHeight) / (1 + 8 * SCALE_FACTOR);
+    if (col >= screen_cell_cols || row >= screen_cell_rows) return NULL;
+    return &screen_cells[row * screen_cell_cols + col];
+}
+/*
+
+    Name: screen damage
+    Description: drawing records the rectangles it touched instead of cleaning the cache right away. Touching or
+                 adjacent rectangles are coalesced (a run of glyphs on one line collapses into a single rectangle),
+                 and screen_flush cleans what is left once, per console flush or frame
+
+*/
+
+#define SCREEN_DAMAGE_RECTS 8
+struct screen_rect {
+    uint32_t x0, y0, x1, y1;
+};
+static struct screen_rect screen_damage_rects[SCREEN_DAMAGE_RECTS];
+static uint32_t screen_damage_count;
+
+static inline bool screen_rect_touches(const struct screen_rect* a, const struct screen_rect* b) {
+    return a->x0 <= b->x1 && b->x0 <= a->x1 && a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+static inline void screen_rect_union(struct screen_rect* a, const struct screen_rect* b) {
+    if (b->x0 < a->x0) a->x0 = b->x0;
+    if (b->y0 < a->y0) a->y0 = b->y0;
+    if (b->x1 > a->x1) a->x1 = b->x1;
+    if (b->y1 > a->y1) a->y1 = b->y1;
+}
+static inline uint64_t screen_rect_area(const struct screen_rect* r) {
+    return (uint64_t)(r->x1 - r->x0) * (r->y1 - r->y0);
+}
+static void screen_damage(uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+    if (x >= gWidth || y >= gHeight || !w || !h) return;
+    struct screen_rect r = { x, y, x + w > gWidth ? gWidth : x + w, y + h > gHeight ? gHeight : y + h };
+    disable_interrupts();
+    for (uint32_t i = 0; i < screen_damage_count; ) {
+        if (screen_rect_touches(&r, &screen_damage_rects[i])) {
+            // absorb it and start over, the grown rectangle may now reach others
+            screen_rect_union(&r, &screen_damage_rects[i]);
+            screen_damage_rects[i] = screen_damage_rects[--screen_damage_count];
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+    if (screen_damage_count == SCREEN_DAMAGE_RECTS) {
+        // out of slots: fold into whichever rectangle grows the least
+        uint32_t best = 0;
+        uint64_t best_growth = UINT64_MAX;
+        for (uint32_t i = 0; i < SCREEN_DAMAGE_RECTS; i++) {
+            struct screen_rect u = screen_damage_rects[i];
+            screen_rect_union(&u, &r);
+            uint64_t growth = screen_rect_area(&u) - screen_rect_area(&screen_damage_rects[i]);
+            if (growth < best_growth) {
+                best_growth = growth;
+                best = i;
+            }
+        }
+        screen_rect_union(&screen_damage_rects[best], &r);
+    } else {
+        screen_damage_rects[screen_damage_count++] = r;
+    }
+    enable_interrupts();
+}
+void screen_flush() {
+    if (!gFramebuffer) return;
+    struct screen_rect rects[SCREEN_DAMAGE_RECTS];
+    disable_interrupts();
+    uint32_t count = screen_damage_count;
+    memcpy(rects, screen_damage_rects, count * sizeof(struct screen_rect));
+    screen_damage_count = 0;
+    enable_interrupts();
+    for (uint32_t i = 0; i < count; i++) {
+        struct screen_rect* r = &rects[i];
+        if (r->x0 == 0 && r->x1 == gWidth) {
+            cache_clean(&gFramebuffer[r->y0 * gRowPixels], (r->y1 - r->y0) * gRowPixels * 4);
+        } else {
+            cache_clean_rect(&gFramebuffer[r->x0 + r->y0 * gRowPixels], gRowPixels * 4, (r->x1 - r->x0) * 4, r->y1 - r->y0);
         }
     }
-    cache_clean(gFramebuffer, gHeight * gRowPixels * 4);
+}
+
+void screen_fill(uint32_t color) {
+    for (int x = 0; x < gWidth; x++) {
+        gFramebuffer[x] = color;
+    }
+    for (int y = 1; y < gHeight; y++) {
+        memcpy(&gFramebuffer[y * gRowPixels], gFramebuffer, gWidth * 4);
+    }
+    screen_damage(0, 0, gWidth, gHeight);
+    screen_flush();
 }
 void screen_fill_basecolor() {
     return screen_fill(basecolor);
@@ -52,21 +155,26 @@ void screen_fill_basecolor() {
 void screen_clear_all()
 {
     y_cursor = bannerHeight;
-    for (int y = bannerHeight; y < gHeight; y++) {
-        for (int x = 0; x < gWidth; x++) {
-            gFramebuffer[x + y * gRowPixels] = gFramebufferCopy[x + y * gRowPixels];
-        }
-    }
-    cache_clean(gFramebuffer, gHeight * gRowPixels * 4);
+    if (screen_cells) bzero(screen_cells, screen_cell_cols * screen_cell_rows);
+    // same layout as the framebuffer, so everything below the banner is one contiguous copy
+    memcpy(&gFramebuffer[bannerHeight * gRowPixels], &gFramebufferCopy[bannerHeight * gRowPixels], (gHeight - bannerHeight) * gRowPixels * 4);
+    screen_damage(0, bannerHeight, gWidth, gHeight - bannerHeight);
+    screen_flush();
+}
+
+static void screen_clear_row_nocache()
+{
+    uint32_t rows = 1 + 8 * SCALE_FACTOR;
+    if (y_cursor + rows > gHeight) rows = gHeight - y_cursor;
+    memcpy(&gFramebuffer[y_cursor * gRowPixels], &gFramebufferCopy[y_cursor * gRowPixels], rows * gRowPixels * 4);
+    screen_damage(0, y_cursor, gWidth, rows);
+    uint8_t* cell = screen_cell(LEFT_MARGIN, y_cursor);
+    if (cell) bzero(cell, screen_cell_cols);
 }
 void screen_clear_row()
 {
-    for (int y = 0; y < (1 + 8 * SCALE_FACTOR); y++) {
-        for (int x = 0; x < gWidth; x++) {
-            gFramebuffer[x + ((y + y_cursor) * gRowPixels)] = gFramebufferCopy[x + ((y + y_cursor) * gRowPixels)];
-        }
-    }
-    cache_clean(&gFramebuffer[y_cursor * gRowPixels], (1 + 8 * SCALE_FACTOR) * gRowPixels * 4);
+    screen_clear_row_nocache();
+    screen_flush();
 }
 uint32_t color_compose(uint16_t components[3]) {
     return ((((uint32_t)components[3]) & 0xff) << 24) | ((((uint32_t)components[2]) & 0xff) << 16) | ((((uint32_t)components[1]) & 0xff) << 8)  | ((((uint32_t)components[0]) & 0xff) << 0); // works on ARGB8,8,8,8 only, i'll add ARGB5,9,9,9 eventually
@@ -126,9 +234,121 @@ uint32_t colors_mix_alpha(uint32_t color1, uint32_t color2) {
     return color_compose_v32(componentsw);
 }
 
-void screen_putc(uint8_t c)
+/*
+
+    Name: glyph atlas
+    Description: font8x8_basic expanded once at the current scale factor, one 32-bit mask per screen pixel
+                 (all ones where the glyph is set), so drawing a glyph is a straight row blit with no per-pixel
+                 divisions or colour decomposition
+
+*/
+
+static uint32_t* glyph_atlas;
+static uint8_t glyph_atlas_scale;
+static const uint32_t* glyph_lookup(uint8_t c)
+{
+    uint32_t gw = 8 * SCALE_FACTOR;
+    if (glyph_atlas_scale != SCALE_FACTOR) {
+        uint32_t* atlas = malloc(128 * gw * gw * sizeof(uint32_t));
+        if (!atlas) return NULL;
+        for (uint32_t g = 0; g < 128; g++) {
+            uint32_t* glyph = &atlas[g * gw * gw];
+            for (uint32_t y = 0; y < gw; y++) {
+                uint8_t bits = font8x8_basic[g][y / SCALE_FACTOR];
+                for (uint32_t x = 0; x < gw; x++) {
+                    glyph[y * gw + x] = (bits & (1 << (x / SCALE_FACTOR))) ? 0xffffffff : 0;
+                }
+            }
+        }
+        disable_interrupts();
+        uint32_t* old = glyph_atlas;
+        glyph_atlas = atlas;
+        glyph_atlas_scale = SCALE_FACTOR;
+        enable_interrupts();
+        if (old) free(old);
+    }
+    return &glyph_atlas[(c & 0x7f) * gw * gw];
+}
+
+/*
+
+    Name: NEON blits
+    Description: exception entry only preserves the low 64 bits of v0-v31, so every routine that touches q registers
+                 runs with interrupts held and is kept out of line, so no vector value lives across the enable
+
+*/
+
+__attribute__((noinline)) static void screen_draw_glyph(const uint32_t* glyph, uint32_t x0, uint32_t y0)
+{
+    uint32_t gw = 8 * SCALE_FACTOR;
+    disable_interrupts();
+    uint32x4_t fg = vdupq_n_u32(basecolor ^ 0xFFFFFFFF);
+    uint8x16_t base = vreinterpretq_u8_u32(vdupq_n_u32(basecolor));
+    uint32x4_t alpha = vdupq_n_u32(0xff000000);
+    for (uint32_t y = 0; y < gw; y++) {
+        uint32_t ind = x0 + (y + y0) * gRowPixels;
+        const uint32_t* mask = &glyph[y * gw];
+        for (uint32_t x = 0; x < gw; x += 4) {
+            // colors_average(rcol, basecolor): halving add on the colour channels, alpha kept from rcol
+            uint32x4_t rcol = vld1q_u32(&gFramebufferCopy[ind + x]);
+            uint32x4_t bg = vbslq_u32(alpha, rcol, vreinterpretq_u32_u8(vhaddq_u8(vreinterpretq_u8_u32(rcol), base)));
+            vst1q_u32(&gFramebuffer[ind + x], vbslq_u32(vld1q_u32(&mask[x]), fg, bg));
+        }
+    }
+    enable_interrupts();
+}
+__attribute__((noinline)) static void screen_blit_row(uint32_t* dst, const uint32_t* src, uint32_t pixels)
+{
+    disable_interrupts();
+    uint32_t x = 0;
+    for (; x + 16 <= pixels; x += 16) {
+        uint32x4x4_t v = vld1q_u32_x4(&src[x]);
+        vst1q_u32_x4(&dst[x], v);
+    }
+    for (; x < pixels; x++) {
+        dst[x] = src[x];
+    }
+    enable_interrupts();
+}
+
+/*
+
+    Name: screen_scroll
+    Description: moves the text up by one text row. Only the text moves, so the text area is put back from the
+                 backdrop in gFramebufferCopy and the text cells are redrawn one row higher; the caller clears the
+                 last row. The whole text area is cleaned once through the damage tracking
+
+*/
+
+static void screen_scroll_nocache()
+{
+    uint32_t rowh = 1 + 8 * SCALE_FACTOR;
+    uint32_t gw = 8 * SCALE_FACTOR;
+    uint32_t end = y_cursor + rowh < gHeight ? y_cursor + rowh : gHeight;
+    for (uint32_t y = bannerHeight; y < end; y++) {
+        screen_blit_row(&gFramebuffer[y * gRowPixels], &gFramebufferCopy[y * gRowPixels], gWidth);
+    }
+    uint32_t rows = (y_cursor - bannerHeight) / rowh + 1;
+    if (rows > screen_cell_rows) rows = screen_cell_rows;
+    if (rows) {
+        memmove(screen_cells, screen_cells + screen_cell_cols, (rows - 1) * screen_cell_cols);
+        bzero(screen_cells + (rows - 1) * screen_cell_cols, screen_cell_cols);
+    }
+    for (uint32_t row = 0; row + 1 < rows; row++) {
+        for (uint32_t col = 0; col < screen_cell_cols; col++) {
+            uint8_t c = screen_cells[row * screen_cell_cols + col];
+            uint32_t x = LEFT_MARGIN + col * gw;
+            if (!c || x + gw > gWidth) continue;
+            const uint32_t* glyph = glyph_lookup(c);
+            if (!glyph) continue;
+            screen_draw_glyph(glyph, x, bannerHeight + row * rowh);
+        }
+    }
+    screen_damage(0, bannerHeight, gWidth, end - bannerHeight);
+}
+
+static void screen_putc_nocache(uint8_t c)
 {
-    if (!gFramebuffer) return;
     disable_interrupts();
     if (c == '\b') {
         if (x_cursor > 8 * SCALE_FACTOR) {
@@ -144,12 +364,16 @@ void screen_putc(uint8_t c)
     }
     if (c == '\n' || (x_cursor + (8 * SCALE_FACTOR)) > (gWidth - LEFT_MARGIN*2)) {
         if ((y_cursor + (12 * SCALE_FACTOR) + 16) > gHeight) {
-            y_cursor = bannerHeight;
+            if (overflow_mode == FB_OVERFLOW_SCROLL && screen_cells && y_cursor > bannerHeight) {
+                screen_scroll_nocache();
+            } else {
+                y_cursor = bannerHeight;
+            }
         } else {
             y_cursor += 1 + 8 * SCALE_FACTOR;
         }
         x_cursor = LEFT_MARGIN;
-        screen_clear_row();
+        screen_clear_row_nocache();
     }
     if (c == '\n') {
         enable_interrupts();
@@ -157,44 +381,61 @@ void screen_putc(uint8_t c)
     }
     if (c == '\r') {
         x_cursor = LEFT_MARGIN;
-        screen_clear_row();
+        screen_clear_row_nocache();
         enable_interrupts();
         return;
     }
     x_cursor += 8 * SCALE_FACTOR;
     volatile uint32_t local_x_cursor = x_cursor;
     volatile uint32_t local_y_cursor = y_cursor;
+    uint8_t* cell = screen_cell(x_cursor, y_cursor);
+    if (cell) *cell = c;
 
     enable_interrupts();
     // @squiffy, whenever you'll see this: tbt libmoonshine
-    for (int x = 0; x < (8 * SCALE_FACTOR); x++) {
-        for (int y = 0; y < (8 * SCALE_FACTOR); y++) {
-            if (font8x8_basic[c & 0x7f][y / SCALE_FACTOR] & (1 << (x / SCALE_FACTOR))) {
-                uint32_t ind = (x + local_x_cursor) + ((y + local_y_cursor) * gRowPixels);
-                uint32_t curcolor = basecolor;
-                curcolor ^= 0xFFFFFFFF;
-                gFramebuffer[ind] = curcolor;
-            } else {
-                uint32_t ind = (x + local_x_cursor) + ((y + local_y_cursor) * gRowPixels);
-                uint32_t rcol = gFramebufferCopy[ind];
-                gFramebuffer[ind] = colors_average(rcol, basecolor);
-            }
-        }
-    }
-    cache_clean(&gFramebuffer[y_cursor * gRowPixels], (1 + 8 * SCALE_FACTOR) * gRowPixels * 4);
+    const uint32_t* glyph = glyph_lookup(c);
+    if (!glyph) return;
+    screen_draw_glyph(glyph, local_x_cursor, local_y_cursor);
+    screen_damage(local_x_cursor, local_y_cursor, 8 * SCALE_FACTOR, 8 * SCALE_FACTOR);
+}
+void screen_putc(uint8_t c)
+{
+    if (!gFramebuffer) return;
+    screen_putc_nocache(c);
+    screen_flush();
+}
+// console sink: renders the whole span and leaves the cache maintenance to screen_flush
+void screen_write_span(const char* buf, size_t len)
+{
+    if (!gFramebuffer) return;
+    for (size_t i = 0; i < len; i++)
+        screen_putc_nocache(buf[i]);
 }
 void screen_write(const char* str)
 {
-    while (*str)
-        screen_putc(*str++);
+    screen_write_span(str, strlen(str));
+    screen_flush();
 }
 void screen_puts(const char* str)
 {
     screen_write(str);
     screen_putc('\n');
 }
+void screen_scroll_cmd(const char* cmd, char* args)
+{
+    if (!strcmp(args, "on")) {
+        overflow_mode = FB_OVERFLOW_SCROLL;
+    } else if (!strcmp(args, "off")) {
+        overflow_mode = FB_OVERFLOW_WRAP;
+    } else if (args[0]) {
+        iprintf("usage: fbscroll [on|off]\n");
+        return;
+    }
+    iprintf("framebuffer overflow: %s\n", overflow_mode == FB_OVERFLOW_SCROLL ? "scroll" : "wrap");
+}
 void screen_mark_banner() {
     bannerHeight = y_cursor;
+    if (screen_cells) bzero(screen_cells, screen_cell_cols * screen_cell_rows);
 }
 
 void screen_invert() {
@@ -205,7 +446,8 @@ void screen_invert() {
         }
     }
     basecolor ^= 0xffffffff;
-    cache_clean(gFramebuffer, gHeight * gRowPixels * 4);
+    screen_damage(0, 0, gWidth, gHeight);
+    screen_flush();
 }
 
 uint32_t gLogoBitmap[32] = { 0x0, 0xa00, 0x400, 0x5540, 0x7fc0, 0x3f80, 0x3f80, 0x1f00, 0x1f00, 0x1f00, 0x3f80, 0xffe0, 0x3f80, 0x3f80, 0x3f83, 0x103f9f, 0x18103ffb, 0xe3fffd5, 0x1beabfab, 0x480d7fd5, 0xf80abfab, 0x480d7fd5, 0x1beabfab, 0xe3fffd5, 0x18107ffb, 0x107fdf, 0x7fc3, 0xffe0, 0xffe0, 0xffe0, 0x1fff0, 0x1fff0 };
@@ -230,6 +472,11 @@ void screen_init() {
     map_range(0xfb0000000ULL, fbbase - fboff, fbsize, 3, 1, true);
     gFramebuffer = (uint32_t*)(0xfb0000000ULL + fboff);
     gFramebufferCopy = (uint32_t*)alloc_contig(fbsize);
+    // sized for the smallest font, larger scales use a corner of it
+    screen_cell_cols = gWidth / 8;
+    screen_cell_rows = gHeight / 9;
+    screen_cells = alloc_contig(screen_cell_cols * screen_cell_rows);
+    if (screen_cells) bzero(screen_cells, screen_cell_cols * screen_cell_rows);
 
     height &= 0xfff0;
     scale_factor = 2;
@@ -262,5 +509,7 @@ void screen_init() {
     cache_clean(gFramebuffer, gHeight * gRowPixels * 4);
     command_register("fbclear", "clears the framebuffer output (minus banner)", screen_clear_all);
     command_register("fbinvert", "inverts framebuffer contents", screen_invert);
+    command_register("fbscroll", "scroll instead of wrapping when the text reaches the bottom [on|off]", screen_scroll_cmd);
     scale_factor = 1;
+    glyph_lookup(0);
 }
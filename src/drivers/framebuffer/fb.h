@@ -24,11 +24,15 @@
  * SOFTWARE.
  * 
  */
+#include <stddef.h>
 #include <stdint.h>
 
 #define SCALE_FACTOR scale_factor
 #define LEFT_MARGIN 4 * scale_factor
 
+#define FB_OVERFLOW_WRAP   0
+#define FB_OVERFLOW_SCROLL 1
+
 extern char overflow_mode;
 extern uint32_t* gFramebuffer;
 extern uint32_t gWidth;
@@ -42,6 +46,8 @@ void screen_init();
 void screen_puts(const char* str);
 void screen_write(const char* str);
 void screen_putc(uint8_t c);
+void screen_write_span(const char* buf, size_t len);
+void screen_flush();
 void screen_clear_row();
 void screen_mark_banner();
 void screen_fill_basecolor();
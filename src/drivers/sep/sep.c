@@ -884,7 +884,11 @@ void seprom_artload() {
         iprintf("please upload an ART before issuing this command\n");
         return;
     }
-    seprom_load_art((void*)loader_xfer_recv_data, 0);
+    // the SEPROM is given a physical address, so it needs the ART in one piece
+    uint32_t size;
+    void* art = usbloader_copy_contig(&size);
+    seprom_load_art(art, 0);
+    free_contig(art, size);
 }
 void seprom_resume() {
     disable_interrupts();
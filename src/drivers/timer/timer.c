@@ -43,9 +43,136 @@ void timer_rearm() {
     set_timer_ctr(LLKTRW_QUANTA);
 }
 
+// fire once after `ticks`, used by the idle loop to sleep until the next deadline instead of the next quanta
+void timer_set_oneshot(uint64_t ticks) {
+    if (ticks > 0x7fffffff) ticks = 0x7fffffff; // TVAL is a signed 32bit downcounter
+    if (!ticks) ticks = 1;
+    set_timer_ctr(ticks);
+    set_timer_reg(1);
+}
+
 void timer_init() {
     set_timer_reg(2); // turn off timer
     set_timer_ctr(0xfffffff);
     set_timer_reg(1); // turn on timer
     timer_inited = 1;
 }
+
+/*
+
+    Name: timer service
+    Description: software timers multiplexed on the scheduler tick. Armed timers sit in a list sorted by deadline;
+                 the FIQ handler only checks the head and kicks the timer task, which runs the callbacks with
+                 interrupts enabled. The idle loop folds the earliest deadline into its one-shot, so a pending
+                 timer wakes the core up on time even while the periodic tick is off.
+
+*/
+
+static struct pongo_timer* timer_head;
+static struct task* timer_task;
+static struct irq_bottom_half timer_bh;
+
+static void timer_queue_remove(struct pongo_timer* t) {
+    if (!t->armed) return;
+    if (t->prev) t->prev->next = t->next;
+    else timer_head = t->next;
+    if (t->next) t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    t->armed = false;
+}
+
+static void timer_queue_insert(struct pongo_timer* t) {
+    struct pongo_timer* prev = NULL;
+    struct pongo_timer* cur = timer_head;
+    while (cur && cur->deadline <= t->deadline) { // FIFO among equal deadlines
+        prev = cur;
+        cur = cur->next;
+    }
+    t->prev = prev;
+    t->next = cur;
+    if (prev) prev->next = t;
+    else timer_head = t;
+    if (cur) cur->prev = t;
+    t->armed = true;
+}
+
+/*
+
+    Name: timer_arm_periodic
+    Description: arms t to call cb(ctx) from the timer task at deadline (get_ticks() units), then every period ticks
+                 if period is non-zero. Re-arming an armed timer moves it.
+
+*/
+
+void timer_arm_periodic(struct pongo_timer* t, uint64_t deadline, uint64_t period, void (*cb)(void* ctx), void* ctx) {
+    disable_interrupts();
+    timer_queue_remove(t);
+    t->deadline = deadline;
+    t->period = period;
+    t->cb = cb;
+    t->ctx = ctx;
+    timer_queue_insert(t);
+    enable_interrupts();
+}
+
+void timer_arm(struct pongo_timer* t, uint64_t deadline, void (*cb)(void* ctx), void* ctx) {
+    timer_arm_periodic(t, deadline, 0, cb, ctx);
+}
+
+/*
+
+    Name: timer_cancel
+    Description: disarms t; a callback that is already running is not waited for
+    Return values: true if the timer was armed
+
+*/
+
+bool timer_cancel(struct pongo_timer* t) {
+    disable_interrupts();
+    bool was_armed = t->armed;
+    timer_queue_remove(t);
+    enable_interrupts();
+    return was_armed;
+}
+
+uint64_t timer_next_deadline() {
+    return timer_head ? timer_head->deadline : 0;
+}
+
+// called from the FIQ handler
+void timer_service_tick(uint64_t now) {
+    if (timer_task && timer_head && timer_head->deadline <= now) {
+        irq_bottom_half_kick(&timer_bh);
+    }
+}
+
+static void timer_service_main() {
+    while (1) {
+        irq_bottom_half_wait(&timer_bh);
+        while (1) {
+            disable_interrupts();
+            struct pongo_timer* t = timer_head;
+            uint64_t now = get_ticks();
+            if (!t || t->deadline > now) {
+                enable_interrupts();
+                break;
+            }
+            timer_queue_remove(t);
+            void (*cb)(void*) = t->cb;
+            void* ctx = t->ctx;
+            if (t->period) {
+                t->deadline += t->period;
+                if (t->deadline <= now) t->deadline = now + t->period; // we fell behind, don't fire a burst
+                timer_queue_insert(t);
+            }
+            enable_interrupts();
+            cb(ctx); // may re-arm or cancel t, or free it if it's one-shot
+        }
+    }
+}
+
+void timer_service_init() {
+    timer_task = task_create_extended("timer", timer_service_main, TASK_PREEMPT|TASK_LINKED, 0);
+    task_set_priority(timer_task, TASK_PRIO_HIGH);
+}
+
@@ -28,3 +28,20 @@ void timer_init();
 void timer_rearm();
 void timer_disable();
 void timer_enable();
+void timer_set_oneshot(uint64_t ticks);
+
+struct pongo_timer {
+    uint64_t deadline; // get_ticks() units
+    uint64_t period;   // 0 for one-shot timers
+    void (*cb)(void* ctx);
+    void* ctx;
+    struct pongo_timer* next;
+    struct pongo_timer* prev;
+    bool armed;
+};
+void timer_service_init();
+void timer_service_tick(uint64_t now);
+uint64_t timer_next_deadline();
+void timer_arm(struct pongo_timer* t, uint64_t deadline, void (*cb)(void* ctx), void* ctx);
+void timer_arm_periodic(struct pongo_timer* t, uint64_t deadline, uint64_t period, void (*cb)(void* ctx), void* ctx);
+bool timer_cancel(struct pongo_timer* t);
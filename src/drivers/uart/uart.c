@@ -27,38 +27,71 @@
 #define UART_INTERNAL 1
 #include <pongo.h>
 
-char uart_queue[64];
-uint8_t uart_queue_idx;
+/*
+
+    Name: uart tx ring
+    Description: serial_putc queues into this ring and tops up the hardware FIFO; the UART IRQ task refills the FIFO
+                 from the TX threshold interrupt, so printing doesn't spin on the line rate. Whenever no IRQ task can
+                 run (early boot, panic, after teardown: preemption_over is set) output goes out synchronously, after
+                 draining whatever was still queued so ordering is kept.
+
+*/
+
+#define UART_TX_RING_SIZE 0x1000 // power of two
+static char uart_tx_ring[UART_TX_RING_SIZE];
+static uint32_t uart_tx_head, uart_tx_tail;
+static bool uart_tx_irq_ready;
+
+void uart_update_tx_irq() {
+    if (uart_tx_head == uart_tx_tail)
+        rUCON0 &= ~UCON_TXTHRESH_ENA;
+    else
+        rUCON0 |= UCON_TXTHRESH_ENA;
+}
+
+// moves as much as fits from the ring into the FIFO, with interrupts held
 void uart_flush() {
-    if (!uart_queue_idx) return;
-    int local_queue_idx = 0;
-    while (rUTRSTAT0 & 0x04)
-    {
-        if (local_queue_idx == uart_queue_idx) break;
-        rUTXH0 = (unsigned)(uart_queue[local_queue_idx]);
-        local_queue_idx++;
+    while (uart_tx_tail != uart_tx_head && !(rUFSTAT0 & UFSTAT_TXFULL)) {
+        rUTXH0 = (unsigned)(uart_tx_ring[uart_tx_tail & (UART_TX_RING_SIZE - 1)]);
+        uart_tx_tail++;
     }
-    if (!local_queue_idx) return;
+}
 
-    if (local_queue_idx != uart_queue_idx) {
-        memcpy(&uart_queue[0], &uart_queue[local_queue_idx], uart_queue_idx - local_queue_idx);
+// drains the ring synchronously, for panic paths and teardown
+void uart_force_flush() {
+    if (!gUartBase) return;
+    disable_interrupts();
+    while (uart_tx_tail != uart_tx_head) {
+        while (rUFSTAT0 & UFSTAT_TXFULL) {}
+        uart_flush();
     }
-    uart_queue_idx -= local_queue_idx;
+    uart_update_tx_irq();
+    enable_interrupts();
 }
-void uart_force_flush() {
-    for (int i = 0; i < uart_queue_idx; i++) {
-        while (!(rUTRSTAT0 & 0x04)) {}
-        rUTXH0 = (unsigned)(uart_queue[i]);
+
+static void uart_putc_sync(char c) {
+    while (rUFSTAT0 & UFSTAT_TXFULL) {}
+    rUTXH0 = (unsigned)(c);
+}
+
+// with interrupts held
+static void uart_tx_enqueue(char c) {
+    while (uart_tx_head - uart_tx_tail >= UART_TX_RING_SIZE) { // full, fall back to spinning on the line rate
+        while (rUFSTAT0 & UFSTAT_TXFULL) {}
+        uart_flush();
     }
-    uart_queue_idx = 0;
+    uart_tx_ring[uart_tx_head & (UART_TX_RING_SIZE - 1)] = c;
+    uart_tx_head++;
 }
-void uart_update_tx_irq() {
-    return;
-    if (!uart_queue_idx)
-        rUCON0 = 0x5885;
-    else
-        rUCON0 = 0x5F85;
+
+static void uart_putc_queued(char c) {
+    disable_interrupts();
+    uart_tx_enqueue(c);
+    uart_flush();
+    uart_update_tx_irq();
+    enable_interrupts();
 }
+
 uint32_t uart_should_drop_rx;
 extern void queue_rx_char(char inch);
 void uart_main() {
@@ -66,10 +99,14 @@ void uart_main() {
         disable_interrupts();
         uint32_t utrst = rUTRSTAT0;
         rUTRSTAT0 = utrst;
+        if (utrst & UTRSTAT_TXTHRESH) {
+            uart_flush();
+            uart_update_tx_irq();
+        }
         if (utrst & 0x40) {
             (void)rURXH0; // force read
         } else
-        if (utrst & 1) {
+        while (rUFSTAT0 & (UFSTAT_RXCOUNT | UFSTAT_RXFULL)) { // the RX FIFO can hold more than one byte now
             int rxh0 = rURXH0;
             if (!uart_should_drop_rx) {
                 char cmd_l = rxh0;
@@ -102,7 +139,7 @@ void serial_early_init() {
     orig_rUMCON0 = rUMCON0;
     rULCON0 = 3;
     rUCON0 = 0x405;
-    rUFCON0 = 0;
+    rUFCON0 = UFCON_FIFO_ENABLE | UFCON_RXFIFO_RESET | UFCON_TXFIFO_RESET;
     rUMCON0 = 0;
     char reorder[6] = {'1','3','2','6','4','5'};
     char modifier[] = {'\x1b', '[', '4', '1', ';', '1', 'm', 0};
@@ -150,9 +187,12 @@ void serial_init() {
     serial_disable_rx();
     task_bind_to_irq(irq_task, uart_irq);
     rUCON0 = 0x5885;
+    uart_tx_irq_ready = true;
     enable_interrupts();
 }
 void serial_teardown(void) {
+    uart_force_flush();
+    uart_tx_irq_ready = false;
     // Restore state set by iBoot
     rUCON0  = orig_rUCON0;
     rULCON0 = orig_rULCON0;
@@ -162,7 +202,32 @@ void serial_teardown(void) {
 void serial_putc(char c) {
     if (c == '\n') serial_putc('\r');
     if (!gUartBase) return;
-    while (!(rUTRSTAT0 & 0x04)) {}
-    rUTXH0 = (unsigned)(c);
-    return;
+    extern char preemption_over;
+    if (uart_tx_irq_ready && !preemption_over) {
+        uart_putc_queued(c);
+        return;
+    }
+    if (uart_tx_head != uart_tx_tail) uart_force_flush();
+    uart_putc_sync(c);
+}
+
+// console sink: queues a whole span with interrupts taken once
+void serial_write(const char* buf, size_t len) {
+    if (!gUartBase) return;
+    extern char preemption_over;
+    if (!uart_tx_irq_ready || preemption_over) {
+        for (size_t i = 0; i < len; i++) {
+            if (buf[i] == '\0') serial_putc('\r');
+            serial_putc(buf[i]);
+        }
+        return;
+    }
+    disable_interrupts();
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == '\0' || buf[i] == '\n') uart_tx_enqueue('\r');
+        uart_tx_enqueue(buf[i]);
+    }
+    uart_flush();
+    uart_update_tx_irq();
+    enable_interrupts();
 }
@@ -28,9 +28,11 @@ void serial_init();
 void serial_early_init();
 void serial_pinmux_init();
 void serial_putc(char c);
+void serial_write(const char* buf, size_t len);
 void serial_disable_rx();
 void serial_enable_rx();
 void uart_flush();
+void uart_force_flush();
 void serial_teardown(void);
 
 #ifdef UART_INTERNAL
@@ -48,6 +50,15 @@ void serial_teardown(void);
 #define rUDIVSLOT0  (*(volatile uint32_t*)(gUartBase + 0x2C))  //UART 0 Baud rate divisor
 #define rUINTM0     (*(volatile uint32_t*)(gUartBase + 0x38))  //UART 0 Baud rate divisor
 
+#define UFCON_FIFO_ENABLE   0x1
+#define UFCON_RXFIFO_RESET  0x2
+#define UFCON_TXFIFO_RESET  0x4
+#define UFSTAT_RXCOUNT      0xf
+#define UFSTAT_RXFULL       (1 << 8)
+#define UFSTAT_TXFULL       (1 << 9)
+#define UCON_TXTHRESH_ENA   (1 << 13) // interrupt once the TX FIFO drains below its trigger level
+#define UTRSTAT_TXTHRESH    (1 << 5)
+
 #define rT8011RX    (*(volatile uint32_t*)(gGpioBase + 0x2A0))
 #define rT8011TX    (*(volatile uint32_t*)(gGpioBase + 0x2A4))
 #define UART_TX_MUX 0x8723A0
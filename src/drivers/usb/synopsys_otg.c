@@ -153,6 +153,7 @@ struct full_configuration_descriptor {
 	struct interface_descriptor     interface;
 	struct endpoint_descriptor      endpoint_81;
 	struct endpoint_descriptor      endpoint_02;
+	struct endpoint_descriptor      endpoint_83;
 } __attribute__((packed));
 
 struct full_configuration_descriptor configuration_descriptor = {
@@ -171,7 +172,7 @@ struct full_configuration_descriptor configuration_descriptor = {
 		.bDescriptorType    = 4,
 		.bInterfaceNumber   = 0,
 		.bAlternateSetting  = 0,
-	        .bNumEndpoints      = 2,
+	        .bNumEndpoints      = 3,
 		.bInterfaceClass    = 0xfe,
 		.bInterfaceSubClass = 0x13,
 		.bInterfaceProtocol = 0x37,
@@ -193,6 +194,14 @@ struct full_configuration_descriptor configuration_descriptor = {
 	        .wMaxPacketSize   = BULK_EP_MAX_PACKET_SIZE,
 	        .bInterval        = 0,
 	},
+	.endpoint_83 = {
+	        .bLength          = sizeof(configuration_descriptor.endpoint_83),
+	        .bDescriptorType  = 5,
+	        .bEndpointAddress = 0x83,    // IN, streamed stdout
+	        .bmAttributes     = 2,        // Bulk
+	        .wMaxPacketSize   = BULK_EP_MAX_PACKET_SIZE,
+	        .bInterval        = 0,
+	},
 };
 
 // ---- The KTRW USB API --------------------------------------------------------------------------
@@ -545,6 +554,7 @@ static struct endpoint_state ep0_in;
 static struct endpoint_state ep0_out;
 static struct endpoint_state ep1_in;
 static struct endpoint_state ep2_out;
+static struct endpoint_state ep3_in;
 
 // ---- Low-level transfer API for IN endpoints ---------------------------------------------------
 
@@ -713,6 +723,24 @@ ep_in_send_data(struct endpoint_state *ep, const void *data, uint32_t size) {
 	ep_in_send(ep);
 }
 
+// Send data on an IN endpoint using direct DMA out of the caller's buffer. The buffer must be
+// physically contiguous and readable up to the next multiple of the packet size, since the DMA
+// buffer size has to be a whole number of packets.
+static void
+ep_in_send_data_dma(struct endpoint_state *ep, const void *data, uint32_t dma, uint32_t size) {
+    if (ep->dir_in != 1 || ep->transfer_size != ep->transferred || ep->in_flight != 0
+            || ep->type == 0 || data == NULL || size == 0 || size > 0x7ffff + 1 - ep->max_packet_size) {
+        BUG(0x73656e642036);    // 'send 6'
+    }
+    ep->xfer_dma_data = (uint8_t *) data;
+    ep->xfer_dma_size = (size + ep->max_packet_size - 1) & ~(uint32_t) (ep->max_packet_size - 1);
+    ep->xfer_dma_phys = dma;
+    ep->transfer_data = (uint8_t *) data;
+    ep->transfer_size = size;
+    ep->transferred = 0;
+    ep_in_send(ep);
+}
+
 // ---- Low-level transfer API for OUT endpoints --------------------------------------------------
 
 // The code for EP 0 OUT is structured a bit differently from that for IN endpoints above. The
@@ -1170,12 +1198,15 @@ usb_set_address(uint8_t address) {
 	dcfg = (dcfg & ~0x7f0) | (((uint32_t) address << 4) & 0x7f0);
 	reg_write(rDCFG, dcfg);
 }
+static void usb_reset_stream(void);
+
 __attribute__((used)) static void
 usb_reset() {
     USB_DEBUG(USB_DEBUG_FUNC, "Reset");
     ep_in_abort(&ep0_in);
     ep_in_abort(&ep1_in);
     ep_in_abort(&ep2_out);
+    ep_in_abort(&ep3_in);
     usb_set_address(0);
     reg_write(rDOEPMSK, 0);
     reg_write(rDIEPMSK, 0);
@@ -1202,6 +1233,10 @@ usb_reset() {
     ep_type = configuration_descriptor.endpoint_02.bmAttributes;
     ep_mps = configuration_descriptor.endpoint_02.wMaxPacketSize;
     ep_out_activate(&ep2_out, 2, ep_type, ep_mps);
+    ep_type = configuration_descriptor.endpoint_83.bmAttributes;
+    ep_mps = configuration_descriptor.endpoint_83.wMaxPacketSize;
+    ep_in_activate(&ep3_in, 3, ep_type, ep_mps, 3);
+    usb_reset_stream();
     ep_out_recv(&ep0_out);
 }
 
@@ -1224,6 +1259,8 @@ struct transfer_state {
         // enough or because the host ended it earlier than expected).
         void (*out_transfer_done)(void *data, uint32_t size, uint32_t transferred);
     };
+    // The future to complete for transfers started through the _async variants.
+    struct pongo_future *done_future;
 };
 
 // State for IN/OUT EP 0 control transfers.
@@ -1232,6 +1269,7 @@ static struct control_transfer_state ep0;
 // State for other endpoints.
 struct transfer_state ep1;
 struct transfer_state ep2;
+struct transfer_state ep3;
 
 // You may try to send more data than was requested, but the request will be truncated to the size
 // requested by the host.
@@ -1273,6 +1311,9 @@ lookup_endpoint(uint8_t ep_addr, int dir_in,
         if (ep_addr == 0x81) {
             *ep = &ep1_in;
             *state = &ep1;
+        } else if (ep_addr == 0x83) {
+            *ep = &ep3_in;
+            *state = &ep3;
         }
     } else {
         if (ep_addr == 0x02) {
@@ -1300,6 +1341,32 @@ usb_in_transfer(uint8_t ep_addr, const void *data, uint32_t size, void (*callbac
     ep_in_send_data(ep, data, size);
 }
 
+// Whatever was in flight on EP 3 IN is gone after a reset, and the next host may not read it at
+// all, so drop the callback and let the stdout stream start over.
+static void
+usb_reset_stream(void) {
+    ep3.in_transfer_done = NULL;
+    usb_stdout_stream_reset();
+    usb_upload_target_reset();
+}
+
+// Like usb_in_transfer(), but DMA straight out of data (physical address dma) instead of
+// bouncing through the endpoint's default DMA buffer. See ep_in_send_data_dma().
+void
+usb_in_transfer_dma(uint8_t ep_addr, const void *data, uint32_t dma, uint32_t size, void (*callback)(void)) {
+    struct endpoint_state *ep = NULL;
+    struct transfer_state *state = NULL;
+    lookup_endpoint(ep_addr, 1, &ep, &state);
+    if (ep == NULL) {
+        BUG(0x6e6f206570);    // 'no ep'
+    }
+    if (state->in_transfer_done != NULL) {
+        BUG(0x636220736574);    // 'cb set'
+    }
+    state->in_transfer_done = callback;
+    ep_in_send_data_dma(ep, data, dma, size);
+}
+
 void
 usb_out_transfer(uint8_t ep_addr, void *data, uint32_t size,
         void (*callback)(void *, uint32_t, uint32_t)) {
@@ -1334,6 +1401,46 @@ usb_out_transfer_dma(uint8_t ep_addr, void *data, uint32_t dma, uint32_t size,
     ep_out_recv_data_dma(ep, data, dma, size);
 }
 
+// Future-based variants of the above. The future is (re)initialized here and completed from the
+// endpoint interrupt with the number of bytes transferred, so the caller can await it or chain a
+// continuation instead of juggling a callback and a busy flag. Like the callbacks, only one
+// transfer per endpoint can be outstanding.
+static void
+ep1_in_future_done(void) {
+    struct pongo_future *f = ep1.done_future;
+    ep1.done_future = NULL;
+    future_complete(f, ep1_in.transferred);
+}
+
+static void
+ep2_out_future_done(void *data, uint32_t size, uint32_t transferred) {
+    cache_invalidate(data, transferred);
+    struct pongo_future *f = ep2.done_future;
+    ep2.done_future = NULL;
+    future_complete(f, transferred);
+}
+
+void
+usb_in_transfer_async(uint8_t ep_addr, const void *data, uint32_t size, struct pongo_future *done) {
+    if (ep_addr != 0x81) {
+        BUG(0x6e6f206570);    // 'no ep'
+    }
+    future_init(done);
+    ep1.done_future = done;
+    usb_in_transfer(ep_addr, data, size, ep1_in_future_done);
+}
+
+void
+usb_out_transfer_dma_async(uint8_t ep_addr, void *data, uint32_t dma, uint32_t size,
+        struct pongo_future *done) {
+    if (ep_addr != 0x02) {
+        BUG(0x6e6f206570);    // 'no ep'
+    }
+    future_init(done);
+    ep2.done_future = done;
+    usb_out_transfer_dma(ep_addr, data, dma, size, ep2_out_future_done);
+}
+
 // ---- USB interrupt handling --------------------------------------------------------------------
 
 // This is the API we export to the layer above:
@@ -1634,6 +1741,31 @@ ep1_in_interrupt() {
 	}
 }
 
+static void
+ep3_in_interrupt() {
+    uint32_t diepint = reg_read(rDIEPINT(3));
+    reg_write(rDIEPINT(3), diepint);
+    USB_DEBUG(USB_DEBUG_INTR, "DIEPINT(3) %x", diepint);
+    if (diepint & 0x1) {
+        bool done = ep_in_send_done(&ep3_in);
+        if (done) {
+            USB_DEBUG(USB_DEBUG_APP, "EP%u IN done", ep3_in.n);
+            if (ep3.in_transfer_done == NULL) {
+                BUG(0x6e6f203369206362);    // 'no 3i cb'
+            }
+            void (*in_transfer_done)(void) = ep3.in_transfer_done;
+            ep3.in_transfer_done = NULL;
+            in_transfer_done();
+        }
+    }
+    if (diepint & 0x8) {
+        USB_DEBUG(USB_DEBUG_STAGE | USB_DEBUG_INTR, "TIMEOUT");
+        USB_DEBUG_ABORT();
+    }
+    if (diepint & 0x4) {
+        BUG(0x61686220696e2033);    // 'ahb in 3'
+    }
+}
 
 static void
 ep2_out_interrupt() {
@@ -1678,6 +1810,9 @@ usb_ep_interrupt() {
     if (daint & (1 << (1))) {
         ep1_in_interrupt();
     }
+    if (daint & (1 << (3))) {
+        ep3_in_interrupt();
+    }
     if (daint & (1 << (16 + 0))) {
         ep0_out_interrupt();
     }
@@ -1721,6 +1856,30 @@ void usb_main_nonirq() {
 }
 
 
+// ep0 request handlers re-enable interrupts, take locks and may block (usb_write_stdin),
+// so the controller is drained from the bottom-half task rather than inline. Both tasks
+// run at TASK_PRIO_IRQ, so irq_exc switches to them before returning to the interrupted task.
+static struct irq_bottom_half usb_bh;
+
+static int usb_top_half(uint32_t irq, void* ctx) {
+    if (usb_usbtask_handoff_mode) {
+        if (usbtask_niq->flags & TASK_LINKED) panic("USB: spurious IRQ");
+        task_link(usbtask_niq);
+        return IRQ_KEEP_MASKED; // usb_main_nonirq unmasks once it drained the controller
+    }
+    return IRQ_WAKE_BOTTOM | IRQ_KEEP_MASKED;
+}
+
+static void usb_bottom_half() {
+    while (1) {
+        irq_bottom_half_wait(&usb_bh);
+        disable_interrupts();
+        usb_handler();
+        unmask_interrupt(usb_irq);
+        enable_interrupts();
+    }
+}
+
 void usb_main() {
     while (1) {
         if (usb_usbtask_handoff_mode && usb_irq_mode) {
@@ -1805,10 +1964,10 @@ void usb_init() {
     reg3 = gIOBase + regs.reg3;
     otg_irq = regs.otg_irq;
 
-    uint64_t dma_page_v = (uint64_t) alloc_contig(4 * DMA_BUFFER_SIZE);
+    uint64_t dma_page_v = (uint64_t) alloc_contig(5 * DMA_BUFFER_SIZE);
     uint64_t dma_page_p = vatophys_static((void*)dma_page_v);
-    bzero((void*)dma_page_v,4 * DMA_BUFFER_SIZE);
-    cache_clean_and_invalidate((void*)dma_page_v, 4 * DMA_BUFFER_SIZE);
+    bzero((void*)dma_page_v,5 * DMA_BUFFER_SIZE);
+    cache_clean_and_invalidate((void*)dma_page_v, 5 * DMA_BUFFER_SIZE);
 
     disable_interrupts();
     usb_irq_mode = 1;
@@ -1846,6 +2005,9 @@ void usb_init() {
     ep2_out.default_xfer_dma_data = (void *)   (dma_page_v + 3 * DMA_BUFFER_SIZE);
     ep2_out.default_xfer_dma_phys = (uint32_t) (dma_page_p + 3 * DMA_BUFFER_SIZE);
     ep2_out.default_xfer_dma_size = DMA_BUFFER_SIZE;
+    ep3_in .default_xfer_dma_data = (void *)   (dma_page_v + 4 * DMA_BUFFER_SIZE);
+    ep3_in .default_xfer_dma_phys = (uint32_t) (dma_page_p + 4 * DMA_BUFFER_SIZE);
+    ep3_in .default_xfer_dma_size = DMA_BUFFER_SIZE;
 
     *(volatile uint32_t*)(gSynopsysOTGBase + 0x4) |= 2;
 
@@ -1853,11 +2015,15 @@ void usb_init() {
         usbtask_niq = alloc_contig(sizeof(struct task));
         strcpy(usbtask_niq->name, "usbtask");
         task_register_unlinked(usbtask_niq, usb_main_nonirq);
+        task_set_priority(usbtask_niq, TASK_PRIO_IRQ);
     }
     usb_irq = 0;
     if (usb_irq_mode) {
         usb_irq = otg_irq;
-        task_register_preempt_irq(&usb_task, usb_main, usb_irq);
+        task_register_unlinked(&usb_task, usb_bottom_half);
+        task_set_priority(&usb_task, TASK_PRIO_IRQ);
+        task_link(&usb_task);
+        irq_register_top_half(usb_irq, "usb", usb_top_half, NULL, &usb_bh);
     }
     else task_register(&usb_task, usb_main);
     enable_interrupts();
@@ -132,5 +132,11 @@ extern void ep0_begin_data_out_stage(bool (*callback)(const void *data, uint32_t
 extern size_t usb_read(void *data, size_t size);
 extern size_t usb_write(const void *data, size_t size);
 extern void usb_in_transfer(uint8_t ep_addr, const void *data, uint32_t size, void (*callback)(void));
+extern void usb_in_transfer_dma(uint8_t ep_addr, const void *data, uint32_t dma, uint32_t size, void (*callback)(void));
+extern void usb_stdout_stream_reset();
+extern void usb_upload_target_reset();
 extern void usb_out_transfer(uint8_t ep_addr, void *data, uint32_t size, void (*callback)(void *data, uint32_t size, uint32_t transferred));
 extern void usb_out_transfer_dma(uint8_t ep_addr, void *data, uint32_t dma, uint32_t size, void (*callback)(void *data, uint32_t size, uint32_t transferred));
+struct pongo_future;
+extern void usb_in_transfer_async(uint8_t ep_addr, const void *data, uint32_t size, struct pongo_future *done);
+extern void usb_out_transfer_dma_async(uint8_t ep_addr, void *data, uint32_t dma, uint32_t size, struct pongo_future *done);
@@ -1483,6 +1483,9 @@ PONGO_EXPORT(task_restart_and_link);
 PONGO_EXPORT(task_critical_enter);
 PONGO_EXPORT(task_critical_exit);
 PONGO_EXPORT(task_bind_to_irq);
+PONGO_EXPORT(irq_register_top_half);
+PONGO_EXPORT(irq_bottom_half_kick);
+PONGO_EXPORT(irq_bottom_half_wait);
 PONGO_EXPORT(task_release);
 PONGO_EXPORT(task_reference);
 PONGO_EXPORT(tz0_calculate_encrypted_block_addr);
@@ -1514,6 +1517,21 @@ PONGO_EXPORT(task_exit_irq);
 PONGO_EXPORT(task_switch);
 PONGO_EXPORT(task_link);
 PONGO_EXPORT(task_unlink);
+PONGO_EXPORT(task_set_priority);
+PONGO_EXPORT(cpu_number);
+PONGO_EXPORT(pongo_cpus_online);
+PONGO_EXPORT(smp_start_secondaries);
+PONGO_EXPORT(task_group_init);
+PONGO_EXPORT(task_group_spawn);
+PONGO_EXPORT(task_group_join);
+PONGO_EXPORT(pongo_parallel_for);
+PONGO_EXPORT(lock_try);
+PONGO_EXPORT(rwlock_read_take);
+PONGO_EXPORT(rwlock_write_take);
+PONGO_EXPORT(rwlock_read_try);
+PONGO_EXPORT(rwlock_write_try);
+PONGO_EXPORT(rwlock_read_release);
+PONGO_EXPORT(rwlock_write_release);
 PONGO_EXPORT(task_irq_dispatch);
 PONGO_EXPORT(task_yield_asserted);
 PONGO_EXPORT(task_register_unlinked);
@@ -1521,6 +1539,32 @@ PONGO_EXPORT(panic);
 PONGO_EXPORT(spin);
 PONGO_EXPORT(get_ticks);
 PONGO_EXPORT(usleep);
+PONGO_EXPORT(task_sleep_until);
+PONGO_EXPORT(event_wait_timeout);
+PONGO_EXPORT(semaphore_init);
+PONGO_EXPORT(semaphore_wait);
+PONGO_EXPORT(semaphore_wait_timeout);
+PONGO_EXPORT(semaphore_try);
+PONGO_EXPORT(semaphore_signal);
+PONGO_EXPORT(condvar_init);
+PONGO_EXPORT(condvar_wait);
+PONGO_EXPORT(condvar_wait_timeout);
+PONGO_EXPORT(condvar_signal);
+PONGO_EXPORT(condvar_broadcast);
+PONGO_EXPORT(future_init);
+PONGO_EXPORT(future_pending);
+PONGO_EXPORT(future_complete);
+PONGO_EXPORT(future_then);
+PONGO_EXPORT(future_await);
+PONGO_EXPORT(future_await_timeout);
+PONGO_EXPORT(future_sleep);
+PONGO_EXPORT(future_cancel);
+PONGO_EXPORT(future_event);
+PONGO_EXPORT(usb_in_transfer_async);
+PONGO_EXPORT(usb_out_transfer_dma_async);
+PONGO_EXPORT(timer_arm);
+PONGO_EXPORT(timer_arm_periodic);
+PONGO_EXPORT(timer_cancel);
 PONGO_EXPORT(sleep);
 PONGO_EXPORT(dt_get_prop);
 PONGO_EXPORT(dt_get_u32_prop);
@@ -1538,6 +1582,7 @@ PONGO_EXPORT(hexprint);
 PONGO_EXPORT(get_el);
 PONGO_EXPORT(cache_invalidate);
 PONGO_EXPORT(cache_clean_and_invalidate);
+PONGO_EXPORT(cache_clean_rect);
 PONGO_EXPORT(register_irq_handler);
 PONGO_EXPORT(device_clock_by_id);
 PONGO_EXPORT(device_clock_by_name);
@@ -1545,6 +1590,9 @@ PONGO_EXPORT(clock_gate);
 PONGO_EXPORT(disable_interrupts);
 PONGO_EXPORT(enable_interrupts);
 PONGO_EXPORT(alloc_contig);
+PONGO_EXPORT(pongo_meminfo_collect);
+PONGO_EXPORT(pongo_trace_enabled);
+PONGO_EXPORT(pongo_trace_record);
 PONGO_EXPORT(alloc_phys);
 PONGO_EXPORT(map_physical_range);
 PONGO_EXPORT(task_vm_space);
@@ -1576,6 +1624,15 @@ PONGO_EXPORT(soc_name);
 PONGO_EXPORT(socnum);
 PONGO_EXPORT(loader_xfer_recv_data);
 PONGO_EXPORT(loader_xfer_recv_count);
+PONGO_EXPORT(usbloader_wait_upload);
+PONGO_EXPORT(usbloader_copy_contig);
+PONGO_EXPORT(upload_ready);
+PONGO_EXPORT(upload_take);
+PONGO_EXPORT(upload_release);
+PONGO_EXPORT(upload_grow);
+PONGO_EXPORT(stdout_dropped);
+PONGO_EXPORT(console_sink_register);
+PONGO_EXPORT(console_sink_set_enabled);
 PONGO_EXPORT(preboot_hook);
 PONGO_EXPORT(ramdisk_buf);
 PONGO_EXPORT(ramdisk_size);
@@ -1671,3 +1728,39 @@ void pongo_module_print_list() {
         cur = cur->next;
     }
 }
+size_t pongo_module_map(struct pongo_module_map_entry* out, size_t max) {
+    size_t n = 0;
+    disable_interrupts();
+    for (struct pongo_module_info* cur = head; cur && n < max; cur = cur->next) {
+        if (!cur->name) continue; // still being linked
+        out[n].vm_base = cur->vm_base;
+        out[n].vm_end = cur->vm_end;
+        bzero(out[n].name, sizeof(out[n].name));
+        strncpy(out[n].name, cur->name, sizeof(out[n].name) - 1);
+        n++;
+    }
+    enable_interrupts();
+    return n;
+}
+void pongo_module_footprint(uint64_t* count, uint64_t* bytes) {
+    uint64_t c = 0, b = 0;
+    disable_interrupts();
+    for (struct pongo_module_info* cur = head; cur; cur = cur->next) {
+        c++;
+        b += cur->vm_end - cur->vm_base;
+    }
+    enable_interrupts();
+    *count = c;
+    *bytes = b;
+}
+void pongo_module_print_footprint() {
+    struct pongo_module_info* cur = head;
+    while (cur) {
+        uint64_t mapped = 0;
+        for (uint32_t i = 0; i < cur->segcount; i++) {
+            mapped += cur->segments[i].vm_size;
+        }
+        iprintf(" | %26s: 0x%llx bytes reserved, 0x%llx in segments\n", cur->name, cur->vm_end - cur->vm_base, mapped);
+        cur = cur->next;
+    }
+}
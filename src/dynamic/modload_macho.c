@@ -34,11 +34,24 @@ void* resolve_symbol(const char* name);
 
 void link_exports(struct pongo_exports* export);
 
-void modload_cmd() {
+void modload_cmd(const char* cmd, char* args) {
         iprintf("[modload_macho:i] Attempting to load a module\n");
-        if (loader_xfer_recv_count >= 0x4000) {
-            //iprintf("enough bytes! %x\n", loader_xfer_recv_count);
-            struct mach_header_64* mh = (void*) loader_xfer_recv_data;
+        // "modload x" loads what was uploaded to the module:x slot, plain "modload" the default upload
+        struct upload_buffer* upload = NULL;
+        if (args && args[0]) {
+            char slot[UPLOAD_SLOT_NAME_MAX];
+            snprintf(slot, sizeof(slot), "module:%s", args);
+            upload = upload_take(slot);
+            if (!upload) {
+                iprintf("[modload_macho:!] load module: nothing in slot %s\n", slot);
+                return;
+            }
+        }
+        uint8_t* data = upload ? upload->data : loader_xfer_recv_data;
+        uint32_t count = upload ? upload->count : loader_xfer_recv_count;
+        if (count >= 0x4000) {
+            //iprintf("enough bytes! %x\n", count);
+            struct mach_header_64* mh = (void*) data;
             struct load_command* lc = (struct load_command*) (mh + 1);
             if (mh->magic == MH_MAGIC_64) {
                 //puts("it's a mach-o!");
@@ -67,8 +80,8 @@ void modload_cmd() {
                         lc = (struct load_command*)(((char*)lc) + lc->cmdsize);
                     }
                     vmsz_needed -= base_vmaddr;
-                    //iprintf("need %llx, got %llx\n", filesz_expected, loader_xfer_recv_count);
-                    if (!(filesz_expected > loader_xfer_recv_count)) {
+                    //iprintf("need %llx, got %llx\n", filesz_expected, count);
+                    if (!(filesz_expected > count)) {
                         uint64_t entrypoint = 0;
                         uint8_t * allocto = alloc_contig((vmsz_needed + 0x3FFF) & ~0x3FFF);
                         uint64_t vma_base = linear_kvm_alloc(vmsz_needed);
@@ -88,7 +101,7 @@ void modload_cmd() {
                                 info->vm_size = sg->vmsize;
 
                                 memset(allocto + sg->vmaddr - base_vmaddr, 0, sg->vmsize);
-                                memcpy(allocto + sg->vmaddr - base_vmaddr, loader_xfer_recv_data + sg->fileoff, sg->filesize);
+                                memcpy(allocto + sg->vmaddr - base_vmaddr, data + sg->fileoff, sg->filesize);
                                 
                                 vm_protect_t prots = 0;
                                 prots |= sg->initprot & VM_PROT_READ ? PROT_READ : 0;
@@ -146,6 +159,7 @@ void modload_cmd() {
                             void* symbol_value = resolve_symbol(name);
                             if (symbol_value == 0) {
                                 puts("[modload_macho:!] load module: linking failed");
+                                upload_release(upload);
                                 return;
                             }
                             // Find the offset of the relocation pointer in the virtually mapped Mach-O and
@@ -178,10 +192,12 @@ void modload_cmd() {
 
                         module->name = strdup(modname ? *modname ? *modname : "<null>" : "<unknown>");
                         module->exports = exports;
+                        PONGO_TRACE(PONGO_TRACE_MODULE_LOAD, module->vm_base, module->vm_end - module->vm_base);
                         ((void (*)())entrypoint)();
                     } else puts ("[modload_macho:!] load module: truncated load");
                 } else puts("[modload_macho:!] load module: need dylib");
             } else puts("[modload_macho:!] load module: not mach-o");
         } else puts("[modload_macho:!] load module: short read");
-        loader_xfer_recv_count = 0;
+        if (upload) upload_release(upload);
+        else loader_xfer_recv_count = 0;
 }
@@ -42,12 +42,19 @@ struct task pongo_task = {.name = "main"};
 /*
 
     Name: pongo_fiq_handler
-    Description: called every LLKTRW_QUANTA (1ms at the time of writing this)
+    Description: called every LLKTRW_QUANTA (1ms at the time of writing this). Every core gets its own tick for
+                 preemption, sleepers and timers are only serviced on the boot core.
 
 */
 
 int pongo_fiq_handler() {
     timer_rearm();
+    if (cpu_number()) return !!(task_current()->flags & TASK_PREEMPT);
+    task_sleep_tick();
+    uint64_t now = get_ticks();
+    timer_service_tick(now);
+    extern void sched_idle_account(uint64_t now, uint64_t idle);
+    sched_idle_account(now, 0); // rolls the idle/busy window while we are fully busy
     return !!(task_current()->flags & TASK_PREEMPT);
 }
 
@@ -66,49 +73,110 @@ __attribute__((noinline)) void pongo_reinstall_vbar() {
 
     Name: pongo_sched_tick
     Description: every time we return from an exception back into the sched task, this function is invoked
-    Return values: 0 if a task got volountarily yielded or we did not schedule, 1 if we got preempted, 2 if we looped around list
+    Return values: 0 if a task got volountarily yielded, 1 if we got preempted, 2 if nothing was runnable
 
 */
 
-extern void _task_switch(struct task* new);
-extern void _task_switch_asserted(struct task* new);
+extern struct task* _task_switch(struct task* new);
+extern struct task* _task_switch_asserted(struct task* new); // returns the task that switched back to us
 
-uint32_t preempt_ctr;
-uint32_t sched_tick_index = 0;
-
-struct task* pongo_sched_head;
+struct task* pongo_sched_head; // ring of all tasks, for task_list only; runnable tasks are in the run queue
 
 char pongo_sched_tick() {
     char rvalue = 0;
     disable_interrupts();
-    if (!pongo_sched_head) panic("no tasks to schedule");
-    if (pongo_sched_head == &sched_task) {
-        pongo_sched_head = pongo_sched_head->next;
-        rvalue = 2; // if we got here
+    struct task* volatile tsk = task_rq_pick_next();
+    if (!tsk) {
+        rvalue = 2;
         goto out;
     }
-    if (pongo_sched_head) {
-        struct task* volatile tsk = pongo_sched_head;
-        pongo_sched_head = pongo_sched_head->next;
-        if (tsk->flags & TASK_PLEASE_DEREF) {
-            tsk->flags &= ~TASK_PLEASE_DEREF;
-            task_release(tsk);
-        } else
-        if (tsk->flags & TASK_LINKED) {
-            _task_switch_asserted(tsk);
-            disable_interrupts();
-            if (preempt_ctr) {
-                rvalue = 1;
-                preempt_ctr = 0;
-            }
-        }
-
+    task_vm_activate(tsk);
+    // prev comes back in a register: interrupts are on again by the time the switch returns, and an IRQ handler
+    // switching in and out during that window would leave anything kept in memory pointing at itself
+    struct task* prev = _task_switch_asserted(tsk);
+    disable_interrupts();
+    task_sched_return(prev);
+    if (pongo_cpu_self()->preempt_ctr) {
+        rvalue = 1;
+        pongo_cpu_self()->preempt_ctr = 0;
     }
 out:
     enable_interrupts();
     return rvalue;
 }
 
+/*
+
+    Name: pongo_idle
+    Description: called by the main loop when the run queue is empty. Stops the periodic tick (or stretches it to the
+                 next sleep deadline) and waits for an interrupt with WFI. Afterwards it wakes the sleepers and timers
+                 that are due itself, restarts the tick and accounts the time spent idle.
+                 The kernel lock is let go of for the duration of the wait. Another core that queues work for us
+                 sees the idle flag and wakes us up with an IPI (see smp_kick).
+
+*/
+
+uint64_t sched_idle_ticks;           // total
+uint64_t sched_idle_window_start;
+uint64_t sched_idle_window_idle;
+uint64_t sched_idle_last_second;     // idle ticks during the last complete second
+uint64_t sched_busy_last_second;
+
+void sched_idle_account(uint64_t now, uint64_t idle) {
+    disable_interrupts();
+    sched_idle_ticks += idle;
+    sched_idle_window_idle += idle;
+    if (!sched_idle_window_start) sched_idle_window_start = now;
+    uint64_t elapsed = now - sched_idle_window_start;
+    if (elapsed >= TICKS_IN_1MS * 1000) {
+        uint64_t window_idle = sched_idle_window_idle < elapsed ? sched_idle_window_idle : elapsed;
+        sched_idle_last_second = window_idle;
+        sched_busy_last_second = elapsed - window_idle;
+        sched_idle_window_start = now;
+        sched_idle_window_idle = 0;
+    }
+    enable_interrupts();
+}
+
+void pongo_idle() {
+    disable_interrupts();
+    if (!task_rq_empty()) {
+        enable_interrupts();
+        return;
+    }
+    uint64_t start = get_ticks();
+    bool boot_cpu = !cpu_number();
+    uint64_t deadline = 0;
+    if (boot_cpu) {
+        deadline = task_sleep_next_deadline();
+        uint64_t timer_deadline = timer_next_deadline();
+        if (timer_deadline && (!deadline || timer_deadline < deadline)) deadline = timer_deadline;
+    }
+    if (deadline) {
+        timer_set_oneshot(deadline > start ? deadline - start : 1);
+    } else {
+        timer_disable();
+    }
+    // WFI wakes up on pending interrupts even while they are masked, so nothing can slip in between the check and here
+    struct pongo_cpu* cpu = pongo_cpu_self();
+    cpu->idle = true;
+    kernel_lock_drop();
+    __asm__ volatile("dsb sy");
+    __asm__ volatile("wfi");
+    kernel_lock_take();
+    cpu->idle = false;
+    uint64_t now = get_ticks();
+    if (boot_cpu) {
+        // re-arming below acks a one-shot that already fired, so its FIQ never arrives; do its work here instead
+        task_sleep_tick();
+        timer_service_tick(now);
+    }
+    timer_rearm();
+    timer_enable();
+    enable_interrupts(); // take whatever other interrupt woke us up
+    if (boot_cpu) sched_idle_account(now, now - start);
+}
+
 /*
 
     Name: pongo_entry_cached
@@ -155,6 +223,8 @@ __attribute__((noinline)) void pongo_entry_cached()
         }
     }
 
+    smp_init();
+
     /*
         Set up IRQ handling
     */
@@ -164,10 +234,12 @@ __attribute__((noinline)) void pongo_entry_cached()
 
     extern void _task_set_current(struct task* t);
 
+    kernel_stack_cache_init();
     task_alloc_fast_stacks(&sched_task);
 
     task_link(&sched_task);
     _task_set_current(&sched_task);
+    pongo_cpu_self()->sched = &sched_task;
     // Setup VM
 
     vm_init();
@@ -204,30 +276,16 @@ __attribute__((noinline)) void pongo_entry_cached()
     timer_init();
     timer_rearm();
 
-    extern void _task_switch_asserted(struct task* new);
+    extern struct task* _task_switch_asserted(struct task* new);
 
-    char has_been_preempted = 0;
     while (!gBootFlag) {
-        char should_wfe = 0;
-        char sched_ret = pongo_sched_tick();
-        if (sched_ret == 2) {
-            // we looped around the list
-            if (has_been_preempted) {
-                has_been_preempted = 0;
-            } else {
-                should_wfe = 1;
-            }
-        } else if (sched_ret == 1) {
-            // we got preempted
-            has_been_preempted = 1;
-        } else if (sched_ret == 0) {
-            // current task was not to be scheduled or we got volountarily yielded
-        }
-        if (should_wfe) {
-            __asm__("wfe");
+        if (pongo_sched_tick() == 2) {
+            // nothing is runnable, wait for an interrupt to link something
+            pongo_idle();
         }
     }
 
+    smp_teardown();
     timer_disable();
     usb_teardown();
     disable_interrupts();
@@ -311,7 +369,7 @@ void pongo_entry(uint64_t *kernel_args, void *entryp, void (*exit_to_el1_image)(
     //  gFramebuffer = vbase;
     //  lowlevel_cleanup();
     if (gBootFlag == BOOT_FLAG_RAW) {
-        jump_to_image_extended(((uint64_t)loader_xfer_recv_data) - kCacheableView + 0x800000000, (uint64_t)gBootArgs, (uint64_t)gEntryPoint);
+        jump_to_image_extended(((uint64_t)raw_boot_image) - kCacheableView + 0x800000000, (uint64_t)gBootArgs, (uint64_t)gEntryPoint);
     } else if (gBootFlag == BOOT_FLAG_LINUX) {
         linux_boot();
     } else if (gBootFlag == BOOT_FLAG_OPUNTIA) {
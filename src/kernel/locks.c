@@ -29,90 +29,279 @@
 /*
 
     Lock:
-    [  63:2 pointer to last task with ownership ][ 1: busy ][ 0: held ]
+    [  63:2 pointer to owning task ][ 1: waiters ][ 0: held ]
 
-    If last task with ownership == current_task and busy, zero out last task with ownership and yield
+    The word is only ever changed with acquire/release atomics (LDAXR/STLXR, or CAS where LSE is available), so the
+    uncontended paths never touch DAIF. Contended takers queue up in a FIFO and block; lock_release hands ownership
+    straight to the head of the queue, so a woken waiter never has to race for the lock again.
+    The wait queue itself is protected by disabling interrupts, which also takes the kernel lock once other cores are
+    up (see disable_interrupts).
 
 */
 
-#define IS_LOCK_HELD(_lock) ((*(volatile lock*)_lock) & 1)
-#define IS_LOCK_BUSY(_lock) ((*(volatile lock*)_lock) & 2)
-#define GET_LOCK_LAST_OWNER(_lock) ((struct task*)((*(volatile lock*)_lock) & (~3)))
-#define SET_LOCK_HELD(_lock) do { (*(volatile lock*)_lock) |= 1; } while (0)
-#define SET_LOCK_BUSY(_lock) do { (*(volatile lock*)_lock) |= 2; } while (0)
-#define SET_LOCK_NOT_HELD(_lock) do { (*(volatile lock*)_lock) &= ~1; } while (0)
-#define SET_LOCK_NOT_BUSY(_lock) do { (*(volatile lock*)_lock) &= ~2; } while (0)
-#define SET_LOCK_LAST_OWNER(_lock, _task) do { (*(volatile lock*)_lock) &= 3; (*(volatile lock*)_lock) |= ((uint64_t)_task) & (~3);  } while (0)
+#define LOCK_HELD    1ULL
+#define LOCK_WAITERS 2ULL
+#define LOCK_OWNER(_word) ((struct task*)((_word) & (~3ULL)))
 
-extern uint64_t dis_int_count;
+#define RWLOCK_WRITER  1ULL
+#define RWLOCK_WAITERS 2ULL
+#define RWLOCK_READER  4ULL // reader count lives in [63:2]
+
+#define LOCK_WAIT_EXCLUSIVE 1
+#define LOCK_WAIT_SHARED    2
+
+static inline bool lock_word_cas(uint64_t* word, uint64_t* expected, uint64_t desired) {
+    return __atomic_compare_exchange_n(word, expected, desired, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static bool lock_can_block(struct task* task) {
+    extern char preemption_over;
+    if (dis_int_count || preemption_over) return false;
+    if (task == pongo_cpu_self()->sched) return false;
+    if ((task->flags & TASK_IRQ_HANDLER) && !(task->flags & TASK_PREEMPT)) return false;
+    return true;
+}
+
+static void lock_wait_enqueue(struct task** head, struct task** tail, struct task* task, uint32_t mode) {
+    task->lock_wait_next = NULL;
+    task->lock_wait_mode = mode;
+    if (*tail) (*tail)->lock_wait_next = task;
+    else *head = task;
+    *tail = task;
+}
+static struct task* lock_wait_dequeue(struct task** head, struct task** tail) {
+    struct task* task = *head;
+    if (!task) return NULL;
+    *head = task->lock_wait_next;
+    if (!*head) *tail = NULL;
+    task->lock_wait_next = NULL;
+    task->lock_wait_mode = 0;
+    return task;
+}
+
+// called with interrupts disabled after being queued, returns once whoever released the lock dequeued us
+static void lock_wait_block(struct task* task) {
+    while (task->lock_wait_mode) {
+        task_unlink(task);
+        task_yield_asserted();
+        disable_interrupts();
+    }
+}
+
+static void lock_take_contended(lock* _lock, struct task* self) {
+    uint64_t start = get_ticks();
+    bool can_block = lock_can_block(self);
+    disable_interrupts();
+    while (1) {
+        uint64_t old = __atomic_load_n(&_lock->word, __ATOMIC_RELAXED);
+        if (!(old & LOCK_HELD)) {
+            if (lock_word_cas(&_lock->word, &old, ((uint64_t)self) | LOCK_HELD | (old & LOCK_WAITERS))) break;
+            continue;
+        }
+        if (!can_block) {
+            // can't sleep here, fall back to polling
+            enable_interrupts();
+            task_yield();
+            disable_interrupts();
+            continue;
+        }
+        if (!lock_word_cas(&_lock->word, &old, old | LOCK_WAITERS)) continue;
+        lock_wait_enqueue(&_lock->wait_head, &_lock->wait_tail, self, LOCK_WAIT_EXCLUSIVE);
+        lock_wait_block(self);
+        if (LOCK_OWNER(__atomic_load_n(&_lock->word, __ATOMIC_ACQUIRE)) != self) panic("lock_take: woken up without ownership");
+        break;
+    }
+    uint64_t waited = get_ticks() - start;
+    __atomic_fetch_add(&_lock->acquisitions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&_lock->contentions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&_lock->wait_ticks, waited, __ATOMIC_RELAXED);
+    enable_interrupts();
+    PONGO_TRACE(PONGO_TRACE_LOCK_CONTENDED, (uint64_t)_lock, waited);
+}
 
 void lock_take(lock* _lock) {
-    // takes a lock yielding until it acquires it
+    // takes a lock, blocking on its wait queue until ownership is handed to us
     extern char preemption_over;
     if(dis_int_count && !preemption_over)
     {
         panic("Called lock_take with interrupts disabled");
     }
-    while (1) {
-        if (!IS_LOCK_HELD(_lock)) {
-            disable_interrupts(); // this should be atomic rather than this but we're not multicore so whatev
-            if (!IS_LOCK_HELD(_lock)) {
-                if (GET_LOCK_LAST_OWNER(_lock) == task_current() && IS_LOCK_BUSY(_lock)) {
-                    SET_LOCK_LAST_OWNER(_lock, 0);
-                    task_yield_asserted();
-                    continue;
-                } else {
-                    SET_LOCK_HELD(_lock);
-                    SET_LOCK_NOT_BUSY(_lock);
-                    SET_LOCK_LAST_OWNER(_lock, task_current());
-                    enable_interrupts();
-                    return;
-                }
-            }
-            enable_interrupts();
-        } else {
-            if (!IS_LOCK_BUSY(_lock)) {
-                disable_interrupts();
-                SET_LOCK_BUSY(_lock);
-                enable_interrupts();
-            }
-        }
-        task_yield();
+    struct task* self = task_current();
+    uint64_t expected = 0;
+    if (lock_word_cas(&_lock->word, &expected, ((uint64_t)self) | LOCK_HELD)) {
+        __atomic_fetch_add(&_lock->acquisitions, 1, __ATOMIC_RELAXED);
+        return;
     }
+    lock_take_contended(_lock, self);
 }
 void lock_take_spin(lock* _lock) {
     // takes a lock spinning until it acquires it
-    
+
     extern char preemption_over;
     if(dis_int_count && !preemption_over)
     {
         panic("Called lock_take_spin with interrupts disabled");
     }
+    struct task* self = task_current();
+    uint64_t start = 0;
     while (1) {
-        if (!IS_LOCK_HELD(_lock)) {
-            disable_interrupts(); // this should be atomic rather than this but we're not multicore so whatev
-            if (!IS_LOCK_HELD(_lock)) {
-                SET_LOCK_HELD(_lock);
-                SET_LOCK_NOT_BUSY(_lock);
-                SET_LOCK_LAST_OWNER(_lock, task_current());
-                enable_interrupts();
-                return;
-            }
+        uint64_t old = __atomic_load_n(&_lock->word, __ATOMIC_RELAXED);
+        if (!(old & LOCK_HELD)) {
+            if (lock_word_cas(&_lock->word, &old, ((uint64_t)self) | LOCK_HELD | (old & LOCK_WAITERS))) break;
+            continue;
+        }
+        if (!start) start = get_ticks();
+        __asm__ volatile("yield");
+    }
+    __atomic_fetch_add(&_lock->acquisitions, 1, __ATOMIC_RELAXED);
+    if (start) {
+        uint64_t waited = get_ticks() - start;
+        __atomic_fetch_add(&_lock->contentions, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&_lock->wait_ticks, waited, __ATOMIC_RELAXED);
+        PONGO_TRACE(PONGO_TRACE_LOCK_CONTENDED, (uint64_t)_lock, waited);
+    }
+}
+bool lock_try(lock* _lock) {
+    // takes a lock only if it is free, never waits
+    uint64_t expected = 0;
+    if (!lock_word_cas(&_lock->word, &expected, ((uint64_t)task_current()) | LOCK_HELD)) return false;
+    __atomic_fetch_add(&_lock->acquisitions, 1, __ATOMIC_RELAXED);
+    return true;
+}
+void lock_release(lock* _lock) {
+    // releases ownership on a lock, handing it to the first waiter if there is one
+    uint64_t expected = ((uint64_t)task_current()) | LOCK_HELD;
+    if (__atomic_compare_exchange_n(&_lock->word, &expected, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return;
+
+    disable_interrupts();
+    struct task* next = lock_wait_dequeue(&_lock->wait_head, &_lock->wait_tail);
+    if (next) {
+        __atomic_store_n(&_lock->word, ((uint64_t)next) | LOCK_HELD | (_lock->wait_head ? LOCK_WAITERS : 0), __ATOMIC_RELEASE);
+        task_link(next);
+    } else {
+        __atomic_store_n(&_lock->word, 0, __ATOMIC_RELEASE);
+    }
+    enable_interrupts();
+}
+
+/*
+
+    Reader-writer lock:
+    [  63:2 reader count ][ 1: waiters ][ 0: writer ]
+
+    Readers only enter on the fast path while nobody is queued, so a waiting writer isn't starved by a stream of
+    readers. On release the queue head gets the lock; if it is a reader, every reader queued directly behind it
+    is admitted together.
+
+*/
+
+// called with interrupts disabled once the rwlock has no holders left
+static void rwlock_handoff(rwlock* rw) {
+    struct task* head = rw->wait_head;
+    if (!head) {
+        __atomic_store_n(&rw->state, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    if (head->lock_wait_mode == LOCK_WAIT_EXCLUSIVE) {
+        lock_wait_dequeue(&rw->wait_head, &rw->wait_tail);
+        __atomic_store_n(&rw->state, RWLOCK_WRITER | (rw->wait_head ? RWLOCK_WAITERS : 0), __ATOMIC_RELEASE);
+        task_link(head);
+        return;
+    }
+    uint64_t readers = 0;
+    while (rw->wait_head && rw->wait_head->lock_wait_mode == LOCK_WAIT_SHARED) {
+        task_link(lock_wait_dequeue(&rw->wait_head, &rw->wait_tail));
+        readers++;
+    }
+    __atomic_store_n(&rw->state, readers * RWLOCK_READER | (rw->wait_head ? RWLOCK_WAITERS : 0), __ATOMIC_RELEASE);
+}
+
+static void rwlock_take_contended(rwlock* rw, uint32_t mode) {
+    struct task* self = task_current();
+    uint64_t start = get_ticks();
+    bool can_block = lock_can_block(self);
+    disable_interrupts();
+    while (1) {
+        uint64_t old = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+        bool free = mode == LOCK_WAIT_SHARED ? !(old & (RWLOCK_WRITER|RWLOCK_WAITERS)) : !old;
+        if (free) {
+            if (lock_word_cas(&rw->state, &old, mode == LOCK_WAIT_SHARED ? old + RWLOCK_READER : RWLOCK_WRITER)) break;
+            continue;
+        }
+        if (!can_block) {
             enable_interrupts();
-        } else {
-            if (!IS_LOCK_BUSY(_lock)) {
-                disable_interrupts();
-                SET_LOCK_BUSY(_lock);
-                enable_interrupts();
-            }
+            task_yield();
+            disable_interrupts();
+            continue;
         }
+        if (!lock_word_cas(&rw->state, &old, old | RWLOCK_WAITERS)) continue;
+        lock_wait_enqueue(&rw->wait_head, &rw->wait_tail, self, mode);
+        lock_wait_block(self);
+        break; // rwlock_handoff accounted for us in the state word
     }
+    uint64_t waited = get_ticks() - start;
+    __atomic_fetch_add(&rw->acquisitions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&rw->contentions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&rw->wait_ticks, waited, __ATOMIC_RELAXED);
+    enable_interrupts();
+    PONGO_TRACE(PONGO_TRACE_LOCK_CONTENDED, (uint64_t)rw, waited);
+}
 
+void rwlock_read_take(rwlock* rw) {
+    extern char preemption_over;
+    if(dis_int_count && !preemption_over)
+    {
+        panic("Called rwlock_read_take with interrupts disabled");
+    }
+    uint64_t old = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+    while (!(old & (RWLOCK_WRITER|RWLOCK_WAITERS))) {
+        if (lock_word_cas(&rw->state, &old, old + RWLOCK_READER)) {
+            __atomic_fetch_add(&rw->acquisitions, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    rwlock_take_contended(rw, LOCK_WAIT_SHARED);
 }
-void lock_release(lock* _lock) {
-    // releases ownership on a lock
-    disable_interrupts(); // this should be atomic rather than this but we're not multicore so whatev
-    SET_LOCK_NOT_HELD(_lock);
-    SET_LOCK_LAST_OWNER(_lock, task_current());
+void rwlock_write_take(rwlock* rw) {
+    extern char preemption_over;
+    if(dis_int_count && !preemption_over)
+    {
+        panic("Called rwlock_write_take with interrupts disabled");
+    }
+    uint64_t expected = 0;
+    if (lock_word_cas(&rw->state, &expected, RWLOCK_WRITER)) {
+        __atomic_fetch_add(&rw->acquisitions, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rwlock_take_contended(rw, LOCK_WAIT_EXCLUSIVE);
+}
+bool rwlock_read_try(rwlock* rw) {
+    uint64_t old = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+    while (!(old & (RWLOCK_WRITER|RWLOCK_WAITERS))) {
+        if (lock_word_cas(&rw->state, &old, old + RWLOCK_READER)) {
+            __atomic_fetch_add(&rw->acquisitions, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    return false;
+}
+bool rwlock_write_try(rwlock* rw) {
+    uint64_t expected = 0;
+    if (!lock_word_cas(&rw->state, &expected, RWLOCK_WRITER)) return false;
+    __atomic_fetch_add(&rw->acquisitions, 1, __ATOMIC_RELAXED);
+    return true;
+}
+void rwlock_read_release(rwlock* rw) {
+    uint64_t now = __atomic_sub_fetch(&rw->state, RWLOCK_READER, __ATOMIC_RELEASE);
+    if (now != RWLOCK_WAITERS) return; // still readers inside, or nobody waiting
+    disable_interrupts();
+    if (__atomic_load_n(&rw->state, __ATOMIC_RELAXED) == RWLOCK_WAITERS) rwlock_handoff(rw);
+    enable_interrupts();
+}
+void rwlock_write_release(rwlock* rw) {
+    uint64_t expected = RWLOCK_WRITER;
+    if (__atomic_compare_exchange_n(&rw->state, &expected, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return;
+    disable_interrupts();
+    rwlock_handoff(rw);
     enable_interrupts();
 }
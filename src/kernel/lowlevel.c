@@ -188,24 +188,101 @@ size_t memcpy_trap(void* dest, void* src, size_t size) {
 
 extern _Noreturn void panic_new_fp(const char* string, ...);
 
-uint64_t dis_int_count = 1;
+/*
+
+    Name: kernel lock
+    Description: masking interrupts is what serialises the kernel on a single core, so once other cores are up the
+                 outermost disable_interrupts on a core also takes this lock and the matching enable_interrupts drops
+                 it. Everything written under disable_interrupts stays race free without touching its callers. The
+                 boot core starts out holding it, the same way it starts out with a masking depth of 1.
+
+*/
+
+#define KERNEL_LOCK_FREE 0xffffffff
+static volatile uint32_t kernel_lock_owner = 0; // index into pongo_cpus
+
+void kernel_lock_take(void) {
+    uint32_t self = pongo_cpu_self()->index;
+    if (kernel_lock_owner == self) return;
+    while (1) {
+        uint32_t expected = KERNEL_LOCK_FREE;
+        if (__atomic_compare_exchange_n(&kernel_lock_owner, &expected, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+        __asm__ volatile("yield");
+    }
+}
+void kernel_lock_drop(void) {
+    if (kernel_lock_owner != pongo_cpu_self()->index) panic("kernel_lock_drop: not the owner");
+    __atomic_store_n(&kernel_lock_owner, KERNEL_LOCK_FREE, __ATOMIC_RELEASE);
+}
+
+/*
+
+    Name: spinlock
+    Description: for leaf subsystems that every core hits often (the allocators and page tables), so they don't queue
+                 up behind the kernel lock. Only masks interrupts on the calling core and nests there. Code holding a
+                 spinlock must not call disable_interrupts or anything that blocks: taking the kernel lock from under
+                 a spinlock can deadlock against a core that holds the kernel lock and wants the spinlock.
+
+*/
+
+void spinlock_take(spinlock* l) {
+    uint64_t daif;
+    __asm__ volatile("mrs %0, daif\n msr daifset, #0xf" : "=r"(daif));
+    uint32_t self = pongo_cpu_self()->index + 1;
+    if (l->owner == self) {
+        l->depth++;
+        return;
+    }
+    while (1) {
+        uint32_t expected = 0;
+        if (__atomic_compare_exchange_n(&l->owner, &expected, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        __asm__ volatile("yield");
+    }
+    l->depth = 1;
+    l->daif = daif;
+}
+void spinlock_release(spinlock* l) {
+    if (l->owner != pongo_cpu_self()->index + 1) panic("spinlock_release: not the owner");
+    if (--l->depth) return;
+    uint64_t daif = l->daif;
+    __atomic_store_n(&l->owner, 0, __ATOMIC_RELEASE);
+    __asm__ volatile("msr daif, %0" : : "r"(daif));
+}
+
 void _enable_interrupts();
 void enable_interrupts() {
-    if (!dis_int_count) panic("irq over-enable");
-    dis_int_count--;
-    if (!dis_int_count) {
+    struct pongo_cpu* cpu = pongo_cpu_self();
+    if (!cpu->int_depth) panic("irq over-enable");
+    cpu->int_depth--;
+    if (!cpu->int_depth) {
+        kernel_lock_drop();
         _enable_interrupts();
     }
 }
 void enable_interrupts_asserted() {
-    if (!dis_int_count) panic("irq over-enable");
-    dis_int_count--;
+    struct pongo_cpu* cpu = pongo_cpu_self();
+    if (!cpu->int_depth) panic("irq over-enable");
+    cpu->int_depth--;
+    if (!cpu->int_depth) kernel_lock_drop();
 }
 void _disable_interrupts();
 void disable_interrupts() {
     _disable_interrupts();
-    dis_int_count++;
-    if (!dis_int_count) panic("irq over-disable");
+    // only look up our core once interrupts are off, we can't be moved to another one after that
+    struct pongo_cpu* cpu = pongo_cpu_self();
+    if (!cpu->int_depth) kernel_lock_take();
+    cpu->int_depth++;
+    if (!cpu->int_depth) panic("irq over-disable");
+}
+
+// exceptions that can only be taken with interrupts enabled, so the depth is always 0 on the way in
+static void exception_enter() {
+    kernel_lock_take();
+    pongo_cpu_self()->int_depth = 1;
+}
+static void exception_exit() {
+    pongo_cpu_self()->int_depth = 0;
+    kernel_lock_drop();
 }
 
 volatile char is_in_exception;
@@ -266,6 +343,7 @@ int sync_exc_handle(uint64_t* state) {
     uint64_t esr = state[0xf8/8];
     uint64_t esr_ec = (esr & 0xFC000000) >> 26;
 
+    PONGO_TRACE(PONGO_TRACE_FAULT, far, esr);
     if (t && ((esr_ec == 0b100101) || // Data abort from current EL
               (esr_ec == 0b100100)    // Data abort from lower EL
               )) {
@@ -290,27 +368,29 @@ int sync_exc_handle(uint64_t* state) {
     return 1;
 }
 int sync_exc(uint64_t* state) {
-    _disable_interrupts();
-    dis_int_count++;
+    disable_interrupts();
     if (!task_current()) panic("caught sync exception with task_current() == NULL");
 
     if (!sync_exc_handle(state)) {
-        dis_int_count --;
+        enable_interrupts_asserted();
         return 0;
     }
 
+    if (kernel_stack_guard_hit(task_current(), state[0x108/8])) {
+        print_state(state);
+        panic("kernel stack overflow in task %s (pid %u)", task_current()->name, task_current()->pid);
+    }
     if (dis_int_count != 1) {
         print_state(state);
         panic("caught sync exception with interrupts held");
     }
     print_state(state);
     task_crash_asserted("caught sync exception!");
-    dis_int_count = 0;
+    exception_exit();
     return 0;
 }
 int sync_exc_el0(uint64_t* state) {
-    _disable_interrupts();
-    dis_int_count++;
+    disable_interrupts();
 
     if (dis_int_count != 1) {
         print_state(state);
@@ -326,16 +406,46 @@ int sync_exc_el0(uint64_t* state) {
         if (dis_int_count != 1) {
             panic("pongo_syscall_entry returned with disable_interrupt count != 1");
         }
-        dis_int_count = 0;
+        exception_exit();
         return 0;
     }
 
-    dis_int_count = 0;
+    exception_exit();
     return sync_exc(state);
 }
 uint32_t interrupt_vector() {
     return (*(volatile uint32_t *)(gInterruptBase + 0x2004));
 }
+/*
+
+    Name: AIC IPIs
+    Description: the only IPI we use is "other", and only to get a core out of WFI after queueing work for it. Reading
+                 the event masks it on the receiving core, so irq_exc acks and unmasks it again.
+
+*/
+
+#define AIC_WHOAMI          0x2000
+#define AIC_EVENT_TYPE_IPI  4
+#define AIC_IPI_SEND        0x2008
+#define AIC_IPI_ACK         0x200c
+#define AIC_IPI_MASK_SET    0x2024
+#define AIC_IPI_MASK_CLR    0x2028
+#define AIC_IPI_OTHER       1
+
+uint32_t interrupt_whoami() {
+    return *(volatile uint32_t*)(gInterruptBase + AIC_WHOAMI);
+}
+void interrupt_ipi_send(uint32_t aic_cpu) {
+    __asm__ volatile("dsb sy"); // make the queued work visible before the target wakes up
+    *(volatile uint32_t*)(gInterruptBase + AIC_IPI_SEND) = 1 << aic_cpu;
+}
+void interrupt_ipi_set_enabled(bool enabled) {
+    *(volatile uint32_t*)(gInterruptBase + (enabled ? AIC_IPI_MASK_CLR : AIC_IPI_MASK_SET)) = AIC_IPI_OTHER;
+}
+static void interrupt_ipi_ack() {
+    *(volatile uint32_t*)(gInterruptBase + AIC_IPI_ACK) = AIC_IPI_OTHER;
+    *(volatile uint32_t*)(gInterruptBase + AIC_IPI_MASK_CLR) = AIC_IPI_OTHER;
+}
 uint64_t interruptCount = 0, fiqCount = 0;
 uint32_t do_preempt = 1;
 void disable_preemption() {
@@ -348,47 +458,68 @@ void enable_preemption() {
     do_preempt--;
     enable_interrupts();
 }
+uint64_t irq_exc_ticks; // total time spent in irq_exc, top halves and non-preempting irq tasks included
 int irq_exc() {
+    exception_enter();
     timer_disable();
-    dis_int_count = 1;
     is_in_exception = 1;
     interruptCount++;
-    if (task_current()->irq_ret) {
+    uint64_t start = get_ticks();
+    struct task* interrupted = task_current();
+    if (interrupted->irq_ret) {
         panic("nested IRQs are not supported at this time");
     }
+    // stop the interrupted task's clock, so the IRQ is only charged to irq_exc_ticks and the handlers
+    if (interrupted->switched_in_at) interrupted->cpu_ticks += start - interrupted->switched_in_at;
+    interrupted->switched_in_at = 0;
     uint32_t intr = interrupt_vector();
     while (intr) {
-        task_irq_dispatch(intr);
+        if (((intr >> 16) & 0xff) == AIC_EVENT_TYPE_IPI) {
+            interrupt_ipi_ack(); // the wakeup was all it was for, the scheduler finds the work
+        } else {
+            PONGO_TRACE(PONGO_TRACE_IRQ_ENTER, intr & 0x1ff, 0);
+            task_irq_dispatch(intr);
+            PONGO_TRACE(PONGO_TRACE_IRQ_EXIT, intr & 0x1ff, 0);
+        }
         intr = interrupt_vector();
     }
     if (dis_int_count != 1) panic("IRQ handler left interrupts disabled...");
+    // a bottom half woken above runs before the interrupted task does, which then picks up where it left off
+    int preempt = task_rq_irq_preempts(interrupted);
+    if (preempt) interrupted->flags |= TASK_IRQ_PREEMPTED;
+    uint64_t end = get_ticks();
+    irq_exc_ticks += end - start;
+    interrupted->switched_in_at = end;
     is_in_exception = 0;
-    dis_int_count = 0;
     timer_enable();
-    return 0;
+    exception_exit();
+    return preempt;
 }
 int serror_exc(uint64_t* state) {
+    exception_enter();
     is_in_exception = 1;
-    dis_int_count = 1;
     print_state(state);
     panic_new_fp("caught serror exception");
     is_in_exception = 0;
     return 0;
 }
-int _fiq_exc() {
+int _fiq_exc(uint64_t* state) {
+    exception_enter();
     is_in_exception = 1;
     fiqCount++;
-    dis_int_count = 1;
     wdt_enable();
+    PONGO_TRACE(PONGO_TRACE_FIQ_ENTER, 0, 0);
+    if (pongo_profile_enabled) pongo_profile_sample(state);
     int ret_val = pongo_fiq_handler();
+    PONGO_TRACE(PONGO_TRACE_FIQ_EXIT, ret_val, 0);
     if (dis_int_count != 1) panic("FIQ handler left interrupts disabled...");
-    dis_int_count = 0;
     is_in_exception = 0;
+    exception_exit();
     return ret_val;
 }
 extern uint64_t preemption_counter;
-int fiq_exc() {
-    int fiq_r = _fiq_exc();
+int fiq_exc(uint64_t* state) {
+    int fiq_r = _fiq_exc(state);
     if (fiq_r) {
         preemption_counter++;
     }
@@ -417,6 +548,11 @@ void spin(uint32_t usec)
 }
 void usleep(uint64_t usec)
 {
+    if (usec >= 1000) {
+        // long enough to be worth leaving the run queue, the sleep queue is driven by the 1ms scheduler tick
+        task_sleep_until(get_ticks() + (24*usec));
+        return;
+    }
     disable_interrupts();
     uint64_t eta_wen = get_ticks() + (24*usec);
     uint64_t preempt_after = get_ticks() + 2400;
@@ -665,6 +801,23 @@ cache_clean(void *address, size_t size) { // invalidates too, because Apple
     asm volatile("dsb sy");
     asm volatile("isb");
 }
+// cleans a 2D region (rows of width bytes, stride bytes apart) line by line, with a single barrier pair for the lot
+void
+cache_clean_rect(void *address, size_t stride, size_t width, size_t rows) {
+    uint64_t cache_line_size = 64;
+    asm volatile("isb");
+    asm volatile("dsb sy");
+    for (size_t row = 0; row < rows; row++) {
+        uintptr_t base = (uintptr_t) address + row * stride;
+        uint64_t start = base & ~(cache_line_size - 1);
+        uint64_t end = (base + width + cache_line_size - 1) & ~(cache_line_size - 1);
+        for (uint64_t addr = start; addr < end; addr += cache_line_size) {
+            asm volatile("dc civac, %0" : : "r"(addr));
+        }
+    }
+    asm volatile("dsb sy");
+    asm volatile("isb");
+}
 extern uint64_t heap_base;
 extern uint64_t heap_end;
 extern uint64_t linear_kvm_base;
@@ -56,6 +56,9 @@ void pongo_main_task() {
     // Turn on IRQ controller
     interrupt_init();
 
+    // Software timers
+    timer_service_init();
+
     // Enable IRQ serial RX
     serial_init();
 
@@ -29,6 +29,7 @@
 #include <pongo.h>
 
 #define MAX_WANT_PAGES_IN_FREELIST 512
+spinlock mm_lock; // not the kernel lock, so other cores can allocate while it is held elsewhere
 void* free_list;
 bool is_16k_v = false;
 void* page_alloc() {
@@ -42,24 +43,24 @@ void ppage_free(uint64_t page) {
 }
 void* ttb_freelist;
 void ttbpage_free(uint64_t page) {
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     void * ttbp = (phystokv(page));
     *(void**)ttbp = ttb_freelist;
     ttb_freelist = ttbp;
-    enable_interrupts();
+    spinlock_release(&mm_lock);
 }
 
 uint64_t ttbpage_alloc() {
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     if (ttb_freelist) {
         void* page = ttb_freelist;
         ttb_freelist = *(void**)page;
-        enable_interrupts();
+        spinlock_release(&mm_lock);
 
         bzero(page, is_16k() ? 0x4000 : 0x1000);
         return vatophys_static(page);
     }
-    enable_interrupts();
+    spinlock_release(&mm_lock);
     if (is_16k()) {
         return ppage_alloc();
     } else {
@@ -367,7 +368,7 @@ err_t vm_allocate(struct vm_space* vmspace, uint64_t* addr, uint64_t size, vm_fl
 
     uint32_t pagecount = ((size + PAGE_MASK) & ~PAGE_MASK) / PAGE_SIZE;
     if (!pagecount) return 0;
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     uint32_t vm_scan_base = 0;
     uint64_t vm_scan_size = (VM_SPACE_SIZE / PAGE_SIZE);
     uint32_t found_pages = 0;
@@ -412,12 +413,12 @@ err_t vm_allocate(struct vm_space* vmspace, uint64_t* addr, uint64_t size, vm_fl
         *addr = 0;
     }
 
-    enable_interrupts();
+    spinlock_release(&mm_lock);
     return retn;
 }
 err_t vm_deallocate(struct vm_space* vmspace, uint64_t addr, uint64_t size) {
     err_t retn = KERN_VM_OOM;
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     uint64_t vm_offset = addr - vmspace->vm_space_base;
     if (!((vm_offset + size) > vmspace->vm_space_end)) {
         uint32_t pagecount = ((size + PAGE_MASK) & ~PAGE_MASK) / PAGE_SIZE;
@@ -437,7 +438,7 @@ err_t vm_deallocate(struct vm_space* vmspace, uint64_t addr, uint64_t size) {
             }
         }
     }
-    enable_interrupts();
+    spinlock_release(&mm_lock);
     return retn;
 }
 struct vm_space kernel_vm_space = {
@@ -456,17 +457,19 @@ uint64_t linear_kvm_alloc(uint32_t size) {
 
     if ((linear_kvm_cursor + size) > linear_kvm_end) panic("linear_kvm_alloc: OOM");
 
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     va = linear_kvm_cursor;
     linear_kvm_cursor += size;
-    enable_interrupts();
+    spinlock_release(&mm_lock);
     return va;
 }
+uint64_t jit_pages = 0;
 void* jit_alloc(uint32_t size) {
     size +=  8;
     size +=  0x3FFF;
     size &= ~0x3FFF;
     uint64_t va = linear_kvm_alloc(size);
+    uint32_t alloc_size = size;
 
     uint64_t mapped_so_far = 0;
     while (size) {
@@ -474,9 +477,10 @@ void* jit_alloc(uint32_t size) {
         vm_space_map_page_physical_prot(&kernel_vm_space, va + mapped_so_far, page, PROT_READ|PROT_WRITE|PROT_EXEC|PROT_KERN_ONLY);
         size -= 0x4000;
         mapped_so_far += 0x4000;
+        jit_pages++;
     }
 
-    *(uint32_t*)(va) = size;
+    *(uint32_t*)(va) = alloc_size;
 
     return (void*)(va + 4);
 }
@@ -493,10 +497,11 @@ void jit_free(void* alloc) {
         vm_space_map_page_physical_prot(&kernel_vm_space, va + mapped_so_far, 0, 0);
         size -= 0x4000;
         mapped_so_far += 0x4000;
+        jit_pages--;
     }
 }
 err_t vm_space_map_page_physical_prot(struct vm_space* vmspace, uint64_t vaddr, uint64_t physical, vm_protect_t prot) {
-    disable_interrupts();
+    spinlock_take(&mm_lock);
 
     if (vmspace == &kernel_vm_space) prot |= PROT_KERN_ONLY;
 
@@ -527,23 +532,55 @@ err_t vm_space_map_page_physical_prot(struct vm_space* vmspace, uint64_t vaddr,
         }
     }
 
-    enable_interrupts();
+    spinlock_release(&mm_lock);
     return KERN_SUCCESS;
 }
-uint8_t asid_table[256/8];
+/*
+
+    Name: asid_alloc
+    Description: hands out an ASID from the current generation. ASIDs are assigned lazily when a vm_space is
+                 about to be switched in; once all 255 are in use we start a new generation, flush the TLB once
+                 and let every other vm_space pick up a fresh ASID on its next switch.
+
+*/
+
+#define ASID_COUNT 256
+uint8_t asid_table[ASID_COUNT/8];
+uint64_t asid_generation = 1;
+uint64_t asid_rollovers = 0;
+static void asid_rollover() {
+    struct vm_space* active = task_current()->vm_space;
+    bzero(asid_table, sizeof(asid_table));
+    asid_table[0] |= 1; // reserve kernel ASID
+    // keep the live context valid so that it doesn't keep filling the TLB under an ASID we are about to recycle
+    if (active && active != &kernel_vm_space && active->asid_generation == asid_generation) {
+        uint32_t index = (active->asid >> 48ULL) & 0xff;
+        asid_table[index >> 3] |= (1 << (index & 0x7));
+        active->asid_generation = asid_generation + 1;
+    }
+    asid_generation++;
+    asid_rollovers++;
+    asm volatile("ISB");
+    asm volatile("TLBI VMALLE1IS");
+    asm volatile("DSB SY");
+    asm volatile("ISB");
+}
 uint64_t asid_alloc() {
-    disable_interrupts();
-    for (uint32_t i=0; i < 256; i++) {
-        bool is_alloc = !!(asid_table[i>>3] & (1 << (i&0x7)));
-        if (!is_alloc) {
-            asid_table[i>>3] |= (1 << (i&0x7));
-            enable_interrupts();
-            //fiprintf(stderr, "allocating asid: %llx\n", ((uint64_t) i) << 48ULL);
+    spinlock_take(&mm_lock);
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        for (uint32_t i=0; i < ASID_COUNT; i++) {
+            bool is_alloc = !!(asid_table[i>>3] & (1 << (i&0x7)));
+            if (!is_alloc) {
+                asid_table[i>>3] |= (1 << (i&0x7));
+                spinlock_release(&mm_lock);
+                //fiprintf(stderr, "allocating asid: %llx\n", ((uint64_t) i) << 48ULL);
 
-            return ((uint64_t) i) << 48ULL;
+                return ((uint64_t) i) << 48ULL;
+            }
         }
+        asid_rollover();
     }
-    panic("asid_alloc: out of ASIDs, are we leaking vm_spaces?");
+    panic("asid_alloc: no ASID available after rollover");
     return 0;
 }
 void asid_free(uint64_t asid) {
@@ -560,6 +597,27 @@ void asid_free(uint64_t asid) {
     asm volatile("TLBI ASIDE1IS, %0" : : "r"(asid));
     asm volatile("DSB SY");
 }
+
+/*
+
+    Name: vm_asid_validate
+    Description: returns the ASID of a vm_space, (re)assigning one if it belongs to an older generation
+
+*/
+
+uint64_t vm_asid_validate(struct vm_space* vmspace) {
+    if (vmspace == &kernel_vm_space) return vmspace->asid;
+    spinlock_take(&mm_lock);
+    if (vmspace->asid_generation != asid_generation) {
+        uint64_t asid = asid_alloc();
+        // asid_alloc may have rolled over and bumped the generation, read it afterwards
+        vmspace->asid = asid;
+        vmspace->asid_generation = asid_generation;
+    }
+    uint64_t rv = vmspace->asid;
+    spinlock_release(&mm_lock);
+    return rv;
+}
 void vm_flush(struct vm_space* fl) {
     asm volatile("ISB");
     asm volatile("TLBI ASIDE1IS, %0" : : "r"(fl->asid));
@@ -567,12 +625,12 @@ void vm_flush(struct vm_space* fl) {
 }
 void vm_flush_by_addr(struct vm_space* fl, uint64_t va) {
     asm volatile("ISB");
-    asm volatile("TLBI VAE1, %0" : : "r"(fl->asid | ((va >> 12) & 0xFFFFFFFFFFF)));
+    asm volatile("TLBI VAE1IS, %0" : : "r"(fl->asid | ((va >> 12) & 0xFFFFFFFFFFF)));
     asm volatile("DSB SY");
 }
 void vm_flush_by_addr_all_asid(uint64_t va) {
     asm volatile("ISB");
-    asm volatile("TLBI VAAE1, %0" : : "r"((va >> 12) & 0xFFFFFFFFFFF));
+    asm volatile("TLBI VAAE1IS, %0" : : "r"((va >> 12) & 0xFFFFFFFFFFF));
     asm volatile("DSB SY");
 }
 void vm_init() {
@@ -598,7 +656,8 @@ struct vm_space* vm_create(struct vm_space* parent) {
         space->ttbr0 = kernel_vm_space.ttbr0;
     }
     space->ttbr1 = ttbpage_alloc();
-    space->asid = asid_alloc();
+    space->asid = 0; // assigned by vm_asid_validate() when first switched in
+    space->asid_generation = 0;
     space->parent = vm_reference(parent); // consume ref
     space->vm_space_table = malloc((VM_SPACE_SIZE / PAGE_SIZE) / 8);
     bzero(space->vm_space_table, (VM_SPACE_SIZE / PAGE_SIZE) / 8);
@@ -652,7 +711,7 @@ void phys_unlink_contiguous(uint64_t pa, uint64_t size) {
     if (pa & 0x3fff) panic("phys_unlink_contiguous only works with aligned PAs");
     pa >>= 14;
 
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     for (uint64_t i=pa; i < pa+fpages; i++) {
         if (i > ppages) panic("OOB phys_unlink_contiguous: 0x%llx", i << 14ULL);
         uint64_t* pa_v = phystokv((i << 14ULL) + gBootArgs->physBase);
@@ -675,7 +734,7 @@ void phys_unlink_contiguous(uint64_t pa, uint64_t size) {
             pa_head = pa_next;
         }
     }
-    enable_interrupts();
+    spinlock_release(&mm_lock);
 }
 void mark_phys_wired(uint64_t pa, uint64_t size) {
     pa -= gBootArgs->physBase;
@@ -684,7 +743,7 @@ void mark_phys_wired(uint64_t pa, uint64_t size) {
     if (pa & 0x3fff) panic("mark_phys_wired only works with aligned PAs (pa: %llx)", pa);
     pa >>= 14;
 
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     for (uint64_t i=pa; i < pa+fpages; i++) {
         if ((phys_get_entry((i << 14ULL) + gBootArgs->physBase) & PAGE_REFBITS) != PAGE_FREE) panic("mark_phys_wired: ppage (pa: %llx) is not free!", (i << 14ULL) + gBootArgs->physBase);
         if (i > ppages) panic("OOB mark_phys_wired: 0x%llx", i << 14ULL);
@@ -692,11 +751,11 @@ void mark_phys_wired(uint64_t pa, uint64_t size) {
         free_pages--;
         wired_pages++;
     }
-    enable_interrupts();
+    spinlock_release(&mm_lock);
 }
 uint64_t ppage_alloc() {
     uint64_t rv = 0;
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     if (!alloc_static_base) {
         void alloc_init(void);
         alloc_init();
@@ -712,11 +771,11 @@ uint64_t ppage_alloc() {
         bzero(rv_v, PAGE_SIZE);
         phys_reference(rv, PAGE_SIZE);
     } else panic("ppage_alloc: OOM");
-    enable_interrupts();
+    spinlock_release(&mm_lock);
     return rv;
 }
 void phys_page_was_freed(uint64_t pa) {
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     uint64_t* pa_v = phystokv(pa);
     if (pa_head) {
         uint64_t* pa_head_v = phystokv(pa_head);
@@ -726,7 +785,7 @@ void phys_page_was_freed(uint64_t pa) {
     pa_v[1] = 0; // new->prev == null
     pa_head = pa; // head = n ew
     free_pages ++;
-    enable_interrupts();
+    spinlock_release(&mm_lock);
 }
 void phys_force_free(uint64_t pa, uint64_t size) {
     pa -= gBootArgs->physBase;
@@ -735,7 +794,7 @@ void phys_force_free(uint64_t pa, uint64_t size) {
     if (pa & 0x3fff) panic("phys_force_free only works with aligned PAs");
     pa >>= 14;
 
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     for (uint64_t i=pa; i < pa+fpages; i++) {
         if (i > ppages) panic("OOB phys_force_free: 0x%llx", i << 14ULL);
         if ((ppage_list[i] & PAGE_REFBITS) == PAGE_WIRED) {
@@ -746,7 +805,7 @@ void phys_force_free(uint64_t pa, uint64_t size) {
         }
         ppage_list[i] = PAGE_FREE;
     }
-    enable_interrupts();
+    spinlock_release(&mm_lock);
 }
 void phys_reference(uint64_t pa, uint64_t size) {
     if (!pa) return;
@@ -757,7 +816,7 @@ void phys_reference(uint64_t pa, uint64_t size) {
     if (pa & 0x3fff) panic("phys_reference only works with aligned PAs");
     pa >>= 14;
 
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     for (uint64_t i=pa; i < pa+fpages; i++) {
         if (i > ppages) panic("OOB phys_reference: 0x%llx", i << 14ULL);
         if ((ppage_list[i] & PAGE_REFBITS) != PAGE_WIRED) {
@@ -767,7 +826,7 @@ void phys_reference(uint64_t pa, uint64_t size) {
             ppage_list[i] = (ppage_list[i] & ~PAGE_REFBITS) | ((ppage_list[i] + 1) & PAGE_REFBITS);
         }
     }
-    enable_interrupts();
+    spinlock_release(&mm_lock);
 }
 void phys_dereference(uint64_t pa, uint64_t size) {
     if (!pa) return;
@@ -778,7 +837,7 @@ void phys_dereference(uint64_t pa, uint64_t size) {
     if (pa & 0x3fff) panic("phys_dereference only works with aligned PAs (was passed %llx)", pa + gBootArgs->physBase);
     pa >>= 14ULL;
 
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     for (uint64_t i=pa; i < pa+fpages; i++) {
         if (i > ppages) panic("OOB phys_dereference: 0x%llx", i << 14ULL);
         if ((ppage_list[i] & PAGE_REFBITS) != PAGE_FREE) {
@@ -788,7 +847,7 @@ void phys_dereference(uint64_t pa, uint64_t size) {
             }
         } else panic("phys_dereference called on PAGE_FREE page @ 0x%llx", i << 14ULL);
     }
-    enable_interrupts();
+    spinlock_release(&mm_lock);
 }
 
 void alloc_init() {
@@ -851,12 +910,12 @@ uint64_t alloc_phys(uint32_t size) {
 
     bool found = false;
     uint64_t rv = 0;
-    disable_interrupts();
+    spinlock_take(&mm_lock);
 
     if (size == PAGE_SIZE) {
         // O(1) fastpath
         rv = ppage_alloc();
-        enable_interrupts();
+        spinlock_release(&mm_lock);
         return rv;
     }
     for (uint64_t i=0; i < ppages; i++) {
@@ -878,7 +937,7 @@ uint64_t alloc_phys(uint32_t size) {
     if (!rv) panic("alloc_phys: returning NULL?? (size 0x%x, npages 0x%x, found_pages 0x%x)", size, npages, found_pages);
     phys_unlink_contiguous(rv, size);
     phys_reference(rv, size);
-    enable_interrupts();
+    spinlock_release(&mm_lock);
     return rv;
 }
 void free_phys(uint64_t pa, uint32_t size) {
@@ -890,6 +949,84 @@ void* alloc_contig(uint32_t size) {
 void free_contig(void* base, uint32_t size) {
     free_phys(vatophys_static(base), size);
 }
+
+/*
+
+    Name: pongo_meminfo_collect
+    Description: snapshots page accounting and walks the physical page list to build a histogram of free contiguous runs
+
+*/
+
+void pongo_meminfo_collect(struct pongo_meminfo* info) {
+    extern uint64_t heap_base, heap_cursor, heap_end;
+    extern uint64_t paging_requests;
+    if (!alloc_static_base) {
+        alloc_init();
+    }
+    bzero(info, sizeof(*info));
+    info->version = PONGO_MEMINFO_VERSION;
+    info->page_size = PAGE_SIZE;
+
+    spinlock_take(&mm_lock);
+    info->total_pages = ppages;
+    uint64_t run = 0;
+    for (uint64_t i=0; i <= ppages; i++) {
+        uint32_t refs = i < ppages ? (ppage_list[i] & PAGE_REFBITS) : PAGE_WIRED;
+        if (refs == PAGE_FREE) {
+            info->free_pages++;
+            run++;
+            continue;
+        }
+        if (i < ppages) {
+            if (refs == PAGE_WIRED) info->wired_pages++;
+            else info->referenced_pages++;
+        }
+        if (run) {
+            uint32_t bucket = 63 - __builtin_clzll(run);
+            if (bucket >= PONGO_MEMINFO_RUN_BUCKETS) bucket = PONGO_MEMINFO_RUN_BUCKETS - 1;
+            info->free_run_histogram[bucket]++;
+            info->free_runs++;
+            if (run > info->largest_free_run) info->largest_free_run = run;
+            run = 0;
+        }
+    }
+    info->paging_requests = paging_requests;
+    info->static_used = alloc_static_current - alloc_static_base;
+    info->static_size = alloc_static_end - alloc_static_base;
+    info->heap_used = heap_cursor - heap_base;
+    info->heap_mapped = heap_end - heap_base;
+    info->linear_kvm_used = linear_kvm_cursor - linear_kvm_base;
+    info->linear_kvm_size = linear_kvm_end - linear_kvm_base;
+    info->jit_pages = jit_pages;
+    spinlock_release(&mm_lock);
+
+    pongo_module_footprint(&info->module_count, &info->module_bytes);
+}
+void meminfo_cmd(const char* cmd, char* args) {
+    struct pongo_meminfo info;
+    pongo_meminfo_collect(&info);
+
+    iprintf("physical: %lld pages (%lld MB), page size 0x%x\n", info.total_pages, (info.total_pages * PAGE_SIZE) >> 20, info.page_size);
+    iprintf(" | free:       %8lld pages (%lld KB)\n", info.free_pages, (info.free_pages * PAGE_SIZE) >> 10);
+    iprintf(" | wired:      %8lld pages (%lld KB)\n", info.wired_pages, (info.wired_pages * PAGE_SIZE) >> 10);
+    iprintf(" | referenced: %8lld pages (%lld KB)\n", info.referenced_pages, (info.referenced_pages * PAGE_SIZE) >> 10);
+    iprintf(" | paging requests: %lld\n", info.paging_requests);
+    iprintf("free runs: %lld, largest %lld pages (%lld KB)\n", info.free_runs, info.largest_free_run, (info.largest_free_run * PAGE_SIZE) >> 10);
+    for (uint32_t i = 0; i < PONGO_MEMINFO_RUN_BUCKETS; i++) {
+        if (!info.free_run_histogram[i]) continue;
+        if (i == PONGO_MEMINFO_RUN_BUCKETS - 1)
+            iprintf(" | %6d+       pages: %lld\n", 1 << i, info.free_run_histogram[i]);
+        else
+            iprintf(" | %6d-%-6d pages: %lld\n", 1 << i, (2 << i) - 1, info.free_run_histogram[i]);
+    }
+    iprintf("static region: 0x%llx / 0x%llx bytes\n", info.static_used, info.static_size);
+    iprintf("heap: 0x%llx bytes used, 0x%llx mapped\n", info.heap_used, info.heap_mapped);
+    iprintf("linear kvm: 0x%llx / 0x%llx bytes\n", info.linear_kvm_used, info.linear_kvm_size);
+    iprintf("jit: %lld pages (%lld KB)\n", info.jit_pages, (info.jit_pages * PAGE_SIZE) >> 10);
+    iprintf("modules: %lld, 0x%llx bytes\n", info.module_count, info.module_bytes);
+    extern void pongo_module_print_footprint();
+    pongo_module_print_footprint();
+}
 void* phystokv(uint64_t paddr) {
     return (void*)(paddr - 0x800000000 + kCacheableView);
 }
@@ -968,7 +1105,7 @@ bool tte_walk_get(struct vm_space* vmspace, uint64_t va, uint64_t** tte_out) {
 }
 uint64_t paging_requests = 0;
 bool vm_fault(struct vm_space* vmspace, uint64_t vma, vm_protect_t fault_prot) {
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     if (vma >= vmspace->vm_space_base && vma < vmspace->vm_space_end) {
         // only MM managed ranges may handle page faults gracefully
         uint64_t vm_offset = (vma - vmspace->vm_space_base) / PAGE_SIZE;
@@ -985,14 +1122,14 @@ bool vm_fault(struct vm_space* vmspace, uint64_t vma, vm_protect_t fault_prot) {
                         //fiprintf(stderr, "should allocate physical for %llx\n", vma);
                         paging_requests++;
                         vm_space_map_page_physical_prot(vmspace, vma & ~0x3fff, ppage_alloc(), PROT_READ|PROT_WRITE);
-                        enable_interrupts();
+                        spinlock_release(&mm_lock);
                         return true;
                     }
                 }
             }
         }
     }
-    enable_interrupts();
+    spinlock_release(&mm_lock);
     return false;
 }
 void vm_release(struct vm_space* vmspace) {
@@ -1006,7 +1143,7 @@ void vm_release(struct vm_space* vmspace) {
 #endif
         vm_release(vmspace->parent);
         ttbpage_free_walk(vmspace->ttbr1 & 0xfffffffff000, true);
-        asid_free(vmspace->asid);
+        if (vmspace->asid_generation == asid_generation) asid_free(vmspace->asid);
         free(vmspace->vm_space_table);
         free(vmspace);
     }
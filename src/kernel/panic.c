@@ -39,6 +39,7 @@ void panic(const char* str, ...) {
     }
     panic_did_enter = 1;
     preemption_over = 1;
+    uart_force_flush(); // get out whatever was still queued before the panic message
     
     va_list va;
     va_start(va, str);
@@ -0,0 +1,162 @@
+/* 
+ * pongoOS - https://checkra.in
+ * 
+ * Copyright (C) 2019-2021 checkra1n team
+ *
+ * This file is part of pongoOS.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * 
+ */
+#include <pongo.h>
+
+struct task_group_work {
+    struct task_group* group;
+    void (*fn)(void* ctx);
+    void* ctx;
+};
+
+/*
+
+    Name: task_group_init
+    Description: prepares an empty task group; a group can be reused once task_group_join returned
+
+*/
+
+void task_group_init(struct task_group* group) {
+    group->pending = 0;
+    group->done.task_head = NULL;
+}
+
+static void task_group_finish(struct task_group* group) {
+    disable_interrupts();
+    if (!group->pending) panic("task_group_finish: group underflow");
+    if (--group->pending == 0) {
+        event_fire(&group->done);
+    }
+    enable_interrupts();
+}
+
+static void task_group_entry() {
+    struct task_group_work* work = task_current()->task_ctx;
+    work->fn(work->ctx);
+    struct task_group* group = work->group;
+    free(work);
+    task_group_finish(group);
+}
+
+/*
+
+    Name: task_group_spawn
+    Description: runs fn(ctx) in a new kernel task that counts towards group. The task is reaped by the scheduler
+                 once it returns, so callers only ever synchronize through task_group_join. The task is TASK_SMP, so fn
+                 may run on any online core.
+
+*/
+
+void task_group_spawn(struct task_group* group, const char* name, void (*fn)(void* ctx), void* ctx) {
+    struct task_group_work* work = malloc(sizeof(struct task_group_work));
+    if (!work) panic("task_group_spawn: out of memory");
+    work->group = group;
+    work->fn = fn;
+    work->ctx = ctx;
+
+    disable_interrupts();
+    group->pending++;
+    enable_interrupts();
+
+    struct task* task = task_create_extended(name, task_group_entry, TASK_PREEMPT|TASK_CAN_EXIT|TASK_SMP, 0);
+    task->task_ctx = work;
+    disable_interrupts();
+    task_link(task);
+    enable_interrupts();
+}
+
+/*
+
+    Name: task_group_join
+    Description: blocks until every task spawned into group has returned
+
+*/
+
+void task_group_join(struct task_group* group) {
+    disable_interrupts();
+    while (group->pending) {
+        event_wait_asserted(&group->done);
+        disable_interrupts();
+    }
+    enable_interrupts();
+}
+
+/*
+
+    Name: pongo_parallel_for
+    Description: calls fn(start, end, ctx) for consecutive [start, end) slices of [0, count), each at most chunk long.
+                 Slices are handed out from a shared cursor to one worker per online core (the caller being one of
+                 them); with a single core online everything runs inline on the caller, in order.
+
+*/
+
+struct parallel_for_job {
+    uint64_t next;
+    uint64_t count;
+    uint64_t chunk;
+    void (*fn)(uint64_t start, uint64_t end, void* ctx);
+    void* ctx;
+};
+
+static void parallel_for_worker(void* arg) {
+    struct parallel_for_job* job = arg;
+    while (1) {
+        uint64_t start = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED);
+        if (start >= job->count) break;
+        uint64_t end = job->count - start < job->chunk ? job->count : start + job->chunk;
+        job->fn(start, end, job->ctx);
+    }
+}
+
+void pongo_parallel_for(uint64_t count, uint64_t chunk, void (*fn)(uint64_t start, uint64_t end, void* ctx), void* ctx) {
+    if (!count) return;
+    if (!chunk || chunk > count) chunk = count;
+
+    struct parallel_for_job job = {
+        .next = 0,
+        .count = count,
+        .chunk = chunk,
+        .fn = fn,
+        .ctx = ctx,
+    };
+
+    uint64_t chunks = (count + chunk - 1) / chunk;
+    uint64_t workers = pongo_cpus_online();
+    if (workers > chunks) workers = chunks;
+
+    if (workers <= 1) {
+        parallel_for_worker(&job);
+        return;
+    }
+
+    struct task_group group;
+    task_group_init(&group);
+    for (uint64_t i = 1; i < workers; i++) {
+        task_group_spawn(&group, "parallel_for", parallel_for_worker, &job);
+    }
+    parallel_for_worker(&job);
+    task_group_join(&group);
+}
@@ -133,10 +133,40 @@ extern volatile char gBootFlag;
 #define LINUX_DTREE_SIZE 262144
 #define LINUX_CMDLINE_SIZE 4096
 
-typedef uint64_t lock;
-extern void lock_take(lock* lock); // takes a lock spinning initially but after being pre-empted once it will start yielding until it acquires it
+typedef struct lock {
+    uint64_t word; // [63:2 owner][1: waiters][0: held]
+    struct task* wait_head; // FIFO of blocked takers, lock_release hands ownership to the head
+    struct task* wait_tail;
+    uint64_t acquisitions; // contention statistics
+    uint64_t contentions;
+    uint64_t wait_ticks;
+} lock;
+typedef struct rwlock {
+    uint64_t state; // [63:2 readers][1: waiters][0: writer]
+    struct task* wait_head;
+    struct task* wait_tail;
+    uint64_t acquisitions;
+    uint64_t contentions;
+    uint64_t wait_ticks;
+} rwlock;
+extern void lock_take(lock* lock); // takes a lock, blocking until ownership is handed over by lock_release
 extern void lock_take_spin(lock* lock); // takes a lock spinning until it acquires it
+extern bool lock_try(lock* lock); // takes a lock if it is free, returns false otherwise
 extern void lock_release(lock* lock); // releases ownership on a lock
+extern void rwlock_read_take(rwlock* rw);
+extern void rwlock_write_take(rwlock* rw);
+extern bool rwlock_read_try(rwlock* rw);
+extern bool rwlock_write_try(rwlock* rw);
+extern void rwlock_read_release(rwlock* rw);
+extern void rwlock_write_release(rwlock* rw);
+typedef struct spinlock {
+    volatile uint32_t owner; // pongo_cpus index + 1, 0 when free
+    uint32_t depth;
+    uint64_t daif; // what spinlock_release restores
+} spinlock;
+extern void spinlock_take(spinlock* l); // masks interrupts on this core and spins, without taking the kernel lock
+extern void spinlock_release(spinlock* l);
+extern spinlock mm_lock; // physical pages, page tables, ASIDs and the heap
 
 extern int dt_check(void* mem, uint32_t size, uint32_t* offp);
 extern int dt_parse(dt_node_t* node, int depth, uint32_t* offp, int (*cb_node)(void*, dt_node_t*), void* cbn_arg, int (*cb_prop)(void*, dt_node_t*, int, const char*, void*, uint32_t), void* cbp_arg);
@@ -148,6 +178,8 @@ extern void task_yield_asserted();
 extern void _task_yield();
 extern uint8_t * loader_xfer_recv_data;
 extern uint32_t loader_xfer_recv_count;
+extern uint32_t usbloader_wait_upload();
+extern void* usbloader_copy_contig(uint32_t* size);
 extern uint32_t autoboot_count;
 extern uint64_t gBootTimeTicks;
 
@@ -165,11 +197,58 @@ extern void (*sepfw_kpf_hook)(void* sepfw_bytes, size_t sepfw_size);
 #define TASK_SPAWN 512
 #define TASK_FROM_PROC 1024
 #define TASK_PLEASE_DEREF 2048
+#define TASK_SMP 4096 // may be picked up by any online core, see task_rq_pick_next
+#define TASK_IRQ_PREEMPTED 8192 // switched out by irq_exc for a bottom half, resumes ahead of its peers
 
-#define TASK_TYPE_MASK TASK_IRQ_HANDLER|TASK_PREEMPT|TASK_LINKED|TASK_CAN_EXIT|TASK_RESTART_ON_EXIT|TASK_SPAWN
+#define TASK_TYPE_MASK TASK_IRQ_HANDLER|TASK_PREEMPT|TASK_LINKED|TASK_CAN_EXIT|TASK_RESTART_ON_EXIT|TASK_SPAWN|TASK_SMP
 #define TASK_REFCOUNT_GLOBAL 0x7fffffff
+
+#define TASK_PRIO_IRQ 0 // preempting irq handlers
+#define TASK_PRIO_HIGH 1
+#define TASK_PRIO_NORMAL 2
+#define TASK_PRIO_LOW 3
+#define TASK_PRIO_COUNT 4
+struct pongo_future;
 struct event {
 	struct task* task_head;
+	struct pongo_future* future_head; // completed by the next event_fire, see future_event
+	uint32_t fires;
+};
+struct waitq {
+    struct task* head;
+    struct task* tail;
+};
+struct semaphore {
+    int32_t count;
+    struct waitq waiters;
+};
+struct condvar {
+    struct waitq waiters;
+};
+struct irq_bottom_half {
+    struct event ev;
+    volatile uint32_t pending;
+};
+#define IRQ_HANDLED 0
+#define IRQ_WAKE_BOTTOM 1 // kick the bottom half registered along with the top half
+#define IRQ_KEEP_MASKED 2 // leave the interrupt masked, whoever finishes the work unmasks it
+struct task_group {
+    uint32_t pending;
+    struct event done;
+};
+#define FUTURE_IDLE 0 // zero-initialised, never started; awaiting it returns right away
+#define FUTURE_PENDING 1
+#define FUTURE_DONE 2
+struct pongo_future {
+    volatile uint32_t state;
+    int64_t value;
+    struct waitq waiters;
+    void (*then)(struct pongo_future* f, void* ctx); // continuation, runs in the completer's context
+    void* then_ctx;
+    struct pongo_timer timer; // backs future_sleep
+    struct event* event; // backs future_event
+    struct pongo_future* event_next;
+    uint32_t event_fires;
 };
 
 extern struct vm_space kernel_vm_space;
@@ -233,6 +312,21 @@ extern struct task* proc_create_task(struct proc* proc, void* entrypoint);
 #define PROC_NO_VM 1
 extern uint32_t loader_xfer_recv_size;
 extern void resize_loader_xfer_data(uint32_t newsz);
+#define UPLOADSZ_MAX (1024 * 1024 * 128)
+#define UPLOAD_SLOTS 8
+#define UPLOAD_SLOT_NAME_MAX 32
+struct upload_buffer {
+    uint8_t* data; // virtually contiguous, UPLOADSZ_MAX of VA
+    uint32_t size; // bytes mapped
+    uint32_t count; // bytes uploaded
+    uint32_t page_count;
+    struct upload_buffer* next;
+    uint64_t pages[UPLOADSZ_MAX / PAGE_SIZE];
+};
+extern bool upload_ready(const char* name);
+extern struct upload_buffer* upload_take(const char* name);
+extern void upload_release(struct upload_buffer* buf);
+extern void upload_grow(struct upload_buffer* buf, uint32_t newsz);
 extern bool vm_fault(struct vm_space* vmspace, uint64_t vma, vm_protect_t fault_prot);
 extern err_t map_physical_range(struct vm_space* vmspace, uint64_t* va, uint64_t pa, uint32_t size, vm_flags_t flags, vm_protect_t prot);
 extern struct vm_space* task_vm_space(struct task*);
@@ -249,6 +343,8 @@ extern err_t vm_allocate(struct vm_space* vmspace, uint64_t* addr, uint64_t size
 extern err_t vm_deallocate(struct vm_space* vmspace, uint64_t addr, uint64_t size);
 extern void vm_flush(struct vm_space* fl);
 extern void vm_flush_by_addr(struct vm_space* fl, uint64_t va);
+extern uint64_t vm_asid_validate(struct vm_space* vmspace);
+extern void task_vm_activate(struct task* task);
 extern size_t memcpy_trap(void* dest, void* src, size_t size);
 extern void task_critical_enter();
 extern void task_critical_exit();
@@ -260,6 +356,7 @@ extern uint64_t gIOBase;
 extern uint64_t gPMGRBase;
 extern char* gDevType;
 extern void* ramdisk_buf;
+extern void* raw_boot_image;
 extern uint32_t ramdisk_size;
 extern char soc_name[9];
 extern uint32_t socnum;
@@ -392,9 +489,40 @@ extern void task_release(struct task* task);
 extern void event_wait_asserted(struct event* ev);
 extern void event_wait(struct event* ev);
 extern void event_fire(struct event* ev);
+extern bool event_wait_timeout(struct event* ev, uint64_t timeout_us);
+extern void semaphore_init(struct semaphore* sem, int32_t count);
+extern void semaphore_wait(struct semaphore* sem);
+extern bool semaphore_wait_timeout(struct semaphore* sem, uint64_t timeout_us);
+extern bool semaphore_try(struct semaphore* sem);
+extern void semaphore_signal(struct semaphore* sem);
+extern void condvar_init(struct condvar* cv);
+extern void condvar_wait(struct condvar* cv, lock* l);
+extern bool condvar_wait_timeout(struct condvar* cv, lock* l, uint64_t timeout_us);
+extern void condvar_signal(struct condvar* cv);
+extern void condvar_broadcast(struct condvar* cv);
+extern void future_init(struct pongo_future* f);
+extern bool future_pending(struct pongo_future* f);
+extern void future_complete(struct pongo_future* f, int64_t value);
+extern void future_then(struct pongo_future* f, void (*then)(struct pongo_future* f, void* ctx), void* ctx);
+extern int64_t future_await(struct pongo_future* f);
+extern bool future_await_timeout(struct pongo_future* f, uint64_t timeout_us, int64_t* value);
+extern void future_sleep(struct pongo_future* f, uint64_t timeout_us);
+extern void future_cancel(struct pongo_future* f, int64_t value);
+extern void future_event(struct pongo_future* f, struct event* ev);
+extern void task_sleep_until(uint64_t deadline); // deadline in get_ticks() units
+extern void task_sleep_tick();
+extern uint64_t task_sleep_next_deadline();
+extern void task_group_init(struct task_group* group);
+extern void task_group_spawn(struct task_group* group, const char* name, void (*fn)(void* ctx), void* ctx);
+extern void task_group_join(struct task_group* group);
+extern void pongo_parallel_for(uint64_t count, uint64_t chunk, void (*fn)(uint64_t start, uint64_t end, void* ctx), void* ctx);
 extern void* alloc_static(uint32_t size); // memory returned by this will be added to the xnu static region, thus will persist after xnu boot
 extern void task_bind_to_irq(struct task* task, int irq);
-extern struct event command_handler_iter;
+extern void irq_register_top_half(uint16_t irq_v, const char* name, int (*handler)(uint32_t irq, void* ctx), void* ctx, struct irq_bottom_half* bottom);
+extern void irq_bottom_half_kick(struct irq_bottom_half* bh);
+extern void irq_bottom_half_wait(struct irq_bottom_half* bh);
+extern uint64_t command_handler_generation();
+extern void command_wait_for_prompt(uint64_t gen); // blocks until the shell is back at its prompt after gen
 
 #ifdef memset
 #   undef memset
@@ -421,7 +549,13 @@ extern _Noreturn __attribute__((format(printf, 1, 2))) void panic(const char* st
 extern void pmgr_reset();
 extern void spin(uint32_t usec);
 extern void task_set_sched_head(struct task* task);
+extern void task_set_priority(struct task* task, uint32_t priority);
+extern struct task* task_rq_pick_next();
+extern bool task_rq_empty();
+extern bool task_rq_irq_preempts(struct task* task);
+extern void task_sched_return(struct task* task);
 extern void enable_interrupts();
+extern void enable_interrupts_asserted(); // drops one level without unmasking, for paths that return through an eret
 extern void disable_interrupts();
 extern uint64_t get_ticks();
 extern void usleep(uint64_t usec);
@@ -431,6 +565,9 @@ extern uint64_t dt_get_u64_prop(const char* device, const char* prop);
 extern uint64_t dt_get_u64_prop_i(const char* device, const char* prop, uint32_t idx);
 extern void unmask_interrupt(uint32_t reg);
 extern void mask_interrupt(uint32_t reg);
+extern uint32_t interrupt_whoami(); // the AIC's number for the calling core
+extern void interrupt_ipi_send(uint32_t aic_cpu);
+extern void interrupt_ipi_set_enabled(bool enabled); // for the calling core
 extern _Noreturn void wdt_reset();
 extern void wdt_enable();
 extern void wdt_disable();
@@ -442,12 +579,21 @@ extern void opuntia_prep_boot();
 extern void opuntia_boot();
 extern void command_register(const char* name, const char* desc, void (*cb)(const char* cmd, char* args));
 extern char* command_tokenize(char* str, uint32_t strbufsz);
+struct console_sink {
+    const char* name;
+    void (*write)(const char* buf, size_t len);
+    void (*flush)(void); // optional, called once after each write
+    volatile bool enabled;
+};
+extern bool console_sink_register(const char* name, void (*write)(const char* buf, size_t len), void (*flush)(void));
+extern bool console_sink_set_enabled(const char* name, bool enabled);
 extern uint8_t get_el(void);
 extern uint64_t vatophys(uint64_t kvaddr);
 extern void* phystokv(uint64_t paddr);
 extern void cache_invalidate(void *address, size_t size);
 extern void cache_clean_and_invalidate(void *address, size_t size);
 extern void cache_clean(void *address, size_t size);
+extern void cache_clean_rect(void *address, size_t stride, size_t width, size_t rows);
 extern void register_irq_handler(uint16_t irq_v, struct task* irq_handler);
 extern uint64_t device_clock_by_id(uint32_t id);
 extern uint64_t device_clock_by_name(const char *name);
@@ -456,6 +602,136 @@ extern void disable_preemption();
 extern void enable_preemption();
 extern void* alloc_contig(uint32_t size);
 extern uint64_t alloc_phys(uint32_t size);
+
+#define PONGO_MAX_CPUS 16
+#define PONGO_MPIDR_AFF_MASK 0xffffffULL
+#define PONGO_CPU_OFF 0
+#define PONGO_CPU_STARTING 1 // kicked, hasn't checked in yet
+#define PONGO_CPU_ONLINE 2
+#define PONGO_CPU_PARKING 3  // asked to stop once it is back in its scheduler
+#define PONGO_CPU_FAILED 4   // never checked in, parks itself if it shows up late
+struct pongo_cpu {
+    uint32_t index;
+    uint32_t cpu_id;
+    uint64_t mpidr;
+    uint32_t cluster_id;
+    char cluster_type;
+    volatile uint32_t state; // PONGO_CPU_*
+    uint64_t impl_reg;
+    uint64_t impl_reg_size;
+    uint64_t iorvbar; // 0 if the device tree didn't tell us where it is
+    uint64_t iorvbar_saved; // whatever iBoot left there, put back before booting
+    char dt_state[16];
+    uint64_t int_depth; // interrupt masking depth on this core, see disable_interrupts
+    struct task* sched; // the task this core schedules from
+    uint32_t preempt_ctr;
+    uint32_t aic_id; // target for interrupt_ipi_send
+    volatile bool idle; // in WFI with nothing to do, set and cleared under the kernel lock
+};
+extern struct pongo_cpu pongo_cpus[PONGO_MAX_CPUS];
+extern uint32_t pongo_cpu_count;
+extern uint32_t cpu_number(void);
+extern uint32_t pongo_cpus_online(void);
+extern uint32_t smp_start_secondaries(void);
+extern void smp_kick(uint32_t cpu, bool any);
+static inline struct pongo_cpu* pongo_cpu_self(void)
+{
+    uint64_t index;
+    __asm__ volatile("mrs %0, tpidrro_el0" : "=r"(index)); // set by the reset path of every core, 0 on the boot core
+    return &pongo_cpus[index];
+}
+
+#define PONGO_MEMINFO_VERSION 1
+#define PONGO_MEMINFO_RUN_BUCKETS 16 // bucket n counts free runs of [2^n, 2^(n+1)) pages, the last one is open-ended
+struct pongo_meminfo {
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t total_pages;
+    uint64_t free_pages;
+    uint64_t wired_pages;
+    uint64_t referenced_pages;
+    uint64_t free_runs;
+    uint64_t largest_free_run; // in pages
+    uint64_t free_run_histogram[PONGO_MEMINFO_RUN_BUCKETS];
+    uint64_t paging_requests;
+    uint64_t static_used;
+    uint64_t static_size;
+    uint64_t heap_used;       // bytes handed out by _sbrk
+    uint64_t heap_mapped;     // bytes backed by pages
+    uint64_t linear_kvm_used;
+    uint64_t linear_kvm_size;
+    uint64_t jit_pages;
+    uint64_t module_count;
+    uint64_t module_bytes;
+} __attribute__((packed));
+extern void pongo_meminfo_collect(struct pongo_meminfo* info);
+extern void pongo_module_footprint(uint64_t* count, uint64_t* bytes);
+
+#define PONGO_TRACE_MAGIC 0x43525450 // 'PTRC'
+#define PONGO_TRACE_VERSION 1
+#define PONGO_TRACE_SWITCH 1         // pid: previous task, arg0: next pid, arg1: first 8 bytes of the next task's name
+#define PONGO_TRACE_IRQ_ENTER 2      // arg0: interrupt number
+#define PONGO_TRACE_IRQ_EXIT 3
+#define PONGO_TRACE_FIQ_ENTER 4
+#define PONGO_TRACE_FIQ_EXIT 5
+#define PONGO_TRACE_LOCK_CONTENDED 6 // arg0: lock address, arg1: ticks spent waiting
+#define PONGO_TRACE_FAULT 7          // arg0: FAR, arg1: ESR
+#define PONGO_TRACE_MODULE_LOAD 8    // arg0: module base, arg1: size
+#define PONGO_TRACE_USER 0x100       // types from here on are free for modules
+struct pongo_trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;    // events following the header
+    uint32_t dropped;  // events overwritten before they could be read
+    uint32_t tick_hz;
+} __attribute__((packed));
+struct pongo_trace_event {
+    uint64_t ticks;
+    uint32_t type;
+    uint32_t pid;
+    uint64_t arg0;
+    uint64_t arg1;
+} __attribute__((packed));
+extern volatile bool pongo_trace_enabled;
+extern void pongo_trace_record(uint32_t type, uint64_t arg0, uint64_t arg1);
+extern void pongo_trace_switch(struct task* prev, struct task* next);
+extern size_t pongo_trace_read(void* buf, size_t size);
+extern void pongo_trace_clear();
+extern void pongo_trace_set_enabled(bool enabled);
+#define PONGO_TRACE(type, arg0, arg1) do { if (pongo_trace_enabled) pongo_trace_record((type), (arg0), (arg1)); } while (0)
+
+#define PONGO_PROFILE_MAGIC 0x464f5250 // 'PROF'
+#define PONGO_PROFILE_VERSION 1
+#define PONGO_PROFILE_DEPTH 8 // frames[0] is the interrupted PC, the rest are return addresses
+struct pongo_profile_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t depth;
+    uint32_t count;    // buckets following the header
+    uint32_t next;     // cursor for the next request, equal to buckets once everything was read
+    uint32_t buckets;
+    uint32_t reserved;
+    uint64_t samples;
+    uint64_t overflow; // samples dropped because the table was full
+    uint64_t anchor;   // runtime address of pongo_profile_read, to slide the Pongo Mach-O
+} __attribute__((packed));
+struct pongo_profile_bucket {
+    uint32_t count;
+    uint32_t pid;
+    uint32_t depth;
+    uint32_t reserved;
+    uint64_t frames[PONGO_PROFILE_DEPTH];
+} __attribute__((packed));
+struct pongo_module_map_entry {
+    uint64_t vm_base;
+    uint64_t vm_end;
+    char name[48];
+} __attribute__((packed));
+extern volatile bool pongo_profile_enabled;
+extern void pongo_profile_sample(uint64_t* state);
+extern size_t pongo_profile_read(uint32_t cursor, void* buf, size_t size);
+extern void pongo_profile_clear();
+extern size_t pongo_module_map(struct pongo_module_map_entry* out, size_t max);
 extern void task_suspend_self_asserted();
 extern void command_execute(char* cmd);
 extern void queue_rx_string(char* string);
@@ -475,6 +751,10 @@ extern uint64_t vatophys_force(uint64_t kvaddr);
 extern volatile uint8_t command_in_progress;
 extern void set_stdout_blocking(bool block);
 extern void fetch_stdoutbuf(char* to, int* len);
+extern size_t stdout_ring_read(char* to, size_t max);
+extern uint64_t stdout_dropped();
+extern bool usb_stdout_streaming();
+extern size_t usb_stdout_stream_write(const char* data, size_t size);
 extern void usbloader_init();
 extern void pmgr_init();
 extern void command_init();
@@ -504,10 +784,24 @@ static inline _Bool is_16k(void)
 static inline void flush_tlb(void)
 {
     __asm__ volatile("isb");
-    __asm__ volatile("tlbi vmalle1\n");
+    __asm__ volatile("tlbi vmalle1is\n");
     __asm__ volatile("dsb sy");
 }
 extern void task_real_unlink(struct task* task);
+extern void smp_init(void);
+extern void smp_teardown(void);
+extern void kernel_lock_take(void);
+extern void kernel_lock_drop(void);
+static inline uint64_t dis_int_depth(void)
+{
+    // an unmasked task can move to another core between finding its core and reading the count, keep it here
+    uint64_t daif;
+    __asm__ volatile("mrs %0, daif\n msr daifset, #0xf" : "=r"(daif));
+    uint64_t depth = pongo_cpu_self()->int_depth;
+    __asm__ volatile("msr daif, %0" : : "r"(daif));
+    return depth;
+}
+#define dis_int_count dis_int_depth() // only written by lowlevel.c, through pongo_cpu_self() with interrupts masked
 #include "hal/hal.h"
 
 #endif
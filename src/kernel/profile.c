@@ -0,0 +1,172 @@
+/* 
+ * pongoOS - https://checkra.in
+ * 
+ * Copyright (C) 2019-2021 checkra1n team
+ *
+ * This file is part of pongoOS.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * 
+ */
+#include <pongo.h>
+
+/*
+
+    Name: sampling profiler
+    Description: every scheduler FIQ (1ms) records the interrupted PC, the running task and a short frame-pointer
+                 backtrace. Identical stacks are folded into one bucket of an open-addressed hash table, so the host
+                 only ever has to pull the distinct stacks plus their hit counts.
+
+*/
+
+#define PROFILE_BUCKETS 1024 // power of two
+#define PROFILE_PROBES 16
+#define PROFILE_STACK_SPAN 0x40000 // frames further than this above the interrupted SP are considered garbage
+
+volatile bool pongo_profile_enabled;
+static struct pongo_profile_bucket profile_table[PROFILE_BUCKETS];
+static uint64_t profile_samples;
+static uint64_t profile_overflow;
+
+static uint64_t profile_hash(const struct pongo_profile_bucket* b) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ b->pid;
+    for (uint32_t i = 0; i < b->depth; i++) {
+        h ^= b->frames[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+static uint32_t profile_backtrace(uint64_t* state, uint64_t* frames, uint32_t max) {
+    struct task* t = task_current();
+    uint32_t depth = 0;
+    frames[depth++] = state[0x100/8]; // ELR
+    // memcpy_trap relies on fault_catch and print_state skips critical sections for the same reason
+    if (!t || t->fault_catch || t->critical_count) return depth;
+
+    uint64_t sp = state[0x118/8];
+    uint64_t fp = state[29];
+    uint64_t frame[2];
+    while (depth < max && fp && !(fp & 7) && fp >= sp && fp - sp < PROFILE_STACK_SPAN) {
+        if (memcpy_trap(frame, (void*)fp, sizeof(frame)) != sizeof(frame)) break;
+        if (!frame[1]) break;
+        frames[depth++] = frame[1];
+        if (frame[0] <= fp) break; // frames grow towards higher addresses
+        fp = frame[0];
+    }
+    return depth;
+}
+
+/*
+
+    Name: pongo_profile_sample
+    Description: called from the FIQ handler with the saved exception state while profiling is on
+
+*/
+
+void pongo_profile_sample(uint64_t* state) {
+    struct pongo_profile_bucket sample = {};
+    struct task* t = task_current();
+    sample.pid = t ? t->pid : 0;
+    sample.depth = profile_backtrace(state, sample.frames, PONGO_PROFILE_DEPTH);
+
+    uint64_t h = profile_hash(&sample);
+    disable_interrupts();
+    profile_samples++;
+    for (uint32_t i = 0; i < PROFILE_PROBES; i++) {
+        struct pongo_profile_bucket* b = &profile_table[(h + i) & (PROFILE_BUCKETS - 1)];
+        if (!b->count) {
+            *b = sample;
+            b->count = 1;
+            goto out;
+        }
+        if (b->pid == sample.pid && b->depth == sample.depth && memcmp(b->frames, sample.frames, sample.depth * sizeof(uint64_t)) == 0) {
+            b->count++;
+            goto out;
+        }
+    }
+    profile_overflow++;
+out:
+    enable_interrupts();
+}
+
+/*
+
+    Name: pongo_profile_read
+    Description: copies the non-empty buckets starting at index cursor into buf behind a pongo_profile_header
+    Return values: number of bytes written; header->next is the cursor to continue from, PROFILE_BUCKETS when done
+
+*/
+
+size_t pongo_profile_read(uint32_t cursor, void* buf, size_t size) {
+    if (size < sizeof(struct pongo_profile_header)) return 0;
+    struct pongo_profile_header* hdr = buf;
+    struct pongo_profile_bucket* out = (struct pongo_profile_bucket*)(hdr + 1);
+    size_t max = (size - sizeof(*hdr)) / sizeof(struct pongo_profile_bucket);
+    uint32_t count = 0;
+
+    disable_interrupts();
+    while (cursor < PROFILE_BUCKETS && count < max) {
+        if (profile_table[cursor].count) {
+            out[count++] = profile_table[cursor];
+        }
+        cursor++;
+    }
+    hdr->magic = PONGO_PROFILE_MAGIC;
+    hdr->version = PONGO_PROFILE_VERSION;
+    hdr->depth = PONGO_PROFILE_DEPTH;
+    hdr->count = count;
+    hdr->next = cursor;
+    hdr->buckets = PROFILE_BUCKETS;
+    hdr->samples = profile_samples;
+    hdr->overflow = profile_overflow;
+    hdr->anchor = (uint64_t)&pongo_profile_read;
+    enable_interrupts();
+
+    return sizeof(*hdr) + count * sizeof(struct pongo_profile_bucket);
+}
+
+void pongo_profile_clear() {
+    disable_interrupts();
+    bzero(profile_table, sizeof(profile_table));
+    profile_samples = 0;
+    profile_overflow = 0;
+    enable_interrupts();
+}
+
+void profile_cmd(const char* cmd, char* args) {
+    if (strcmp(args, "on") == 0) {
+        pongo_profile_enabled = true;
+    } else if (strcmp(args, "off") == 0) {
+        pongo_profile_enabled = false;
+    } else if (strcmp(args, "clear") == 0) {
+        pongo_profile_clear();
+    } else if (args[0]) {
+        iprintf("usage: profile [on|off|clear]\n");
+        return;
+    }
+    uint32_t used = 0;
+    disable_interrupts();
+    for (uint32_t i = 0; i < PROFILE_BUCKETS; i++) {
+        if (profile_table[i].count) used++;
+    }
+    uint64_t samples = profile_samples, overflow = profile_overflow;
+    enable_interrupts();
+    iprintf("profiling %s, %llu samples in %u/%u stacks, %llu dropped\n", pongo_profile_enabled ? "on" : "off", samples, used, PROFILE_BUCKETS, overflow);
+}
@@ -0,0 +1,459 @@
+/* 
+ * pongoOS - https://checkra.in
+ * 
+ * Copyright (C) 2019-2021 checkra1n team
+ *
+ * This file is part of pongoOS.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * 
+ */
+#include <pongo.h>
+
+/*
+
+    The boot core always sits in slot 0 of pongo_cpus, the other cores described by the device tree follow. Each
+    core finds its slot through TPIDRRO_EL0, which its reset path sets up. Secondary cores only run when asked to
+    (cpus start, or smp_start_secondaries from a module) and only pick up TASK_SMP tasks; everything else keeps
+    running on the boot core exactly as before. See disable_interrupts for how the kernel is kept consistent.
+    This is experimental: the cpu start registers are only known for the SoCs in smp_socs and not verified on all of them.
+
+*/
+
+struct pongo_cpu pongo_cpus[PONGO_MAX_CPUS] = {
+    [0] = { .int_depth = 1 }, // the boot core comes up with interrupts masked and the kernel lock held
+};
+uint32_t pongo_cpu_count = 0;
+
+/*
+
+    Name: cpu_number
+    Description: returns the index into pongo_cpus of the core we are running on
+
+*/
+
+uint32_t cpu_number(void)
+{
+    return pongo_cpu_self() - pongo_cpus;
+}
+
+/*
+
+    Name: pongo_cpus_online
+    Description: returns the number of cores that are currently taking work
+
+*/
+
+uint32_t pongo_cpus_online(void)
+{
+    uint32_t online = 0;
+    for (uint32_t i = 0; i < pongo_cpu_count; i++) {
+        if (pongo_cpus[i].state == PONGO_CPU_ONLINE) online++;
+    }
+    return online ? online : 1;
+}
+
+static dt_node_t* smp_find_cpu(uint32_t idx)
+{
+    char name[8] = "cpu";
+    if (idx >= 10) {
+        name[3] = '0' + idx / 10;
+        name[4] = '0' + idx % 10;
+    } else {
+        name[3] = '0' + idx;
+    }
+    return dt_find(gDeviceTree, name);
+}
+
+static void smp_describe_cpu(struct pongo_cpu* cpu, dt_node_t* node, uint32_t idx, uint64_t mpidr)
+{
+    uint32_t len = 0;
+    uint32_t* u32 = dt_prop(node, "cpu-id", &len);
+    cpu->cpu_id = (u32 && len >= 4) ? *u32 : idx;
+    cpu->mpidr = mpidr;
+
+    u32 = dt_prop(node, "cluster-id", &len);
+    cpu->cluster_id = (u32 && len >= 4) ? *u32 : 0;
+
+    u32 = dt_prop(node, "cluster-type", &len);
+    cpu->cluster_type = (u32 && len >= 1) ? *(char*)u32 : '?';
+
+    uint64_t* u64 = dt_prop(node, "cpu-impl-reg", &len);
+    if (u64 && len >= 16) {
+        cpu->impl_reg = u64[0];
+        cpu->impl_reg_size = u64[1];
+    }
+
+    // IORVBAR lives at reg-private + 0x40000, see iorvbar_yeet
+    u64 = dt_prop(node, "reg-private", &len);
+    if (u64 && len >= 8) {
+        cpu->iorvbar = gIOBase + u64[0] + 0x40000;
+        cpu->iorvbar_saved = *(volatile uint64_t*)cpu->iorvbar;
+    }
+
+    char* state = dt_prop(node, "state", &len);
+    if (state && len) {
+        strncpy(cpu->dt_state, state, sizeof(cpu->dt_state) - 1);
+    }
+}
+
+/*
+
+    Name: smp_init
+    Description: enumerates the cpus node of the device tree, putting the core we booted on in slot 0. Only fills in
+                 descriptive fields: slot 0 is live already, it holds the masking depth of the code calling us.
+
+*/
+
+void smp_init(void)
+{
+    uint64_t boot_mpidr = get_mpidr() & PONGO_MPIDR_AFF_MASK;
+    pongo_cpus[0].mpidr = boot_mpidr;
+    pongo_cpus[0].cluster_type = '?';
+    pongo_cpus[0].state = PONGO_CPU_ONLINE;
+    pongo_cpu_count = 1;
+
+    for (uint32_t i = 0; i < PONGO_MAX_CPUS; i++) {
+        dt_node_t* node = smp_find_cpu(i);
+        if (!node) break;
+
+        uint32_t len = 0;
+        uint32_t* reg = dt_prop(node, "reg", &len);
+        uint64_t mpidr = (reg && len >= 4) ? (*reg & PONGO_MPIDR_AFF_MASK) : i;
+
+        struct pongo_cpu* cpu = NULL;
+        if (mpidr == boot_mpidr) {
+            cpu = &pongo_cpus[0];
+        } else if (pongo_cpu_count < PONGO_MAX_CPUS) {
+            cpu = &pongo_cpus[pongo_cpu_count];
+            cpu->index = pongo_cpu_count++;
+        } else {
+            continue;
+        }
+        smp_describe_cpu(cpu, node, i, mpidr);
+    }
+}
+
+/*
+
+    Name: secondary bring-up
+    Description: a core is started by pointing its IORVBAR at smp_secondary_reset (smp_entry.S) and setting its
+                 bit in the PMGR cpu start registers. The reset path runs with the MMU off and takes everything it
+                 needs from smp_boot_args, so cores are started one at a time. The register layout is the one
+                 publicly documented for later Apple SoCs (set the core in +0x4, start it in +0x8 + 4 * cluster)
+                 at the per-generation offsets below; it has not been verified on every SoC in the table, which is
+                 why none of this runs unless asked for, it warns every time, and a core that doesn't check in is
+                 simply given up on.
+
+*/
+
+struct smp_boot_args { // layout shared with smp_entry.S
+    uint64_t cpu;
+    uint64_t mair;
+    uint64_t tcr;
+    uint64_t ttbr0;
+    uint64_t ttbr1;
+    uint64_t sctlr;
+    uint64_t vbar;
+    uint64_t task;
+    uint64_t stack;
+    uint64_t exception_stack;
+    uint64_t entry;
+};
+struct smp_boot_args smp_boot_args;
+
+static const struct {
+    uint32_t socnum;
+    uint64_t cpu_start; // from gPMGRBase
+} smp_socs[] = {
+    { 0x8960, 0x30000 },
+    { 0x7000, 0x30000 },
+    { 0x7001, 0x30000 },
+    { 0x8000, 0xd4000 },
+    { 0x8001, 0xd4000 },
+    { 0x8003, 0xd4000 },
+    { 0x8010, 0xd4000 },
+    { 0x8011, 0xd4000 },
+    { 0x8012, 0xd4000 },
+    { 0x8015, 0xd4000 },
+};
+
+#define SMP_CHECKIN_TIMEOUT_MS 100
+#define SMP_PARK_TIMEOUT_MS 1000
+
+extern char smp_secondary_reset[];
+extern _Noreturn void smp_park(void);
+extern char pongo_sched_tick();
+extern void pongo_idle();
+extern struct task sched_task;
+extern uint64_t gPongoSlide;
+
+static uint64_t smp_cpu_start_base(void)
+{
+    if (!gPMGRBase) return 0;
+    for (uint32_t i = 0; i < sizeof(smp_socs) / sizeof(smp_socs[0]); i++) {
+        if (smp_socs[i].socnum == socnum) return gPMGRBase + smp_socs[i].cpu_start;
+    }
+    return 0;
+}
+
+static void smp_secondary_main(void)
+{
+    disable_interrupts();
+    struct pongo_cpu* cpu = pongo_cpu_self();
+    if (cpu->state != PONGO_CPU_STARTING) {
+        // we were given up on, stay out of the way
+        enable_interrupts_asserted();
+        smp_park();
+    }
+    timer_init();
+    timer_rearm();
+    cpu->aic_id = interrupt_whoami();
+    interrupt_ipi_set_enabled(true);
+    cpu->state = PONGO_CPU_ONLINE;
+    enable_interrupts();
+
+    while (cpu->state == PONGO_CPU_ONLINE) {
+        if (pongo_sched_tick() == 2) {
+            pongo_idle();
+        }
+    }
+
+    disable_interrupts();
+    timer_disable();
+    interrupt_ipi_set_enabled(false);
+    cpu->state = PONGO_CPU_OFF; // whatever is left on our run queue gets stolen by the boot core
+    enable_interrupts_asserted(); // lets go of the kernel lock, interrupts stay masked for good
+    smp_park();
+}
+
+static struct task* smp_sched_task(struct pongo_cpu* cpu)
+{
+    struct task* task = malloc(sizeof(struct task));
+    if (!task) panic("smp_sched_task: out of memory");
+    bzero(task, sizeof(struct task));
+    siprintf(task->name, "sched%u", cpu->index);
+    task->cpu = cpu->index;
+    task->refcount = TASK_REFCOUNT_GLOBAL;
+    task->vm_space = &kernel_vm_space;
+    task->proc = sched_task.proc;
+    task->cpsr = 0x205;
+    task->ttbr0 = kernel_vm_space.ttbr0;
+    task->ttbr1 = kernel_vm_space.ttbr1 | kernel_vm_space.asid;
+    task_alloc_fast_stacks(task);
+    return task;
+}
+
+static bool smp_start_cpu(struct pongo_cpu* cpu, uint64_t start_base)
+{
+    if (cpu->state == PONGO_CPU_ONLINE) return true;
+    if (cpu->state != PONGO_CPU_OFF) return false; // failed before or still parking
+    if (!cpu->iorvbar) {
+        iprintf("cpu%u: no reg-private in the device tree\n", cpu->index);
+        return false;
+    }
+    if (cpu->iorvbar_saved & 1) {
+        iprintf("cpu%u: IORVBAR is locked\n", cpu->index);
+        return false;
+    }
+    uint64_t reset = (uint64_t)smp_secondary_reset - gPongoSlide;
+    if (reset & ~0xffffff800ULL) panic("smp_start_cpu: reset vector 0x%llx can't go in IORVBAR", reset);
+
+    if (!cpu->sched) cpu->sched = smp_sched_task(cpu);
+    struct task* sched = cpu->sched;
+
+    uint64_t mair, tcr, sctlr;
+    __asm__ volatile("mrs %0, mair_el1" : "=r"(mair));
+    __asm__ volatile("mrs %0, tcr_el1" : "=r"(tcr));
+    __asm__ volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
+    smp_boot_args = (struct smp_boot_args) {
+        .cpu = cpu->index,
+        .mair = mair,
+        .tcr = tcr,
+        .ttbr0 = kernel_vm_space.ttbr0,
+        .ttbr1 = sched->ttbr1,
+        .sctlr = sctlr,
+        .vbar = (uint64_t)&exception_vector,
+        .task = (uint64_t)sched,
+        .stack = sched->kernel_stack & ~0xfULL,
+        .exception_stack = sched->exception_stack,
+        .entry = (uint64_t)smp_secondary_main,
+    };
+    // the reset path reads both with the MMU and caches off
+    cache_clean(&smp_boot_args, sizeof(smp_boot_args));
+    cache_clean(smp_secondary_reset, 0x800);
+
+    cpu->int_depth = 0;
+    cpu->preempt_ctr = 0;
+    cpu->state = PONGO_CPU_STARTING;
+    __asm__ volatile("dsb sy");
+
+    volatile uint64_t* iorvbar = (volatile uint64_t*)cpu->iorvbar;
+    *iorvbar = reset;
+    __asm__ volatile("dmb sy");
+    if ((*iorvbar & 0xffffff800ULL) != reset) {
+        iprintf("cpu%u: IORVBAR didn't take 0x%llx\n", cpu->index, reset);
+        *iorvbar = cpu->iorvbar_saved;
+        cpu->state = PONGO_CPU_OFF;
+        return false;
+    }
+
+    uint32_t core = cpu->mpidr & 0xff;
+    volatile uint32_t* start = (volatile uint32_t*)start_base;
+    start[1] |= 1 << (4 * cpu->cluster_id + core);
+    start[2 + cpu->cluster_id] = 1 << core;
+
+    uint64_t deadline = get_ticks() + SMP_CHECKIN_TIMEOUT_MS * TICKS_IN_1MS;
+    while (cpu->state == PONGO_CPU_STARTING && get_ticks() < deadline) {
+        task_yield();
+    }
+    disable_interrupts();
+    bool online = cpu->state == PONGO_CPU_ONLINE;
+    if (!online) cpu->state = PONGO_CPU_FAILED;
+    enable_interrupts();
+    if (!online) {
+        iprintf("cpu%u: didn't check in\n", cpu->index);
+        *iorvbar = cpu->iorvbar_saved;
+    }
+    return online;
+}
+
+/*
+
+    Name: smp_start_secondaries
+    Description: starts every core the device tree describes that isn't running yet, returns the number of cores
+                 online afterwards. Must be called from a task with interrupts enabled.
+
+*/
+
+uint32_t smp_start_secondaries(void)
+{
+    static lock smp_start_lock;
+    if (gBootFlag) return pongo_cpus_online();
+    uint64_t start_base = smp_cpu_start_base();
+    if (!start_base) {
+        iprintf("don't know how to start cores on %s\n", soc_name);
+        return pongo_cpus_online();
+    }
+    iprintf("warning: starting secondary cores is experimental, the %s cpu start registers are unverified\n", soc_name);
+    lock_take(&smp_start_lock);
+    disable_interrupts();
+    pongo_cpus[0].aic_id = interrupt_whoami();
+    interrupt_ipi_set_enabled(true);
+    enable_interrupts();
+    for (uint32_t i = 1; i < pongo_cpu_count; i++) {
+        smp_start_cpu(&pongo_cpus[i], start_base);
+    }
+    lock_release(&smp_start_lock);
+    return pongo_cpus_online();
+}
+
+/*
+
+    Name: smp_teardown
+    Description: called on the boot core right before booting. Waits for every secondary core to get back to its
+                 scheduler and park itself, then puts back the IORVBAR values iBoot left so recfg_soc_sync and the
+                 next kernel see them untouched. A core that doesn't park would keep running Pongo code over
+                 whatever gets booted, so that is fatal.
+
+*/
+
+void smp_teardown(void)
+{
+    for (uint32_t i = 1; i < pongo_cpu_count; i++) {
+        struct pongo_cpu* cpu = &pongo_cpus[i];
+        disable_interrupts();
+        if (cpu->state == PONGO_CPU_ONLINE) {
+            cpu->state = PONGO_CPU_PARKING;
+            interrupt_ipi_send(cpu->aic_id); // it may be sitting in WFI with no tick
+        }
+        enable_interrupts();
+        uint64_t deadline = get_ticks() + SMP_PARK_TIMEOUT_MS * TICKS_IN_1MS;
+        while (cpu->state == PONGO_CPU_PARKING) {
+            if (get_ticks() > deadline) panic("smp_teardown: cpu%u didn't park", i);
+            __asm__ volatile("yield");
+        }
+        if (cpu->iorvbar && *(volatile uint64_t*)cpu->iorvbar != cpu->iorvbar_saved) {
+            *(volatile uint64_t*)cpu->iorvbar = cpu->iorvbar_saved;
+            __asm__ volatile("dmb sy");
+        }
+    }
+    if (pongo_cpu_count > 1) {
+        disable_interrupts();
+        interrupt_ipi_set_enabled(false);
+        enable_interrupts();
+    }
+}
+
+/*
+
+    Name: smp_kick
+    Description: called with the kernel lock held after queueing work on a core's run queue. Wakes that core with an
+                 IPI if it is idle; with any set, work that can be stolen, it wakes some other idle core instead when
+                 the target is busy.
+
+*/
+
+void smp_kick(uint32_t cpu, bool any)
+{
+    if (pongo_cpu_count < 2) return;
+    uint32_t self = cpu_number();
+    if (cpu != self && pongo_cpus[cpu].state == PONGO_CPU_ONLINE && pongo_cpus[cpu].idle) {
+        interrupt_ipi_send(pongo_cpus[cpu].aic_id);
+        return;
+    }
+    if (!any) return;
+    for (uint32_t i = 0; i < pongo_cpu_count; i++) {
+        if (i == self || i == cpu) continue;
+        if (pongo_cpus[i].state == PONGO_CPU_ONLINE && pongo_cpus[i].idle) {
+            interrupt_ipi_send(pongo_cpus[i].aic_id);
+            return;
+        }
+    }
+}
+
+static const char* smp_state_name(uint32_t state)
+{
+    switch (state) {
+        case PONGO_CPU_OFF: return "offline";
+        case PONGO_CPU_STARTING: return "starting";
+        case PONGO_CPU_ONLINE: return "online";
+        case PONGO_CPU_PARKING: return "parking";
+        case PONGO_CPU_FAILED: return "failed";
+    }
+    return "?";
+}
+
+void cpus_cmd(const char* cmd, char* args)
+{
+    if (args && !strcmp(args, "start")) {
+        smp_start_secondaries();
+    } else if (args && *args) {
+        iprintf("usage: cpus [start]\n");
+        return;
+    }
+    uint32_t self = cpu_number();
+    iprintf("%u cores, %u online\n", pongo_cpu_count, pongo_cpus_online());
+    for (uint32_t i = 0; i < pongo_cpu_count; i++) {
+        struct pongo_cpu* cpu = &pongo_cpus[i];
+        iprintf("%c cpu%u: id %u, mpidr 0x%llx, cluster %u (%c), impl-reg 0x%llx, iorvbar 0x%llx, dt state %s, %s\n",
+                i == self ? '*' : ' ', cpu->index, cpu->cpu_id, cpu->mpidr, cpu->cluster_id, cpu->cluster_type,
+                cpu->impl_reg, cpu->iorvbar, cpu->dt_state[0] ? cpu->dt_state : "-", smp_state_name(cpu->state));
+    }
+}
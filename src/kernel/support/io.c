@@ -38,8 +38,23 @@ int _open(const char *name, int flags, int mode) { return -1; }
 int _lseek(int file, int ptr, int dir) { return 0; }
 int _close(int file) { return -1; }
 
-static char stdout_buf[STDOUT_BUFLEN];
-static volatile int stdout_buf_len;
+/*
+
+    Name: stdout ring
+    Description: single-producer/single-consumer ring for stdout. Writers are serialised by stdout_lock and are the
+                 only ones moving the head; the reader (the USB side) only moves the tail and never takes the lock.
+                 In non-blocking mode the writer just keeps going and overwrites the oldest data. It announces how
+                 far it is about to write (stdout_ring_reserved) before copying and publishes stdout_ring_head after,
+                 so a reader can tell which part of what it copied got clobbered meanwhile and count it as dropped.
+
+*/
+
+#define STDOUT_RING_SIZE 0x4000 // power of two
+static char stdout_ring[STDOUT_RING_SIZE];
+static volatile uint64_t stdout_ring_head;     // written by the producer
+static volatile uint64_t stdout_ring_reserved; // producer is writing up to here
+static volatile uint64_t stdout_ring_tail;     // written by the consumer
+static volatile uint64_t stdout_ring_dropped;  // written by the consumer
 static volatile bool stdout_blocking;
 static lock stdout_lock;
 
@@ -52,12 +67,185 @@ void set_stdout_blocking(bool block)
     lock_release(&stdout_lock);
 }
 
+uint64_t stdout_dropped()
+{
+    return stdout_ring_dropped;
+}
+
+static void stdout_ring_copy_in(uint64_t pos, const char* from, size_t len)
+{
+    size_t off = pos & (STDOUT_RING_SIZE - 1);
+    size_t first = STDOUT_RING_SIZE - off;
+    if(first > len) first = len;
+    memcpy(stdout_ring + off, from, first);
+    memcpy(stdout_ring, from + first, len - first);
+}
+
+// called with stdout_lock held, only ever gives the lock up to wait for space in blocking mode
+static void stdout_ring_write(const char* ptr, size_t len)
+{
+    while(len)
+    {
+        uint64_t head = stdout_ring_head;
+        size_t n = len;
+        if(stdout_blocking)
+        {
+            size_t space = STDOUT_RING_SIZE - (head - __atomic_load_n(&stdout_ring_tail, __ATOMIC_ACQUIRE));
+            if(!space)
+            {
+                lock_release(&stdout_lock);
+                task_yield();
+                lock_take(&stdout_lock);
+                continue;
+            }
+            if(n > space) n = space;
+        }
+        else if(n > STDOUT_RING_SIZE)
+        {
+            // only the last STDOUT_RING_SIZE bytes could survive anyway
+            head += n - STDOUT_RING_SIZE;
+            ptr += n - STDOUT_RING_SIZE;
+            len -= n - STDOUT_RING_SIZE;
+            n = STDOUT_RING_SIZE;
+        }
+        __atomic_store_n(&stdout_ring_reserved, head + n, __ATOMIC_RELEASE);
+        // the release store doesn't keep the ring stores below from being seen before it
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        stdout_ring_copy_in(head, ptr, n);
+        __atomic_store_n(&stdout_ring_head, head + n, __ATOMIC_RELEASE);
+        ptr += n;
+        len -= n;
+    }
+}
+
+/*
+
+    Name: stdout_ring_read
+    Description: copies out up to max of the oldest unread stdout bytes, in at most two contiguous spans. Lock-free,
+                 so it is fine to call from the USB handlers.
+
+*/
+
+size_t stdout_ring_read(char* to, size_t max)
+{
+    uint64_t head = __atomic_load_n(&stdout_ring_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = stdout_ring_tail;
+    uint64_t dropped = 0;
+    if(head - tail > STDOUT_RING_SIZE)
+    {
+        dropped += head - STDOUT_RING_SIZE - tail;
+        tail = head - STDOUT_RING_SIZE;
+    }
+    size_t n = head - tail;
+    if(n > max) n = max;
+    size_t off = tail & (STDOUT_RING_SIZE - 1);
+    size_t first = STDOUT_RING_SIZE - off;
+    if(first > n) first = n;
+    memcpy(to, stdout_ring + off, first);
+    memcpy(to + first, stdout_ring, n - first);
+    // anything below reserved - STDOUT_RING_SIZE may have been overwritten while we were copying.
+    // The fence keeps the ring loads above from being satisfied after the load of reserved.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t reserved = __atomic_load_n(&stdout_ring_reserved, __ATOMIC_ACQUIRE);
+    if(reserved > STDOUT_RING_SIZE && reserved - STDOUT_RING_SIZE > tail)
+    {
+        uint64_t lost = reserved - STDOUT_RING_SIZE - tail;
+        if(lost > n) lost = n;
+        memmove(to, to + lost, n - lost);
+        n -= lost;
+        tail += lost;
+        dropped += lost;
+    }
+    stdout_ring_dropped += dropped;
+    __atomic_store_n(&stdout_ring_tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
 void fetch_stdoutbuf(char* to, int* len) {
-    lock_take(&stdout_lock);
-    memcpy(to, stdout_buf, stdout_buf_len);
-    *len = stdout_buf_len;
-    stdout_buf_len = 0;
-    lock_release(&stdout_lock);
+    *len = stdout_ring_read(to, STDOUT_BUFLEN);
+}
+
+/*
+
+    Name: console sinks
+    Description: everything written to stdout/stderr is handed as whole spans to each enabled sink, and every sink
+                 gets one flush per write. Sinks can be switched off at runtime (console command), and modules can add
+                 their own with console_sink_register.
+
+*/
+
+#define CONSOLE_SINK_MAX 8
+static struct console_sink console_sinks[CONSOLE_SINK_MAX] = {
+    { .name = "serial", .write = serial_write, .enabled = true },
+    { .name = "screen", .write = screen_write_span, .flush = screen_flush, .enabled = true },
+};
+
+bool console_sink_register(const char* name, void (*write)(const char* buf, size_t len), void (*flush)(void))
+{
+    bool ok = false;
+    disable_interrupts();
+    for(int i = 0; i < CONSOLE_SINK_MAX; i++)
+    {
+        if(console_sinks[i].write) continue;
+        console_sinks[i].name = name;
+        console_sinks[i].flush = flush;
+        console_sinks[i].enabled = true;
+        console_sinks[i].write = write;
+        ok = true;
+        break;
+    }
+    enable_interrupts();
+    return ok;
+}
+
+bool console_sink_set_enabled(const char* name, bool enabled)
+{
+    for(int i = 0; i < CONSOLE_SINK_MAX; i++)
+    {
+        if(console_sinks[i].write && strcmp(console_sinks[i].name, name) == 0)
+        {
+            console_sinks[i].enabled = enabled;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void console_write(const char* ptr, size_t len)
+{
+    for(int i = 0; i < CONSOLE_SINK_MAX; i++)
+    {
+        struct console_sink* sink = &console_sinks[i];
+        if(!sink->write || !sink->enabled) continue;
+        sink->write(ptr, len);
+        if(sink->flush) sink->flush();
+    }
+}
+
+void console_cmd(const char* cmd, char* args)
+{
+    char* arg1 = command_tokenize(args, 0x1ff - (args - cmd));
+    if(*args && arg1 && *arg1)
+    {
+        bool on = strcmp(arg1, "on") == 0;
+        if(!on && strcmp(arg1, "off") != 0)
+        {
+            iprintf("usage: console [sink on|off]\n");
+            return;
+        }
+        if(!console_sink_set_enabled(args, on))
+        {
+            iprintf("console: no sink named %s\n", args);
+        }
+        return;
+    }
+    for(int i = 0; i < CONSOLE_SINK_MAX; i++)
+    {
+        if(console_sinks[i].write)
+        {
+            iprintf(" | %-8s %s\n", console_sinks[i].name, console_sinks[i].enabled ? "on" : "off");
+        }
+    }
 }
 
 int _write(int file, char *ptr, int len)
@@ -69,47 +257,36 @@ int _write(int file, char *ptr, int len)
         default: panic("Write to unknown fd: %d", file);
     }
     if(file == 1) {
-        extern uint64_t dis_int_count;
         if (dis_int_count != 0) {
             panic("write() to stdout with interrupts disabled - please use stderr instead\n");
         }
         lock_take(&stdout_lock);
     }
-    int i;
-    for(i = 0; i < len; i++)
+    bool streaming = file == 1 && usb_stdout_streaming();
+    console_write(ptr, len);
+    if(streaming)
     {
-        if (ptr[i] == '\0') serial_putc('\r');
-        serial_putc(ptr[i]);
-        screen_putc(ptr[i]);
-
-        if(file != 1) continue;
-
-    retry:;
-        if(stdout_buf_len >= STDOUT_BUFLEN - 1)
+        int done = 0;
+        while(done < len)
         {
-            if(stdout_blocking) // blocking
-            {
-                lock_release(&stdout_lock);
-                task_yield();
-                lock_take(&stdout_lock);
-                goto retry;
-            }
-            else // non-blocking = discard
-            {
-                --stdout_buf_len;
-                memmove(stdout_buf, stdout_buf+1, stdout_buf_len);
-            }
+            done += usb_stdout_stream_write(ptr + done, len - done);
+            if(done == len || !stdout_blocking || !usb_stdout_streaming()) break;
+            lock_release(&stdout_lock);
+            task_yield();
+            lock_take(&stdout_lock);
         }
-        stdout_buf[stdout_buf_len++] = ptr[i];
+    }
+    else if(file == 1)
+    {
+        stdout_ring_write(ptr, len);
     }
     if(file == 1) lock_release(&stdout_lock);
     return len;
 }
 
-
 lock stdin_lock;
 char stdin_buf[512];
-struct event stdin_ev;
+struct condvar stdin_cv; // signalled once per completed line
 uint32_t bufoff = 0;
 extern uint32_t uart_should_drop_rx;
 void queue_rx_char(char inch) {
@@ -133,7 +310,7 @@ void queue_rx_char(char inch) {
     if (bufoff < 512)
         stdin_buf[bufoff++] = inch;
     if (inch == '\n')
-        event_fire(&stdin_ev);
+        condvar_signal(&stdin_cv);
     lock_release(&stdin_lock);
 }
 void queue_rx_string(char* string) {
@@ -144,9 +321,7 @@ int _read(int file, char *ptr, int len) {
     int readln = 0;
     lock_take(&stdin_lock);
     while (!bufoff) {
-        lock_release(&stdin_lock);
-        event_wait(&stdin_ev);
-        lock_take(&stdin_lock);
+        condvar_wait(&stdin_cv, &stdin_lock);
     }
     if (bufoff) {
         // 1. calculate memcpy length (l o l signedness)
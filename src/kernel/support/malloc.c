@@ -27,9 +27,9 @@
 #include <pongo.h>
 
 void __malloc_lock(struct _reent * unused) {
-    disable_interrupts();
+    spinlock_take(&mm_lock);
 }
 
 void __malloc_unlock(struct _reent * unused) {
-    enable_interrupts();
+    spinlock_release(&mm_lock);
 }
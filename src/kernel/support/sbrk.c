@@ -31,13 +31,13 @@ uint64_t heap_cursor = 0xe00000000;
 uint64_t heap_end = 0xe00000000;
 extern struct vm_space kernel_vm_space;
 caddr_t _sbrk(int size) {
-    disable_interrupts();
+    spinlock_take(&mm_lock);
     uint64_t cursor_copy = heap_cursor;
     heap_cursor += size;
     while (heap_cursor > heap_end) {
         vm_space_map_page_physical_prot(&kernel_vm_space, heap_end, ppage_alloc(), PROT_READ|PROT_WRITE|PROT_KERN_ONLY);
         heap_end += 0x4000;
     }
-    enable_interrupts();
+    spinlock_release(&mm_lock);
     return (caddr_t)cursor_copy;
 }
@@ -27,6 +27,7 @@
 #include <pongo.h>
 
 #define SYSCALL(name, handlerf) {.handler = handlerf, .sysc_name = name}
+#define SYSCALL_QUIET(name, handlerf) {.handler = handlerf, .sysc_name = name, .quiet = true}
 struct uap {
     uint64_t u64_arguments[7];
     uint64_t* state;
@@ -34,6 +35,7 @@ struct uap {
 struct syscall_table {
     int (*handler)(struct task* task, struct uap* uap);
     char* sysc_name;
+    bool quiet; // don't log invocations, for syscalls on hot paths
 };
 
 int sys_exit(struct task* task, struct uap* uap) {
@@ -55,11 +57,17 @@ int sys_kmcrash(struct task* task, struct uap* uap) {
     return 0;
 }
 
+int sys_yield(struct task* task, struct uap* uap) {
+    task_yield();
+    return 0;
+}
+
 struct syscall_table sysc_table[] = {
     SYSCALL("exit", sys_exit),
     SYSCALL("crash", sys_crash),
     SYSCALL("return", sys_return),
     SYSCALL("kmcrash", sys_kmcrash),
+    SYSCALL_QUIET("yield", sys_yield),
 };
 
 
@@ -69,8 +77,8 @@ void pongo_syscall_entry(struct task* task, uint32_t sysnr, uint64_t* state) {
     if (sysnr == 0x42) {
         // pongo syscall
         uint32_t syscall_nr = state[15] & 0xffffffff;
+        uint32_t logged_nr = syscall_nr;
         
-        iprintf("-> got SVC 0x%x from task %s (%p)! syscall_nr = %d\n", sysnr, task->name, task, syscall_nr);
         struct uap uap;
         memcpy(uap.u64_arguments, state, 7 * 8);
         uap.state = state;
@@ -81,9 +89,13 @@ void pongo_syscall_entry(struct task* task, uint32_t sysnr, uint64_t* state) {
         }
         syscall_nr--;
         
+        bool in_table = syscall_nr < (sizeof(sysc_table) / sizeof(struct syscall_table));
+        if (!in_table || !sysc_table[syscall_nr].quiet)
+            iprintf("-> got SVC 0x%x from task %s (%p)! syscall_nr = %d\n", sysnr, task->name, task, logged_nr);
+        
         state[0] = -1;
         
-        if (syscall_nr < (sizeof(sysc_table) / sizeof(struct syscall_table))) {
+        if (in_table) {
             if (sysc_table[syscall_nr].handler) {
                 state[0] = sysc_table[syscall_nr].handler(task, &uap);
                 is_valid_svc = true;
@@ -32,13 +32,16 @@ extern void task_load(struct task* to_task);
 extern void task_load_asserted(struct task* to_task);
 uint64_t scheduler_ticks = 0;
 volatile uint64_t preemption_counter = 0;
-extern void _task_switch(struct task* new);
-extern void _task_switch_asserted(struct task* new);
+extern struct task* _task_switch(struct task* new);
+extern struct task* _task_switch_asserted(struct task* new);
 
-extern uint64_t dis_int_count, fiqCount;
+extern uint64_t fiqCount;
 uint64_t served_irqs;
 volatile struct task* sched_array[32];
 volatile char has_preempted = 0;
+static void task_rq_enqueue(struct task* task, bool at_head);
+static void task_rq_remove(struct task* task);
+static void sleep_queue_remove(struct task* task);
 
 void task_assert_unlinked(struct task* task) {
     return;
@@ -61,12 +64,83 @@ void task_timer_fired() {
 }
 
 struct task* irqvecs[0x200];
+
+/*
+
+    Name: irq top halves
+    Description: handlers that run inline from irq_exc on the exception stack with interrupts masked, instead of
+                 switching into a handler task and back. Anything that needs to sleep or take long goes into a
+                 bottom-half task, which the top half kicks by returning IRQ_WAKE_BOTTOM.
+
+*/
+
+struct irq_top_half {
+    int (*handler)(uint32_t irq, void* ctx);
+    void* ctx;
+    struct irq_bottom_half* bottom;
+    const char* name;
+    uint64_t count;
+    uint64_t ticks; // time spent in handler
+};
+static struct irq_top_half irq_top_halves[0x200];
+
 void register_irq_handler(uint16_t irq_v, struct task* irq_handler)
 {
     if (irq_v >= 0x1ff) panic("invalid irq");
     if (irqvecs[irq_v]) task_release(irqvecs[irq_v]);
     if (irq_handler) task_reference(irq_handler);
     irqvecs[irq_v] = irq_handler;
+    if (irq_handler) irq_top_halves[irq_v].handler = NULL;
+}
+
+void irq_register_top_half(uint16_t irq_v, const char* name, int (*handler)(uint32_t irq, void* ctx), void* ctx, struct irq_bottom_half* bottom)
+{
+    if (irq_v >= 0x1ff) panic("invalid irq");
+    disable_interrupts();
+    register_irq_handler(irq_v, NULL);
+    struct irq_top_half* top = &irq_top_halves[irq_v];
+    top->handler = handler;
+    top->ctx = ctx;
+    top->bottom = bottom;
+    top->name = name;
+    top->count = 0;
+    if (handler) unmask_interrupt(irq_v);
+    else mask_interrupt(irq_v);
+    enable_interrupts();
+}
+
+/*
+
+    Name: irq_bottom_half_kick
+    Description: marks work pending and wakes the task sleeping in irq_bottom_half_wait, safe from top halves
+
+*/
+
+void irq_bottom_half_kick(struct irq_bottom_half* bh)
+{
+    disable_interrupts();
+    bh->pending = 1;
+    event_fire(&bh->ev);
+    enable_interrupts();
+}
+
+/*
+
+    Name: irq_bottom_half_wait
+    Description: blocks the bottom-half task until the top half kicked it; kicks that happen while the task is busy are
+                 not lost, they just collapse into one wakeup
+
+*/
+
+void irq_bottom_half_wait(struct irq_bottom_half* bh)
+{
+    disable_interrupts();
+    while (!bh->pending) {
+        event_wait_asserted(&bh->ev);
+        disable_interrupts();
+    }
+    bh->pending = 0;
+    enable_interrupts();
 }
 
 typedef struct
@@ -75,6 +149,7 @@ typedef struct
     uint64_t runcnt;
     uint32_t pid;
     uint32_t flags;
+    uint32_t priority;
     uint64_t irq_count;
 } task_info_t;
 
@@ -161,6 +236,7 @@ retry:;
             tasks_copy[nt].runcnt = cur_task->runcnt;
             tasks_copy[nt].pid    = cur_task->pid;
             tasks_copy[nt].flags  = cur_task->flags;
+            tasks_copy[nt].priority = cur_task->priority;
             ++nt;
         }
         cur_task = cur_task->next;
@@ -184,6 +260,11 @@ retry:;
     extern uint64_t heap_base;
     extern uint64_t heap_end;
 
+    extern uint64_t sched_idle_last_second, sched_busy_last_second, sched_idle_ticks;
+    uint64_t idle_window = sched_idle_last_second + sched_busy_last_second;
+    uint64_t idle_pml = idle_window ? (sched_idle_last_second * 1000) / idle_window : 0;
+    uint64_t idle_total = sched_idle_ticks / (2400 * 1000);
+
     // Get these too while we're uninterruptible
     uint64_t a = *(volatile uint64_t*)&served_irqs,
              b = *(volatile uint64_t*)&fiqCount,
@@ -193,11 +274,11 @@ retry:;
     enable_interrupts();
 
     // Now dump it all out
-    iprintf("=+= System Information ===\n | served irqs: %lld, caught fiqs: %lld, preempt: %lld, uptime: %lld.%llds\n | free pages: %lld (%lld MB), inuse: %lld (%lld MB), paged: %lld\n | heap: %lld (%lld MB), wired: %lld (%lld MB), total: %lld (%lld MB)\n=+=    Process List    ===\n", a, b, c, d/10, d%10, f, f / 0x40, e - f, (e - f) / 0x40, i, h, h / 0x40, g, g / 0x40, e, e / 0x40);
+    iprintf("=+= System Information ===\n | served irqs: %lld, caught fiqs: %lld, preempt: %lld, uptime: %lld.%llds\n | idle: %lld.%lld%% (last second), %lld.%llds total\n | free pages: %lld (%lld MB), inuse: %lld (%lld MB), paged: %lld\n | heap: %lld (%lld MB), wired: %lld (%lld MB), total: %lld (%lld MB)\n=+=    Process List    ===\n", a, b, c, d/10, d%10, idle_pml / 10, idle_pml % 10, idle_total / 10, idle_total % 10, f, f / 0x40, e - f, (e - f) / 0x40, i, h, h / 0x40, g, g / 0x40, e, e / 0x40);
     for(int i = 0; i < ntasks; ++i)
     {
         task_info_t *t = &tasks_copy[i];
-        iprintf(" | %7s | task %d | runcnt = %llx | flags = %s, %s\n", t->name[0] ? t->name : "unknown", t->pid, t->runcnt, t->flags & TASK_PREEMPT ? "preempt" : "coop", t->flags & TASK_LINKED ? "run" : "wait");
+        iprintf(" | %7s | task %d | runcnt = %llx | prio = %d | flags = %s, %s\n", t->name[0] ? t->name : "unknown", t->pid, t->runcnt, t->priority, t->flags & TASK_PREEMPT ? "preempt" : "coop", t->flags & TASK_LINKED ? "run" : "wait");
     }
     iprintf("=+=    IRQ Handlers    ===\n");
     for(int i = 0; i < nirq; ++i)
@@ -206,6 +287,14 @@ retry:;
         char* nm = t->name[0] ? t->name : "unknown";
         iprintf(" | %7s (%d) | runcnt: %lld | irq: %d | irqcnt: %llu | flags: %s, %s\n", nm, t->pid, t->runcnt, i, t->irq_count, t->flags & TASK_PREEMPT ? "preempt" : "coop", t->flags & TASK_LINKED ? "run" : "wait");
     }
+    for (int i = 0; i < 0x1ff; i++) {
+        struct irq_top_half* top = &irq_top_halves[i];
+        if (top->handler) {
+            iprintf(" | %7s (top half) | irq: %d | irqcnt: %llu | bottom half: %s\n", top->name ? top->name : "unknown", i, top->count, top->bottom ? "yes" : "no");
+        }
+    }
+    iprintf("=+=   Kernel stacks    ===\n");
+    kernel_stack_stats_print();
     iprintf("=+=   Loaded modules   ===\n");
     extern void pongo_module_print_list();
     pongo_module_print_list();
@@ -213,9 +302,147 @@ retry:;
     free(tasks_copy);
     free(irq_copy);
 }
+/*
+
+    Name: task_switch_account
+    Description: called from _task_switch_asserted and _task_load_asserted with interrupts held, right before next
+                 gets switched in. Charges prev for the time since it was switched in, and records which core next
+                 runs on so that no other core picks it meanwhile. irq_exc stops the clock of the task it interrupts
+                 (switched_in_at 0), so IRQ time doesn't end up in task time as well.
+
+*/
+
+void task_switch_account(struct task* prev, struct task* next) {
+    uint64_t now = get_ticks();
+    if (prev && prev->switched_in_at) prev->cpu_ticks += now - prev->switched_in_at;
+    // prev is fully saved by now, and whoever picks it next has to wait for the kernel lock we are holding
+    if (prev) prev->on_cpu = false;
+    next->on_cpu = true;
+    next->cpu = cpu_number();
+    next->switched_in_at = now;
+    if (pongo_trace_enabled) pongo_trace_switch(prev, next);
+}
+
+/*
+
+    Name: top
+    Description: samples per-task CPU time, switches and IRQs over an interval (one second by default)
+
+*/
+
+typedef struct
+{
+    char name[32];
+    uint32_t pid;
+    uint32_t irq;      // irq handlers and top halves
+    bool top_half;
+    uint64_t cpu_ticks;
+    uint64_t runcnt;
+    uint64_t irq_count;
+} task_cpu_sample_t;
+
+static void task_cpu_sample_fill(task_cpu_sample_t* s, struct task* task, uint64_t now) {
+    bzero(s, sizeof(*s));
+    strlcpy(s->name, task->name, sizeof(s->name));
+    s->pid = task->pid;
+    s->cpu_ticks = task->cpu_ticks;
+    if (task->on_cpu && task->switched_in_at) s->cpu_ticks += now - task->switched_in_at;
+    s->runcnt = task->runcnt;
+    s->irq_count = task->irq_count;
+}
+
+static size_t task_cpu_snapshot(task_cpu_sample_t* out, size_t max, uint64_t now) {
+    extern struct task sched_task;
+    size_t n = 0;
+    struct task* cur = &sched_task;
+    do {
+        if (n < max && !(cur->flags & (TASK_HAS_EXITED|TASK_IRQ_HANDLER))) {
+            task_cpu_sample_fill(&out[n++], cur, now);
+        }
+        cur = cur->next;
+    } while (cur != &sched_task);
+    for (int i = 0; i < 0x1ff; i++) {
+        if (irqvecs[i] && n < max) {
+            task_cpu_sample_fill(&out[n], irqvecs[i], now);
+            out[n++].irq = i;
+        }
+    }
+    for (int i = 0; i < 0x1ff; i++) {
+        struct irq_top_half* top = &irq_top_halves[i];
+        if (!top->handler || n >= max) continue;
+        task_cpu_sample_t* s = &out[n++];
+        bzero(s, sizeof(*s));
+        strlcpy(s->name, top->name ? top->name : "irq", sizeof(s->name));
+        s->irq = i;
+        s->top_half = true;
+        s->cpu_ticks = top->ticks;
+        s->irq_count = top->count;
+    }
+    return n;
+}
+
+void top_cmd(const char* cmd, char* arg) {
+    uint64_t interval_ms = 1000;
+    if (arg && *arg) interval_ms = strtoull(arg, NULL, 0);
+    if (!interval_ms) interval_ms = 1000;
+
+    size_t max = 256;
+    task_cpu_sample_t* before = malloc(max * sizeof(*before));
+    task_cpu_sample_t* after = malloc(max * sizeof(*after));
+    if (!before || !after) panic("top: out of memory");
+
+    extern uint64_t sched_idle_ticks, irq_exc_ticks;
+    disable_interrupts();
+    uint64_t t0 = get_ticks();
+    size_t n0 = task_cpu_snapshot(before, max, t0);
+    uint64_t idle0 = sched_idle_ticks, irq0 = irq_exc_ticks, irqs0 = served_irqs;
+    enable_interrupts();
+
+    task_sleep_until(t0 + interval_ms * TICKS_IN_1MS);
+
+    disable_interrupts();
+    uint64_t t1 = get_ticks();
+    size_t n1 = task_cpu_snapshot(after, max, t1);
+    uint64_t idle1 = sched_idle_ticks, irq1 = irq_exc_ticks, irqs1 = served_irqs;
+    enable_interrupts();
+
+    uint64_t elapsed = t1 - t0;
+    if (!elapsed) elapsed = 1;
+    uint64_t secs_x10 = (elapsed * 10) / (TICKS_IN_1MS * 1000);
+    if (!secs_x10) secs_x10 = 1;
+    iprintf("=+= top over %llu.%llus ===\n | idle: %llu.%llu%%, irq exceptions: %llu.%llu%% (top halves and irq tasks below are part of it), irqs/s: %llu\n",
+            secs_x10 / 10, secs_x10 % 10,
+            ((idle1 - idle0) * 1000 / elapsed) / 10, ((idle1 - idle0) * 1000 / elapsed) % 10,
+            ((irq1 - irq0) * 1000 / elapsed) / 10, ((irq1 - irq0) * 1000 / elapsed) % 10,
+            (irqs1 - irqs0) * 10 / secs_x10);
+    iprintf(" | %5s %-16s %7s %10s %8s\n", "pid", "name", "cpu", "switch/s", "irq/s");
+    for (size_t i = 0; i < n1; i++) {
+        task_cpu_sample_t* a = &after[i];
+        task_cpu_sample_t* b = NULL;
+        for (size_t j = 0; j < n0; j++) {
+            if (before[j].top_half == a->top_half && (a->top_half ? before[j].irq == a->irq : before[j].pid == a->pid)) {
+                b = &before[j];
+                break;
+            }
+        }
+        uint64_t cpu = a->cpu_ticks - (b ? b->cpu_ticks : 0);
+        uint64_t runs = a->runcnt - (b ? b->runcnt : 0);
+        uint64_t irqs = a->irq_count - (b ? b->irq_count : 0);
+        uint64_t pml = cpu * 1000 / elapsed;
+        if (a->top_half) {
+            iprintf(" | %5s %-16s %3llu.%llu%% %10s %8llu  (irq %u top half)\n", "-", a->name, pml / 10, pml % 10, "-", irqs * 10 / secs_x10, a->irq);
+        } else {
+            iprintf(" | %5u %-16s %3llu.%llu%% %10llu %8llu\n", a->pid, a->name[0] ? a->name : "unknown", pml / 10, pml % 10, runs * 10 / secs_x10, irqs * 10 / secs_x10);
+        }
+    }
+    iprintf("=+========================\n");
+    free(before);
+    free(after);
+}
+
 void task_irq_teardown() {
     for (int i=0; i<0x1ff; i++) {
-        if (irqvecs[i]) {
+        if (irqvecs[i] || irq_top_halves[i].handler) {
             mask_interrupt(i);
         }
     }
@@ -246,6 +473,17 @@ __attribute__((noinline)) void task_switch_irq(struct task* new)
     served_irqs++;
 }
 __attribute__((noinline)) void task_irq_dispatch(uint32_t intr) {
+    struct irq_top_half* top = &irq_top_halves[intr & 0x1ff];
+    if (top->handler) {
+        top->count++;
+        uint64_t start = get_ticks();
+        int ret = top->handler(intr & 0x1ff, top->ctx);
+        top->ticks += get_ticks() - start;
+        if ((ret & IRQ_WAKE_BOTTOM) && top->bottom) irq_bottom_half_kick(top->bottom);
+        if (!(ret & IRQ_KEEP_MASKED)) unmask_interrupt(intr & 0x1ff); // re-arm IRQ
+        served_irqs++;
+        return;
+    }
     struct task* irq_handler = irqvecs[intr & 0x1FF];
     if (irq_handler) {
         irq_handler->irq_type = intr & 0x1ff;
@@ -257,19 +495,18 @@ __attribute__((noinline)) void task_irq_dispatch(uint32_t intr) {
 }
 
 extern struct task sched_task;
-extern uint32_t preempt_ctr;
 void task_yield_preemption() {
     disable_interrupts();
     if (dis_int_count != 1) {
         panic("task yielded with interrupts held");
     }
-    preempt_ctr++;
-    _task_switch_asserted(&sched_task);
+    pongo_cpu_self()->preempt_ctr++;
+    _task_switch_asserted(pongo_cpu_self()->sched);
     disable_interrupts();
     if (dis_int_count != 1) {
         panic("sched returned with interrupts held");
     }
-    dis_int_count = 0;
+    enable_interrupts_asserted(); // the exception return unmasks
 }
 
 void task_wait() {
@@ -277,7 +514,7 @@ void task_wait() {
     if (dis_int_count != 1) {
         panic("task yielded with interrupts held");
     }
-    _task_switch_asserted(&sched_task);
+    _task_switch_asserted(pongo_cpu_self()->sched);
 }
 
 void task_crash_internal(const char* reason, va_list va) {
@@ -345,7 +582,7 @@ void task_exit_asserted() {
     else
         task_current()->flags |= TASK_PLEASE_DEREF;
 
-    task_load_asserted(&sched_task);
+    task_load_asserted(pongo_cpu_self()->sched);
     panic("never reached");
 }
 
@@ -408,56 +645,161 @@ void task_entry() {
 }
 volatile uint32_t gPid = 1;
 
-#define KERN_STACK_SIZE 0x8000
+/*
+
+    Name: kernel stack cache
+    Description: kernel and exception stacks come out of per-size-class pools of pre-mapped stacks, each with an
+                 unmapped guard page on either side, and go back to their pool when the task is freed. Every class
+                 is topped up at boot so spawning a task normally doesn't touch the allocator or the page tables.
+                 The word above the stack top records the class so kernel_stack_free knows where it goes.
+                 Each core keeps the last stack it freed of every class, so tasks that come and go on one core
+                 recycle their stacks there; the pools behind that have their own spinlock rather than the kernel
+                 lock.
+
+*/
+
+#define KERN_STACK_RESERVED 0x400 // between the stack top and the upper guard page
+
+struct kernel_stack_class {
+    const char* name;
+    uint64_t size;
+    uint32_t prefill;
+    uint32_t free_count;
+    uint32_t total;
+    void* freelist;
+};
+static struct kernel_stack_class kernel_stack_classes[KSTACK_CLASS_COUNT] = {
+    [KSTACK_KERN] = { .name = "kernel", .size = 0x8000, .prefill = 4 },
+    [KSTACK_IRQ] = { .name = "irq", .size = 0x4000, .prefill = 2 },
+    [KSTACK_EXC] = { .name = "exception", .size = 0x4000, .prefill = 6 },
+    [KSTACK_PREEMPT] = { .name = "preempt", .size = 0x10000, .prefill = 2 },
+};
+static spinlock kernel_stack_lock;
+static struct {
+    spinlock lock; // whoever looked this core up may have migrated since, so it is still a real lock
+    void* stack[KSTACK_CLASS_COUNT];
+} kernel_stack_cpu_cache[PONGO_MAX_CPUS];
 
-void* kernel_stack_allocate_new() {
-    uint64_t stack_size = KERN_STACK_SIZE + 2 * PAGE_SIZE;
-    uint64_t phys_backing = alloc_phys(KERN_STACK_SIZE);
+struct kernel_stack_hdr {
+    void* next; // only while on the freelist
+    uint64_t cls;
+};
+
+static void* kernel_stack_allocate_new(uint32_t cls) {
+    uint64_t size = kernel_stack_classes[cls].size;
+    uint64_t stack_size = size + 2 * PAGE_SIZE;
+    uint64_t phys_backing = alloc_phys(size);
     uint64_t vma_backing = linear_kvm_alloc(stack_size);
     
     vm_space_map_page_physical_prot(&kernel_vm_space, vma_backing, 0, 0); // guard page
-    for (uint64_t offset = 0; offset < stack_size - PAGE_SIZE * 2; offset += PAGE_SIZE) {
+    for (uint64_t offset = 0; offset < size; offset += PAGE_SIZE) {
         vm_space_map_page_physical_prot(&kernel_vm_space, vma_backing + PAGE_SIZE + offset, phys_backing + offset, PROT_READ|PROT_WRITE|PROT_KERN_ONLY);
     }
-    vm_space_map_page_physical_prot(&kernel_vm_space, vma_backing + KERN_STACK_SIZE + PAGE_SIZE, 0, 0); // guard page
+    vm_space_map_page_physical_prot(&kernel_vm_space, vma_backing + size + PAGE_SIZE, 0, 0); // guard page
 
-    return (void*)(vma_backing + PAGE_SIZE + KERN_STACK_SIZE - 0x400);
+    struct kernel_stack_hdr* hdr = (void*)(vma_backing + PAGE_SIZE + size - KERN_STACK_RESERVED);
+    hdr->next = NULL;
+    hdr->cls = cls;
+    __atomic_add_fetch(&kernel_stack_classes[cls].total, 1, __ATOMIC_RELAXED);
+    return hdr;
 }
 
-void* stack_freelist = NULL;
-
-void* kernel_stack_allocate() {
+void* kernel_stack_allocate_class(uint32_t cls) {
+    if (cls >= KSTACK_CLASS_COUNT) panic("kernel_stack_allocate_class: bad class %u", cls);
+    struct kernel_stack_class* c = &kernel_stack_classes[cls];
     void* stack = NULL;
-    disable_interrupts();
-    if (stack_freelist) {
-        stack = stack_freelist;
-        stack_freelist = *(void**)stack;
-    } else {
-        stack = kernel_stack_allocate_new();
+    typeof(kernel_stack_cpu_cache[0])* pcpu = &kernel_stack_cpu_cache[cpu_number()];
+    spinlock_take(&pcpu->lock);
+    stack = pcpu->stack[cls];
+    pcpu->stack[cls] = NULL;
+    spinlock_release(&pcpu->lock);
+    if (stack) return stack;
+
+    spinlock_take(&kernel_stack_lock);
+    if (c->freelist) {
+        struct kernel_stack_hdr* hdr = c->freelist;
+        c->freelist = hdr->next;
+        hdr->next = NULL;
+        c->free_count--;
+        stack = hdr;
     }
-    enable_interrupts();
+    spinlock_release(&kernel_stack_lock);
+    if (!stack) stack = kernel_stack_allocate_new(cls);
     return stack;
 }
+void* kernel_stack_allocate() {
+    return kernel_stack_allocate_class(KSTACK_KERN);
+}
 void kernel_stack_free(void* stack) {
-    disable_interrupts();
-    *(void**)stack = stack_freelist;
-    stack_freelist = stack;
-    enable_interrupts();
+    if (!stack) return;
+    struct kernel_stack_hdr* hdr = stack;
+    if (hdr->cls >= KSTACK_CLASS_COUNT) panic("kernel_stack_free: corrupted stack header at %p", stack);
+    struct kernel_stack_class* c = &kernel_stack_classes[hdr->cls];
+    typeof(kernel_stack_cpu_cache[0])* pcpu = &kernel_stack_cpu_cache[cpu_number()];
+    spinlock_take(&pcpu->lock);
+    void* spill = pcpu->stack[hdr->cls];
+    pcpu->stack[hdr->cls] = stack;
+    spinlock_release(&pcpu->lock);
+    if (!spill) return;
+
+    hdr = spill;
+    spinlock_take(&kernel_stack_lock);
+    hdr->next = c->freelist;
+    c->freelist = hdr;
+    c->free_count++;
+    spinlock_release(&kernel_stack_lock);
 }
 
+void kernel_stack_cache_init() {
+    for (uint32_t cls = 0; cls < KSTACK_CLASS_COUNT; cls++) {
+        struct kernel_stack_class* c = &kernel_stack_classes[cls];
+        while (c->free_count < c->prefill) {
+            struct kernel_stack_hdr* hdr = kernel_stack_allocate_new(cls);
+            spinlock_take(&kernel_stack_lock);
+            hdr->next = c->freelist;
+            c->freelist = hdr;
+            c->free_count++;
+            spinlock_release(&kernel_stack_lock);
+        }
+    }
+}
 
-void task_alloc_fast_stacks(struct task* task) {
+// true if addr is in one of the guard pages around the task's kernel or exception stack
+static bool kernel_stack_guard_hit_one(uint64_t top, uint64_t addr) {
+    if (!top) return false;
+    uint64_t cls = ((struct kernel_stack_hdr*)top)->cls;
+    if (cls >= KSTACK_CLASS_COUNT) return false;
+    uint64_t end = top + KERN_STACK_RESERVED;
+    uint64_t bottom = end - kernel_stack_classes[cls].size;
+    return (addr >= bottom - PAGE_SIZE && addr < bottom) || (addr >= end && addr < end + PAGE_SIZE);
+}
+bool kernel_stack_guard_hit(struct task* task, uint64_t addr) {
+    if (!task) return false;
+    return kernel_stack_guard_hit_one(task->kernel_stack, addr) || kernel_stack_guard_hit_one(task->exception_stack_top, addr);
+}
+
+void kernel_stack_stats_print() {
+    for (uint32_t cls = 0; cls < KSTACK_CLASS_COUNT; cls++) {
+        struct kernel_stack_class* c = &kernel_stack_classes[cls];
+        iprintf(" | %9s stacks: 0x%llx bytes, %u allocated, %u cached\n", c->name, c->size, c->total, c->free_count);
+    }
+}
+
+void task_alloc_stacks(struct task* task, uint32_t cls) {
     if (!task->kernel_stack) {
-        task->kernel_stack = (uint64_t)kernel_stack_allocate();
+        task->kernel_stack = (uint64_t)kernel_stack_allocate_class(cls);
     }
     if (!task->exception_stack_top) {
-        task->exception_stack_top = (uint64_t)kernel_stack_allocate();
+        task->exception_stack_top = (uint64_t)kernel_stack_allocate_class(KSTACK_EXC);
     }
     task->exception_stack = (uint64_t)task->exception_stack_top;
     task->exception_stack &= ~0xf;
     task->el0_exception_stack = task->kernel_stack;
     task->el0_exception_stack &= ~0xf;
 }
+void task_alloc_fast_stacks(struct task* task) {
+    task_alloc_stacks(task, KSTACK_KERN);
+}
 void task_set_entry(struct task* task) {
     task_alloc_fast_stacks(task);
 
@@ -485,6 +827,9 @@ void task_restart_and_link(struct task* task) {
 
 
 void task_register_unlinked(struct task* task, void (*entry)()) {
+    disable_interrupts();
+    task_rq_remove(task);
+    enable_interrupts();
     memset(task, 0, offsetof(struct task, anchor));
 
     if (task->proc) {
@@ -503,6 +848,7 @@ void task_register_unlinked(struct task* task, void (*entry)()) {
     task->flags &= TASK_WAS_LINKED | TASK_HAS_EXITED;
     task->flags |= TASK_PREEMPT;
     task->gencount = 0;
+    task->priority = TASK_PRIO_NORMAL;
 
     disable_interrupts();
     task->pid = gPid++;
@@ -523,6 +869,7 @@ void task_register_preempt_irq(struct task* task, void (*entry)(), int irq_id) {
     task_register_unlinked(task, entry);
     task->flags |= TASK_IRQ_HANDLER;
     task->flags |= TASK_PREEMPT;
+    task->priority = TASK_PRIO_IRQ;
     register_irq_handler(irq_id, task);
     unmask_interrupt(irq_id);
     enable_interrupts();
@@ -555,15 +902,21 @@ struct task* task_create(const char* name, void (*entry)()) {
 }
 struct task* task_create_extended(const char* name, void (*entry)(), int task_type, uint64_t arg) {
     struct proc* proc = task_current()->proc;
+    uint32_t cls = KSTACK_KERN;
     if (task_type & TASK_FROM_PROC) {
         proc = (struct proc*) arg;
         arg = 0;
+    } else if (task_type & TASK_IRQ_HANDLER) {
+        cls = KSTACK_IRQ;
+    } else if (task_type & TASK_PREEMPT) {
+        cls = KSTACK_PREEMPT; // procs run at EL0, their kernel side stays in the kernel class
     }
     
     task_type &= TASK_TYPE_MASK;
 
     struct task* task = malloc(sizeof(struct task));
     bzero((void*) task, sizeof(struct task));
+    task_alloc_stacks(task, cls);
     
     proc_reference(proc);
     task->proc = proc;
@@ -572,6 +925,7 @@ struct task* task_create_extended(const char* name, void (*entry)(), int task_ty
     task->flags |= task_type & ~TASK_LINKED;
     task->flags &= ~TASK_PREEMPT;
     if (task_type & TASK_PREEMPT) task->flags |= TASK_PREEMPT;
+    if (task_type & TASK_IRQ_HANDLER) task->priority = TASK_PRIO_IRQ;
     task->refcount = 1;
 
     if (task_type & TASK_SPAWN) {
@@ -626,6 +980,7 @@ void task_release(struct task* task) {
                 el = &((*el)->proc_task_list_next);
             }
         }
+        sleep_queue_remove(task);
         kernel_stack_free((void*)task->kernel_stack);
         kernel_stack_free((void*)task->exception_stack_top);
         vm_deallocate(task->vm_space, task->user_stack, 0x40000);
@@ -649,37 +1004,224 @@ void task_exit_irq()
         if (dis_int_count != 1) {
             panic("irq handler yielded with interrupts held");
         }
-        return _task_switch_asserted(&sched_task);
+        _task_switch_asserted(pongo_cpu_self()->sched);
+        return;
     }
     if (!(task_current()->flags & TASK_IRQ_HANDLER))  return task_yield();
     if (!task_current()->irq_ret) panic("task_exit_irq must be invoked from enabled irq context");
     _task_switch(task_current()->irq_ret);
 }
-extern uint64_t dis_int_count;
 void task_switch(struct task* new)
 {
     if (new->flags & TASK_IRQ_HANDLER) {
         return;
     }
     if (dis_int_count) return; // do not allow task yield in irq context
-    _task_switch(new);
+    disable_interrupts();
+    if (new->on_cpu) {
+        // already running on another core
+        enable_interrupts();
+        return;
+    }
+    // a direct switch bypasses the scheduler, so keep the run queue consistent by hand
+    task_rq_remove(new);
+    if (task_current()->flags & TASK_LINKED) task_rq_enqueue(task_current(), false);
+    task_vm_activate(new);
+    _task_switch_asserted(new);
+}
+
+/*
+
+    Name: task_vm_activate
+    Description: refreshes the ASID in a task's TTBR1 before it gets switched in, the switch itself never touches the TLB
+
+*/
+
+void task_vm_activate(struct task* task) {
+    struct vm_space* vmspace = task->vm_space;
+    if (!vmspace || vmspace == &kernel_vm_space) return;
+    task->ttbr1 = vmspace->ttbr1 | vm_asid_validate(vmspace);
 }
 
 void task_yield_asserted() {
-    _task_switch_asserted(&sched_task);
+    _task_switch_asserted(pongo_cpu_self()->sched);
 }
 void _task_yield() {
-    _task_switch(&sched_task);
+    disable_interrupts(); // pins us to this core before looking up its scheduler
+    _task_switch_asserted(pongo_cpu_self()->sched);
 }
 void task_yield() {
     if (dis_int_count) {
         return; // no-preempt
     }
     disable_interrupts();
-    _task_switch_asserted(&sched_task);
+    _task_switch_asserted(pongo_cpu_self()->sched);
 }
 
 
+/*
+
+    Name: run queue
+    Description: runnable tasks live in one FIFO per priority level and core, with a bitmap of non-empty levels so
+                 that finding work is cheap. Tasks only go on the boot core's queue unless they are TASK_SMP, which
+                 go back on the queue of the core they last ran on. The next/prev ring (headed by pongo_sched_head)
+                 holds every task that was ever linked and is only walked by task_list.
+
+*/
+struct task_runq {
+    struct task* head[TASK_PRIO_COUNT];
+    struct task* tail[TASK_PRIO_COUNT];
+    uint32_t bitmap;
+};
+static struct task_runq runqs[PONGO_MAX_CPUS];
+
+static bool task_is_sched(struct task* task) {
+    return task == &sched_task || (task->cpu < PONGO_MAX_CPUS && task == pongo_cpus[task->cpu].sched);
+}
+static bool task_is_smp(struct task* task) {
+    return (task->flags & (TASK_SMP|TASK_IRQ_HANDLER)) == TASK_SMP;
+}
+
+static void task_rq_enqueue(struct task* task, bool at_head) {
+    if (task->rq_queued || task_is_sched(task)) return;
+    uint32_t prio = task->priority;
+    if (prio >= TASK_PRIO_COUNT) prio = TASK_PRIO_NORMAL;
+    uint32_t cpu = 0;
+    if (task_is_smp(task) && task->cpu < PONGO_MAX_CPUS && pongo_cpus[task->cpu].state == PONGO_CPU_ONLINE) cpu = task->cpu;
+    struct task_runq* rq = &runqs[cpu];
+    if (at_head) {
+        task->rq_prev = NULL;
+        task->rq_next = rq->head[prio];
+        if (rq->head[prio]) rq->head[prio]->rq_prev = task;
+        else rq->tail[prio] = task;
+        rq->head[prio] = task;
+    } else {
+        task->rq_next = NULL;
+        task->rq_prev = rq->tail[prio];
+        if (rq->tail[prio]) rq->tail[prio]->rq_next = task;
+        else rq->head[prio] = task;
+        rq->tail[prio] = task;
+    }
+    task->rq_cpu = cpu;
+    task->rq_queued = true;
+    rq->bitmap |= 1 << prio;
+    smp_kick(cpu, task_is_smp(task));
+}
+static void task_rq_remove(struct task* task) {
+    if (!task->rq_queued) return;
+    uint32_t prio = task->priority;
+    if (prio >= TASK_PRIO_COUNT) prio = TASK_PRIO_NORMAL;
+    struct task_runq* rq = &runqs[task->rq_cpu];
+    if (task->rq_prev) task->rq_prev->rq_next = task->rq_next;
+    else rq->head[prio] = task->rq_next;
+    if (task->rq_next) task->rq_next->rq_prev = task->rq_prev;
+    else rq->tail[prio] = task->rq_prev;
+    task->rq_next = task->rq_prev = NULL;
+    task->rq_queued = false;
+    if (!rq->head[prio]) rq->bitmap &= ~(1 << prio);
+}
+
+/*
+
+    Name: task_rq_find
+    Description: returns the task the calling core should run next without dequeuing it. Priority wins over
+                 locality: for every level the core's own queue is tried first, then TASK_SMP tasks are stolen from
+                 the other queues. Tasks that are still switched in elsewhere (woken up before they got to yield)
+                 are skipped and stay queued.
+
+*/
+
+static struct task* task_rq_first(struct task_runq* rq, uint32_t prio, bool smp_only) {
+    if (!(rq->bitmap & (1 << prio))) return NULL;
+    for (struct task* task = rq->head[prio]; task; task = task->rq_next) {
+        if (task->on_cpu) continue;
+        if (smp_only && !task_is_smp(task)) continue;
+        return task;
+    }
+    return NULL;
+}
+static struct task* task_rq_find() {
+    uint32_t self = cpu_number();
+    for (uint32_t prio = 0; prio < TASK_PRIO_COUNT; prio++) {
+        struct task* task = task_rq_first(&runqs[self], prio, self != 0);
+        if (task) return task;
+        for (uint32_t i = 1; i < pongo_cpu_count; i++) {
+            uint32_t victim = (self + i) % pongo_cpu_count;
+            task = task_rq_first(&runqs[victim], prio, true);
+            if (task) return task;
+        }
+    }
+    return NULL;
+}
+
+/*
+
+    Name: task_rq_pick_next
+    Description: dequeues the task the calling core should run next, NULL if nothing is runnable for it
+
+*/
+
+struct task* task_rq_pick_next() {
+    disable_interrupts();
+    struct task* task = task_rq_find();
+    if (task) task_rq_remove(task);
+    enable_interrupts();
+    return task;
+}
+
+bool task_rq_empty() {
+    disable_interrupts();
+    bool empty = !task_rq_find();
+    enable_interrupts();
+    return empty;
+}
+
+/*
+
+    Name: task_rq_irq_preempts
+    Description: called by irq_exc with the interrupted task. True if a top half woke a bottom half on this core that
+                 should run before returning to it, the way irq handler tasks used to be switched into right away.
+
+*/
+
+bool task_rq_irq_preempts(struct task* task) {
+    if (task_is_sched(task) || (task->flags & (TASK_LINKED|TASK_IRQ_HANDLER)) != TASK_LINKED) return false;
+    if (task->priority == TASK_PRIO_IRQ) return false;
+    return !!(runqs[cpu_number()].bitmap & (1 << TASK_PRIO_IRQ));
+}
+
+/*
+
+    Name: task_sched_return
+    Description: called by the scheduler once a task handed control back to it; requeues it if it's still runnable
+                 and drops the scheduler's reference on tasks that exited
+
+*/
+
+void task_sched_return(struct task* task) {
+    if (!task || task_is_sched(task)) return;
+    disable_interrupts();
+    if (task->flags & TASK_PLEASE_DEREF) {
+        task->flags &= ~TASK_PLEASE_DEREF;
+        task_release(task);
+    } else if (task->flags & TASK_LINKED) {
+        bool irq_preempted = !!(task->flags & TASK_IRQ_PREEMPTED);
+        task->flags &= ~TASK_IRQ_PREEMPTED;
+        task_rq_enqueue(task, irq_preempted);
+    }
+    enable_interrupts();
+}
+
+void task_set_priority(struct task* task, uint32_t priority) {
+    if (priority >= TASK_PRIO_COUNT) panic("task_set_priority: invalid priority %d", priority);
+    disable_interrupts();
+    bool queued = task->rq_queued;
+    task_rq_remove(task);
+    task->priority = priority;
+    if (queued) task_rq_enqueue(task, false);
+    enable_interrupts();
+}
+
 /*
 
     Name: task_link
@@ -704,11 +1246,13 @@ void task_link(struct task* task) {
         task->flags |= TASK_WAS_LINKED;
     }
     task->flags |= TASK_LINKED;
+    task_rq_enqueue(task, false);
     enable_interrupts();
 }
 
 void task_real_unlink(struct task* task) {
     disable_interrupts();
+    task_rq_remove(task);
     if (task->flags & TASK_WAS_LINKED) {
         if (task == pongo_sched_head) {
             if (task == task->next) {
@@ -728,14 +1272,15 @@ void task_real_unlink(struct task* task) {
 /*
 
     Name: task_set_sched_head
-    Description: moves a task to the scheduler queue head
+    Description: moves a task to the head of its run queue level
 
 */
 
 void task_set_sched_head(struct task* task) {
     disable_interrupts();
     if (!(task->flags & TASK_LINKED)) panic ("task was not linked but was asked to move to head of schedqueue");
-    pongo_sched_head = task;
+    task_rq_remove(task);
+    task_rq_enqueue(task, true);
     enable_interrupts();
 }
 
@@ -749,6 +1294,7 @@ void task_set_sched_head(struct task* task) {
 void task_unlink(struct task* task) {
     disable_interrupts();
     task->flags &= ~TASK_LINKED;
+    task_rq_remove(task);
     enable_interrupts();
 }
 
@@ -773,6 +1319,508 @@ void event_fire(struct event* ev) {
         to_link = to_link->eq_next;
     }
     ev->task_head = NULL;
+    // continuations may queue futures on ev again, those were registered with the new count and wait for the next fire
+    uint32_t fires = ++ev->fires;
+    struct pongo_future* f;
+    while ((f = ev->future_head) && f->event_fires != fires) {
+        ev->future_head = f->event_next;
+        f->event = NULL;
+        future_complete(f, 0);
+    }
+    enable_interrupts();
+}
+
+/*
+
+    Name: sleep queue
+    Description: min-heap of sleeping tasks keyed on wait_until (in timer ticks). The 1ms scheduler FIQ pops every
+                 expired entry and links it back into the run queue, so sleepers cost nothing until their deadline.
+                 Once it is full, further sleepers stay runnable and poll the clock by yielding instead.
+
+*/
+
+#define SLEEP_QUEUE_MAX 256
+static struct task* sleep_heap[SLEEP_QUEUE_MAX];
+static uint32_t sleep_heap_count;
+
+static void sleep_heap_set(uint32_t i, struct task* task) {
+    sleep_heap[i] = task;
+    task->sleep_index = i + 1;
+}
+static void sleep_heap_sift_up(uint32_t i) {
+    struct task* task = sleep_heap[i];
+    while (i) {
+        uint32_t parent = (i - 1) / 2;
+        if (sleep_heap[parent]->wait_until <= task->wait_until) break;
+        sleep_heap_set(i, sleep_heap[parent]);
+        i = parent;
+    }
+    sleep_heap_set(i, task);
+}
+static void sleep_heap_sift_down(uint32_t i) {
+    struct task* task = sleep_heap[i];
+    while (1) {
+        uint32_t child = i * 2 + 1;
+        if (child >= sleep_heap_count) break;
+        if (child + 1 < sleep_heap_count && sleep_heap[child + 1]->wait_until < sleep_heap[child]->wait_until) child++;
+        if (task->wait_until <= sleep_heap[child]->wait_until) break;
+        sleep_heap_set(i, sleep_heap[child]);
+        i = child;
+    }
+    sleep_heap_set(i, task);
+}
+static bool sleep_queue_insert(struct task* task) {
+    if (task->sleep_index) panic("sleep_queue_insert: task %s is already sleeping", task->name);
+    if (sleep_heap_count >= SLEEP_QUEUE_MAX) return false;
+    sleep_heap_set(sleep_heap_count, task);
+    sleep_heap_count++;
+    sleep_heap_sift_up(sleep_heap_count - 1);
+    return true;
+}
+static void sleep_queue_remove(struct task* task) {
+    if (!task->sleep_index) return;
+    uint32_t i = task->sleep_index - 1;
+    task->sleep_index = 0;
+    sleep_heap_count--;
+    if (i == sleep_heap_count) return;
+    struct task* moved = sleep_heap[sleep_heap_count];
+    sleep_heap_set(i, moved);
+    sleep_heap_sift_up(i);
+    sleep_heap_sift_down(moved->sleep_index - 1);
+}
+
+/*
+
+    Name: task_sleep_tick
+    Description: called from the scheduler FIQ, wakes every task whose deadline has passed
+
+*/
+
+void task_sleep_tick() {
+    if (!sleep_heap_count) return;
+    disable_interrupts();
+    uint64_t now = get_ticks();
+    while (sleep_heap_count && sleep_heap[0]->wait_until <= now) {
+        struct task* task = sleep_heap[0];
+        sleep_queue_remove(task);
+        task_link(task);
+    }
+    enable_interrupts();
+}
+
+/*
+
+    Name: task_sleep_next_deadline
+    Description: returns the earliest sleep deadline in ticks, or 0 if no task is sleeping
+
+*/
+
+uint64_t task_sleep_next_deadline() {
+    return sleep_heap_count ? sleep_heap[0]->wait_until : 0;
+}
+
+// fallback for a full sleep queue, called and returns with interrupts disabled: yields until the deadline passes or
+// whoever wakes us has taken us off the eq_next list at *head
+static void task_poll_listed(struct task** head, struct task* task, uint64_t deadline) {
+    while (get_ticks() < deadline) {
+        struct task* cur = *head;
+        while (cur && cur != task) cur = cur->eq_next;
+        if (!cur) return;
+        enable_interrupts();
+        task_yield();
+        disable_interrupts();
+    }
+}
+
+static bool task_can_block(struct task* task) {
+    extern char timer_inited;
+    if (dis_int_count != 1) return false; // caller holds interrupts, we can't yield
+    if (!timer_inited) return false; // nothing would wake us up
+    if (task_is_sched(task)) return false;
+    if (task->flags & TASK_IRQ_HANDLER) return false;
+    return true;
+}
+
+/*
+
+    Name: task_sleep_until
+    Description: blocks the current task until get_ticks() reaches deadline. Falls back to yielding in a loop
+                 where blocking isn't possible (interrupts held, irq handlers, before the timer is up, sleep queue
+                 full).
+
+*/
+
+void task_sleep_until(uint64_t deadline) {
+    disable_interrupts();
+    struct task* task = task_current();
+    if (!task_can_block(task)) {
+        enable_interrupts();
+        while (get_ticks() < deadline) {
+            task_yield();
+        }
+        return;
+    }
+    if (get_ticks() >= deadline) {
+        enable_interrupts();
+        return;
+    }
+    task->wait_until = deadline;
+    if (!sleep_queue_insert(task)) {
+        enable_interrupts();
+        while (get_ticks() < deadline) {
+            task_yield();
+        }
+        return;
+    }
+    task_unlink(task);
+    task_yield_asserted();
+    disable_interrupts();
+    sleep_queue_remove(task); // in case something else linked us before the deadline
+    enable_interrupts();
+}
+
+/*
+
+    Name: event_wait_timeout
+    Description: like event_wait, but gives up after timeout_us microseconds
+    Return values: true if the event fired, false on timeout
+
+*/
+
+bool event_wait_timeout(struct event* ev, uint64_t timeout_us) {
+    disable_interrupts();
+    struct task* task = task_current();
+    if (!timeout_us || !task_can_block(task)) {
+        enable_interrupts();
+        return false;
+    }
+    task->wait_until = get_ticks() + timeout_us * (TICKS_IN_1MS / 1000);
+    task->eq_next = ev->task_head;
+    ev->task_head = task;
+    if (sleep_queue_insert(task)) {
+        task_unlink(task);
+        task_yield_asserted();
+        disable_interrupts();
+        sleep_queue_remove(task);
+    } else {
+        task_poll_listed(&ev->task_head, task, task->wait_until);
+    }
+    // event_fire empties the waiter list, so if we are still on it we were woken by the deadline
+    bool fired = true;
+    for (struct task** waiter = &ev->task_head; *waiter; waiter = &(*waiter)->eq_next) {
+        if (*waiter == task) {
+            *waiter = task->eq_next;
+            fired = false;
+            break;
+        }
+    }
+    enable_interrupts();
+    return fired;
+}
+/*
+
+    Name: wait queues
+    Description: FIFO of blocked tasks linked through eq_next, used by semaphores and condition variables. Unlike
+                 events, whoever wakes a waiter dequeues it first, so a task that is still queued after waking up
+                 knows its deadline passed.
+
+*/
+
+static void waitq_push(struct waitq* q, struct task* task) {
+    task->eq_next = NULL;
+    if (q->tail) q->tail->eq_next = task;
+    else q->head = task;
+    q->tail = task;
+}
+static struct task* waitq_pop(struct waitq* q) {
+    struct task* task = q->head;
+    if (!task) return NULL;
+    q->head = task->eq_next;
+    if (!q->head) q->tail = NULL;
+    task->eq_next = NULL;
+    return task;
+}
+static bool waitq_remove(struct waitq* q, struct task* task) {
+    struct task* prev = NULL;
+    for (struct task* cur = q->head; cur; prev = cur, cur = cur->eq_next) {
+        if (cur != task) continue;
+        if (prev) prev->eq_next = cur->eq_next;
+        else q->head = cur->eq_next;
+        if (q->tail == cur) q->tail = prev;
+        cur->eq_next = NULL;
+        return true;
+    }
+    return false;
+}
+
+// called with interrupts disabled exactly once, returns with them enabled; false if the deadline (if any) hit first
+static bool waitq_block(struct waitq* q, uint64_t deadline) {
+    struct task* task = task_current();
+    waitq_push(q, task);
+    if (deadline) {
+        task->wait_until = deadline;
+        if (!sleep_queue_insert(task)) {
+            task_poll_listed(&q->head, task, deadline);
+            bool woken = !waitq_remove(q, task);
+            enable_interrupts();
+            return woken;
+        }
+    }
+    task_unlink(task);
+    task_yield_asserted();
+    disable_interrupts();
+    if (deadline) sleep_queue_remove(task);
+    bool woken = !waitq_remove(q, task);
+    enable_interrupts();
+    return woken;
+}
+
+static uint64_t wait_deadline(uint64_t timeout_us) {
+    return get_ticks() + timeout_us * (TICKS_IN_1MS / 1000);
+}
+
+/*
+
+    Name: semaphore
+    Description: counting semaphore with wake-one semantics; semaphore_signal hands its permit straight to the
+                 longest waiter instead of waking everyone to race for it
+
+*/
+
+void semaphore_init(struct semaphore* sem, int32_t count) {
+    sem->count = count;
+    sem->waiters.head = sem->waiters.tail = NULL;
+}
+
+bool semaphore_try(struct semaphore* sem) {
+    disable_interrupts();
+    bool taken = sem->count > 0;
+    if (taken) sem->count--;
+    enable_interrupts();
+    return taken;
+}
+
+static bool semaphore_wait_deadline(struct semaphore* sem, uint64_t deadline, bool timed) {
+    disable_interrupts();
+    if (sem->count > 0) {
+        sem->count--;
+        enable_interrupts();
+        return true;
+    }
+    if (timed && get_ticks() >= deadline) {
+        enable_interrupts();
+        return false;
+    }
+    if (!task_can_block(task_current())) {
+        enable_interrupts();
+        while (!semaphore_try(sem)) {
+            if (timed && get_ticks() >= deadline) return false;
+            task_yield();
+        }
+        return true;
+    }
+    return waitq_block(&sem->waiters, timed ? deadline : 0);
+}
+
+void semaphore_wait(struct semaphore* sem) {
+    semaphore_wait_deadline(sem, 0, false);
+}
+
+bool semaphore_wait_timeout(struct semaphore* sem, uint64_t timeout_us) {
+    return semaphore_wait_deadline(sem, wait_deadline(timeout_us), true);
+}
+
+void semaphore_signal(struct semaphore* sem) {
+    disable_interrupts();
+    struct task* waiter = waitq_pop(&sem->waiters);
+    if (waiter) task_link(waiter); // the permit goes to the waiter, count stays where it is
+    else sem->count++;
+    enable_interrupts();
+}
+
+/*
+
+    Name: condvar
+    Description: condition variable paired with a lock. The waiter is queued before the lock is dropped, with
+                 interrupts held across both, so a signal sent right after the unlock can't get lost.
+
+*/
+
+void condvar_init(struct condvar* cv) {
+    cv->waiters.head = cv->waiters.tail = NULL;
+}
+
+static bool condvar_wait_deadline(struct condvar* cv, lock* l, uint64_t deadline) {
+    disable_interrupts();
+    if (!task_can_block(task_current())) {
+        // can't sleep here: drop the lock, let others run once and have the caller re-check its predicate
+        enable_interrupts();
+        lock_release(l);
+        task_yield();
+        lock_take(l);
+        return !deadline || get_ticks() < deadline;
+    }
+    lock_release(l);
+    bool woken = waitq_block(&cv->waiters, deadline);
+    lock_take(l);
+    return woken;
+}
+
+void condvar_wait(struct condvar* cv, lock* l) {
+    condvar_wait_deadline(cv, l, 0);
+}
+
+bool condvar_wait_timeout(struct condvar* cv, lock* l, uint64_t timeout_us) {
+    return condvar_wait_deadline(cv, l, wait_deadline(timeout_us));
+}
+
+void condvar_signal(struct condvar* cv) {
+    disable_interrupts();
+    struct task* waiter = waitq_pop(&cv->waiters);
+    if (waiter) task_link(waiter);
+    enable_interrupts();
+}
+
+void condvar_broadcast(struct condvar* cv) {
+    disable_interrupts();
+    struct task* waiter;
+    while ((waiter = waitq_pop(&cv->waiters))) task_link(waiter);
+    enable_interrupts();
+}
+
+/*
+
+    Name: future
+    Description: one-shot completion with a value. Whatever produces the result (a USB completion, a timer, another
+                 task) calls future_complete, which is safe with interrupts held. Consumers either block on it with
+                 future_await from task context, or chain a continuation with future_then that runs in the
+                 completer's context, so a driver flow can be written as straight-line code or as a chain of small
+                 steps instead of a set of busy flags. A future has to be zero-filled or already initialised before
+                 future_init, which may find an armed timer or event registration in it.
+
+*/
+
+static void future_event_detach(struct pongo_future* f) {
+    if (!f->event) return;
+    struct pongo_future** link = &f->event->future_head;
+    while (*link && *link != f) link = &(*link)->event_next;
+    if (*link) *link = f->event_next;
+    f->event = NULL;
+    f->event_next = NULL;
+}
+
+void future_init(struct pongo_future* f) {
+    disable_interrupts();
+    future_event_detach(f); // so a stale event can't complete the new round
+    f->state = FUTURE_PENDING;
+    f->value = 0;
+    f->waiters.head = f->waiters.tail = NULL;
+    f->then = NULL;
+    f->then_ctx = NULL;
+    timer_cancel(&f->timer); // re-initialising a future_sleep that is still pending drops its timer
+    bzero(&f->timer, sizeof(f->timer));
+    enable_interrupts();
+}
+
+bool future_pending(struct pongo_future* f) {
+    return f->state == FUTURE_PENDING;
+}
+
+void future_complete(struct pongo_future* f, int64_t value) {
+    disable_interrupts();
+    if (f->state != FUTURE_PENDING) {
+        enable_interrupts();
+        return;
+    }
+    f->value = value;
+    f->state = FUTURE_DONE;
+    future_event_detach(f);
+    void (*then)(struct pongo_future*, void*) = f->then;
+    void* then_ctx = f->then_ctx;
+    f->then = NULL;
+    struct task* waiter;
+    while ((waiter = waitq_pop(&f->waiters))) task_link(waiter);
+    if (then) then(f, then_ctx); // may re-init and restart f
+    enable_interrupts();
+}
+
+void future_then(struct pongo_future* f, void (*then)(struct pongo_future* f, void* ctx), void* ctx) {
+    disable_interrupts();
+    if (f->state == FUTURE_PENDING) {
+        if (f->then) panic("future_then: continuation already set");
+        f->then = then;
+        f->then_ctx = ctx;
+        enable_interrupts();
+        return;
+    }
+    enable_interrupts(); // already done, so this is the caller's context rather than the completer's
+    then(f, ctx);
+}
+
+static bool future_await_deadline(struct pongo_future* f, uint64_t deadline, int64_t* value) {
+    disable_interrupts();
+    while (f->state == FUTURE_PENDING) {
+        if (deadline && get_ticks() >= deadline) {
+            enable_interrupts();
+            return false;
+        }
+        if (!task_can_block(task_current())) {
+            enable_interrupts();
+            task_yield();
+            disable_interrupts();
+            continue;
+        }
+        waitq_block(&f->waiters, deadline);
+        disable_interrupts();
+    }
+    if (value) *value = f->value;
+    enable_interrupts();
+    return true;
+}
+
+int64_t future_await(struct pongo_future* f) {
+    int64_t value = 0;
+    future_await_deadline(f, 0, &value);
+    return value;
+}
+
+bool future_await_timeout(struct pongo_future* f, uint64_t timeout_us, int64_t* value) {
+    return future_await_deadline(f, wait_deadline(timeout_us), value);
+}
+
+static void future_timer_fired(void* ctx) {
+    future_complete(ctx, 0);
+}
+
+void future_sleep(struct pongo_future* f, uint64_t timeout_us) {
+    future_init(f);
+    timer_arm(&f->timer, wait_deadline(timeout_us), future_timer_fired, f);
+}
+
+void future_cancel(struct pongo_future* f, int64_t value) {
+    timer_cancel(&f->timer);
+    future_complete(f, value);
+}
+
+/*
+
+    Name: future_event
+    Description: bridges an event into a future: the future is queued on the event and the next event_fire completes
+                 it, so an event can be awaited with a timeout or chained like any other completion. Whoever gives up
+                 on it has to future_cancel or future_init it before letting go of the future, which takes it off the
+                 event again.
+
+*/
+
+void future_event(struct pongo_future* f, struct event* ev) {
+    future_init(f);
+    disable_interrupts();
+    f->event = ev;
+    f->event_fires = ev->fires;
+    f->event_next = NULL;
+    struct pongo_future** link = &ev->future_head;
+    while (*link) link = &(*link)->event_next; // in order, so event_fire stops at the first one queued while it runs
+    *link = f;
     enable_interrupts();
 }
 struct proc* proc_create(struct proc* parent, const char* procname, uint32_t flags) {
@@ -73,6 +73,7 @@ struct vm_space {
     uint32_t refcount;
     struct vm_space* parent;
     uint64_t asid;
+    uint64_t asid_generation; // asid is only valid while this matches the global generation
 };
 extern void vm_init();
 
@@ -128,7 +129,30 @@ struct task { // a task is a thread-like execution environment, executing under
     lock task_lock;
     struct proc* proc;
     struct task* proc_task_list_next; // only tasks created with proc_create_task are queued here
+    struct task* rq_next; // run queue linkage, see task_rq_pick_next
+    struct task* rq_prev;
+    uint32_t priority; // TASK_PRIO_*
+    bool rq_queued;
+    uint32_t sleep_index; // 1-based slot in the sleep queue, 0 if not sleeping
+    uint32_t lock_wait_mode; // non-zero while queued on a lock
+    struct task* lock_wait_next;
+    uint64_t cpu_ticks; // time spent switched in, see task_switch_account
+    uint64_t switched_in_at;
+    uint32_t cpu; // core it last ran on, SMP tasks get queued back there
+    uint32_t rq_cpu; // whose run queue it sits on while rq_queued
+    volatile bool on_cpu; // switched in somewhere, other cores must not pick it
 };
+#define KSTACK_KERN 0 // kernel tasks, also the kernel side of EL0 tasks
+#define KSTACK_IRQ 1 // irq handler tasks
+#define KSTACK_EXC 2 // per-task exception stacks
+#define KSTACK_PREEMPT 3 // preemptible kernel tasks, they can be interrupted at any depth
+#define KSTACK_CLASS_COUNT 4
 extern void task_alloc_fast_stacks(struct task* task);
+extern void task_alloc_stacks(struct task* task, uint32_t cls);
+extern void* kernel_stack_allocate_class(uint32_t cls);
+extern void kernel_stack_free(void* stack);
+extern void kernel_stack_cache_init();
+extern bool kernel_stack_guard_hit(struct task* task, uint64_t addr);
+extern void kernel_stack_stats_print();
 
 #endif /* task_h */
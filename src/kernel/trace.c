@@ -0,0 +1,141 @@
+/* 
+ * pongoOS - https://checkra.in
+ * 
+ * Copyright (C) 2019-2021 checkra1n team
+ *
+ * This file is part of pongoOS.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * 
+ */
+#include <pongo.h>
+
+/*
+
+    Name: trace ring
+    Description: fixed-size ring of binary trace events. Writers only ever bump the head, the single reader (the USB
+                 control endpoint or the shell) follows with its own cursor and counts whatever got overwritten as
+                 dropped. Both sides mask interrupts for the handful of stores involved.
+
+*/
+
+#define PONGO_TRACE_RING_SIZE 4096 // power of two
+
+volatile bool pongo_trace_enabled;
+static struct pongo_trace_event trace_ring[PONGO_TRACE_RING_SIZE];
+static uint64_t trace_head;
+static uint64_t trace_tail;
+static uint64_t trace_dropped;
+
+void pongo_trace_record(uint32_t type, uint64_t arg0, uint64_t arg1) {
+    if (!pongo_trace_enabled) return;
+    uint64_t now = get_ticks();
+    struct task* task = task_current();
+    disable_interrupts();
+    struct pongo_trace_event* ev = &trace_ring[trace_head & (PONGO_TRACE_RING_SIZE - 1)];
+    ev->ticks = now;
+    ev->type = type;
+    ev->pid = task ? task->pid : 0;
+    ev->arg0 = arg0;
+    ev->arg1 = arg1;
+    trace_head++;
+    enable_interrupts();
+}
+
+/*
+
+    Name: pongo_trace_switch
+    Description: called from task_switch_account with interrupts held, only while tracing
+
+*/
+
+void pongo_trace_switch(struct task* prev, struct task* next) {
+    struct pongo_trace_event* ev = &trace_ring[trace_head & (PONGO_TRACE_RING_SIZE - 1)];
+    ev->ticks = get_ticks();
+    ev->type = PONGO_TRACE_SWITCH;
+    ev->pid = prev ? prev->pid : 0;
+    ev->arg0 = next->pid;
+    memcpy(&ev->arg1, next->name, sizeof(ev->arg1)); // short name so the host can label tasks
+    trace_head++;
+}
+
+/*
+
+    Name: pongo_trace_read
+    Description: copies the oldest unread events into buf behind a pongo_trace_header, as many as fit into size
+    Return values: number of bytes written
+
+*/
+
+size_t pongo_trace_read(void* buf, size_t size) {
+    if (size < sizeof(struct pongo_trace_header)) return 0;
+    struct pongo_trace_header* hdr = buf;
+    struct pongo_trace_event* out = (struct pongo_trace_event*)(hdr + 1);
+    size_t max = (size - sizeof(*hdr)) / sizeof(struct pongo_trace_event);
+
+    disable_interrupts();
+    if (trace_head - trace_tail > PONGO_TRACE_RING_SIZE) {
+        trace_dropped += trace_head - trace_tail - PONGO_TRACE_RING_SIZE;
+        trace_tail = trace_head - PONGO_TRACE_RING_SIZE;
+    }
+    size_t count = trace_head - trace_tail;
+    if (count > max) count = max;
+    for (size_t i = 0; i < count; i++) {
+        out[i] = trace_ring[(trace_tail + i) & (PONGO_TRACE_RING_SIZE - 1)];
+    }
+    trace_tail += count;
+    hdr->magic = PONGO_TRACE_MAGIC;
+    hdr->version = PONGO_TRACE_VERSION;
+    hdr->count = count;
+    hdr->dropped = trace_dropped;
+    hdr->tick_hz = TICKS_IN_1MS * 1000;
+    trace_dropped = 0;
+    enable_interrupts();
+
+    return sizeof(*hdr) + count * sizeof(struct pongo_trace_event);
+}
+
+void pongo_trace_clear() {
+    disable_interrupts();
+    trace_tail = trace_head;
+    trace_dropped = 0;
+    enable_interrupts();
+}
+
+void pongo_trace_set_enabled(bool enabled) {
+    pongo_trace_enabled = enabled;
+}
+
+void trace_cmd(const char* cmd, char* args) {
+    if (strcmp(args, "on") == 0) {
+        pongo_trace_set_enabled(true);
+    } else if (strcmp(args, "off") == 0) {
+        pongo_trace_set_enabled(false);
+    } else if (strcmp(args, "clear") == 0) {
+        pongo_trace_clear();
+    } else if (args[0]) {
+        iprintf("usage: trace [on|off|clear]\n");
+        return;
+    }
+    disable_interrupts();
+    uint64_t pending = trace_head - trace_tail;
+    uint64_t total = trace_head;
+    enable_interrupts();
+    iprintf("tracing %s, %llu events recorded, %llu unread (ring holds %u)\n", pongo_trace_enabled ? "on" : "off", total, pending, PONGO_TRACE_RING_SIZE);
+}
@@ -983,3 +983,71 @@ int unlzma_decompress(uint8_t *dest, size_t *dest_size, const uint8_t *src, size
     return (i);
 }
 
+void unlzma_stream_init(unlzma_stream *s, uint8_t *dest, size_t dest_size)
+{
+    LzmaDec_Construct(&s->dec);
+    s->dec.dic = dest;
+    s->dec.dicBufSize = dest_size;
+    s->dec.dicPos = 0;
+    s->headerLen = 0;
+    s->unpackSize = (UInt64)-1;
+    s->status = LZMA_STATUS_NOT_SPECIFIED;
+}
+
+int unlzma_stream_feed(unlzma_stream *s, const uint8_t *src, size_t *src_size, size_t dest_limit)
+{
+    size_t avail = *src_size, used = 0;
+    int i;
+
+    *src_size = 0;
+    if(s->headerLen < sizeof(s->header))
+    {
+	size_t n = sizeof(s->header) - s->headerLen;
+	if(n > avail)
+	    n = avail;
+	memcpy(s->header + s->headerLen, src, n);
+	s->headerLen += n;
+	used += n;
+	if(s->headerLen < sizeof(s->header))
+	{
+	    *src_size = used;
+	    return SZ_OK;
+	}
+	s->unpackSize = 0;
+	for(i = 0; i < 8; i++)
+	    s->unpackSize |= (UInt64)s->header[LZMA_PROPS_SIZE + i] << (8 * i);
+	RINOK(LzmaDec_AllocateProbs(&s->dec, s->header, LZMA_PROPS_SIZE, &unlzma_alloc_str));
+	LzmaDec_Init(&s->dec);
+    }
+
+    if(dest_limit > s->dec.dicBufSize)
+	dest_limit = s->dec.dicBufSize;
+    if(s->unpackSize != (UInt64)-1 && dest_limit > s->unpackSize)
+	dest_limit = s->unpackSize;
+
+    SizeT inSize = avail - used;
+    int res = SZ_OK;
+    if(inSize && s->dec.dicPos < dest_limit)
+	res = LzmaDec_DecodeToDic(&s->dec, dest_limit, src + used, &inSize, LZMA_FINISH_ANY, &s->status);
+    else
+	inSize = 0;
+    *src_size = used + inSize;
+    return res;
+}
+
+size_t unlzma_stream_out(unlzma_stream *s)
+{
+    return s->dec.dicPos;
+}
+
+int unlzma_stream_finished(unlzma_stream *s)
+{
+    if(s->status == LZMA_STATUS_FINISHED_WITH_MARK)
+	return 1;
+    return s->headerLen == sizeof(s->header) && s->unpackSize != (UInt64)-1 && s->dec.dicPos >= s->unpackSize;
+}
+
+void unlzma_stream_free(unlzma_stream *s)
+{
+    LzmaDec_FreeProbs(&s->dec, &unlzma_alloc_str);
+}
@@ -30,7 +30,7 @@ extern uint64_t gIOBase;
 #include <libfdt.h>
 #include <lzma/lzmadec.h>
 
-void *fdt = NULL;
+void *fdt = NULL; // NULL or a LINUX_DTREE_SIZE heap block whenever fdt_initialized is set, so free(fdt) is always valid
 bool fdt_initialized = false;
 void *ramdisk = NULL;
 uint32_t prev_ramdisk_size = 0;
@@ -244,9 +244,7 @@ void linux_dtree_overlay(char *boot_args)
 
 bool linux_can_boot()
 {
-    if (!loader_xfer_recv_count)
-        return false;
-    return true;
+    return upload_ready("kernel") || upload_ready(NULL);
 }
 
 void *gLinuxStage;
@@ -343,20 +341,23 @@ void linux_prep_boot()
     puts("This is only supported on iPhone 7 for now and works to a lesser extent on other A10 devices. Behavior on non-A10 devices is undefined!!");
 
     gEntryPoint = (void *)(0x800080000);
-    uint64_t image_size = loader_xfer_recv_count;
+    struct upload_buffer *kernel = upload_take("kernel");
+    uint8_t *image = kernel ? kernel->data : loader_xfer_recv_data;
+    uint64_t image_size = kernel ? kernel->count : loader_xfer_recv_count;
     gLinuxStage = (void *)alloc_contig(image_size + LINUX_DTREE_SIZE);
     size_t dest_size = 0x10000000;
-    int res = unlzma_decompress((uint8_t *)gLinuxStage, &dest_size, loader_xfer_recv_data, image_size);
+    int res = unlzma_decompress((uint8_t *)gLinuxStage, &dest_size, image, image_size);
     if (res != SZ_OK)
     {
         puts("Assuming decompressed kernel.");
-        image_size = *(uint64_t *)(loader_xfer_recv_data + 16);
-        memcpy(gLinuxStage, loader_xfer_recv_data, image_size);
+        image_size = *(uint64_t *)(image + 16);
+        memcpy(gLinuxStage, image, image_size);
     }
     else
     {
         image_size = *(uint64_t *)(gLinuxStage + 16);
     }
+    upload_release(kernel);
     void *gLinuxDtre = (void *)((((uint64_t)gLinuxStage) + image_size + 7ull) & -8ull);
     memcpy(gLinuxDtre, fdt, LINUX_DTREE_SIZE);
     gLinuxStageSize = image_size + LINUX_DTREE_SIZE;
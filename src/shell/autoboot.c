@@ -36,7 +36,9 @@ void pongo_autoboot()
         autoboot_count = loader_xfer_recv_count;
         phys_force_free(vatophys((uint64_t)autoboot_block), (autoboot_block[1] + 0x20 + 0x3fff) & ~0x3fff);
 
-        queue_rx_string("modload\nautoboot\n");
+        // rendering text only slows the boot down, serial still gets it; if autoboot comes back, so does the screen
+        console_sink_set_enabled("screen", false);
+        queue_rx_string("modload\nautoboot\nconsole screen on\n");
 	}
 }
 
@@ -126,7 +126,25 @@ void command_execute(char* cmd) {
 extern uint32_t uart_should_drop_rx;
 char command_handler_ready = 0;
 volatile uint8_t command_in_progress = 0;
-struct event command_handler_iter;
+// bumped every time the shell gets back to its prompt, see command_wait_for_prompt
+static lock command_handler_lock;
+static struct condvar command_handler_cv;
+static uint64_t command_handler_gen;
+
+uint64_t command_handler_generation() {
+    lock_take(&command_handler_lock);
+    uint64_t gen = command_handler_gen;
+    lock_release(&command_handler_lock);
+    return gen;
+}
+
+void command_wait_for_prompt(uint64_t gen) {
+    lock_take(&command_handler_lock);
+    while (command_handler_gen == gen) {
+        condvar_wait(&command_handler_cv, &command_handler_lock);
+    }
+    lock_release(&command_handler_lock);
+}
 
 static inline void put_serial_modifier(const char* str) {
     while (*str) serial_putc(*str++);
@@ -148,7 +166,10 @@ void command_main() {
             }
         }
         fflush(stdout);
-        event_fire(&command_handler_iter);
+        lock_take(&command_handler_lock);
+        command_handler_gen++;
+        condvar_broadcast(&command_handler_cv);
+        lock_release(&command_handler_lock);
         command_handler_ready = 1;
         command_in_progress = 0;
         fgets(command_buffer,512,stdin);
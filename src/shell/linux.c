@@ -43,6 +43,11 @@ void fdt_cmd() {
         iprintf("please upload a fdt before issuing this command\n");
         return;
     }
+    if (loader_xfer_recv_count > LINUX_DTREE_SIZE) {
+        iprintf("fdt is larger than LINUX_DTREE_SIZE (%u > %lu)\n", loader_xfer_recv_count, (size_t) LINUX_DTREE_SIZE);
+        loader_xfer_recv_count = 0;
+        return;
+    }
     if (fdt_initialized) free(fdt);
     fdt = malloc(LINUX_DTREE_SIZE);
     if (!fdt) panic("couldn't reserve heap for fdt");
@@ -74,6 +79,7 @@ void linux_cmdline_cmd(const char* cmd, char* args) {
 */
 
 void pongo_boot_linux() {
+    usbloader_wait_upload(); // a streamed kernel may still be decompressing
     if (!linux_can_boot()) {
         printf("linux boot not prepared\n");
         return;
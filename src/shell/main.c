@@ -37,11 +37,15 @@ extern volatile char gBootFlag;
 
 */
 
+void* raw_boot_image;
 void pongo_boot_raw() {
     if (!loader_xfer_recv_count) {
         iprintf("please upload a raw image before issuing this command\n");
         return;
     }
+    // the image is entered through its physical address, which the upload buffer doesn't have in one piece
+    uint32_t size;
+    raw_boot_image = usbloader_copy_contig(&size);
     loader_xfer_recv_count = 0;
     gBootFlag = BOOT_FLAG_RAW;
     task_yield();
@@ -62,6 +66,7 @@ void ramdisk_cmd() {
         iprintf("please upload a ramdisk before issuing this command\n");
         return;
     }
+    // ramdisk_buf is exported and modules realloc it (the KPF appends kerninfo), so it always has to be a heap block
     if (ramdisk_buf) free(ramdisk_buf);
     ramdisk_buf = malloc(loader_xfer_recv_count);
     if (!ramdisk_buf) panic("couldn't reserve heap for ramdisk");
@@ -221,6 +226,68 @@ void spawn_cmd(const char* cmd, char* args) {
     proc_release(umproc); // the proc will be held alive by the reference in the task, which will be dropped once it gets free'd
 }
 
+static struct event ctxbench_ev;
+static volatile uint32_t ctxbench_done;
+static void ctxbench_task_exited() {
+    ctxbench_done++;
+    event_fire(&ctxbench_ev);
+}
+static struct task* ctxbench_spawn(const char* name, uint64_t iterations) {
+    uint64_t shc_addr = 0;
+
+    struct proc* umproc = proc_create(NULL, name, 0);
+    vm_allocate(umproc->vm_space, &shc_addr, 0x4000, VM_FLAGS_ANYWHERE | VM_FLAGS_NOMAP);
+    uint64_t phys = ppage_alloc();
+    uint32_t* ins = phystokv(phys);
+    int ic = 0;
+    ins[ic++] = 0xaa0003f3; // mov x19, x0
+    ins[ic++] = 0xd28000af; // mov x15, #5 (yield)
+    ins[ic++] = 0xd4000841; // svc #0x42
+    ins[ic++] = 0xd1000673; // sub x19, x19, #1
+    ins[ic++] = 0xb5ffffb3; // cbnz x19, <mov x15>
+    ins[ic++] = 0xd280002f; // mov x15, #1 (exit)
+    ins[ic++] = 0xd4000841; // svc #0x42
+    ins[ic++] = 0xd65f03c0; // ret
+
+    invalidate_icache();
+    vm_space_map_page_physical_prot(umproc->vm_space, shc_addr, phys, PROT_READ | PROT_WRITE | PROT_EXEC);
+
+    struct task* umtask = proc_create_task(umproc, (void*)shc_addr);
+    umtask->initial_state[0] = iterations;
+    umtask->exit_callback = ctxbench_task_exited;
+    proc_release(umproc);
+    return umtask;
+}
+void ctxbench_cmd(const char* cmd, char* args) {
+    uint64_t iterations = 10000;
+    if (*args) iterations = strtoull(args, NULL, 0);
+    if (!iterations) {
+        iprintf("usage: ctxbench [iterations]\n");
+        return;
+    }
+    extern uint64_t asid_rollovers;
+    uint64_t rollovers = asid_rollovers;
+
+    ctxbench_done = 0;
+    struct task* a = ctxbench_spawn("ctxbench-a", iterations);
+    struct task* b = ctxbench_spawn("ctxbench-b", iterations);
+
+    disable_interrupts();
+    uint64_t start = get_ticks();
+    task_link(a);
+    task_link(b);
+    while (ctxbench_done < 2) {
+        event_wait_asserted(&ctxbench_ev);
+        disable_interrupts();
+    }
+    uint64_t ticks = get_ticks() - start;
+    enable_interrupts();
+
+    // every yield goes EL0 task -> sched -> other EL0 task, so each one is two switches
+    uint64_t switches = iterations * 2 * 2;
+    iprintf("ctxbench: %lld yields per task in %lld ticks (%lld us), ~%lld ns per switch, %lld ASID rollovers\n", iterations, ticks, (ticks * 1000) / TICKS_IN_1MS, (ticks * 1000000) / (TICKS_IN_1MS * switches), asid_rollovers - rollovers);
+}
+
 void paging_cmd(const char* cmd, char* args) {
     uint64_t addr = 0;
     vm_allocate(task_current()->vm_space, &addr, 0x8000, VM_FLAGS_ANYWHERE);
@@ -253,6 +320,18 @@ void shell_main() {
     extern void task_list(const char *, char*);
     command_register("panic", "calls panic()", panic_cmd);
     command_register("ps", "lists current tasks and irq handlers", task_list);
+    extern void console_cmd(const char *, char*);
+    command_register("console", "lists console sinks or switches one on/off (console [sink on|off])", console_cmd);
+    extern void top_cmd(const char *, char*);
+    command_register("top", "samples per-task cpu usage, switches and irqs (top [ms])", top_cmd);
+    extern void cpus_cmd(const char *, char*);
+    command_register("cpus", "lists cores described by the device tree, 'cpus start' brings up the secondaries (experimental)", cpus_cmd);
+    extern void trace_cmd(const char *, char*);
+    command_register("trace", "controls the scheduler and interrupt trace ring", trace_cmd);
+    extern void profile_cmd(const char *, char*);
+    command_register("profile", "controls the sampling profiler", profile_cmd);
+    extern void meminfo_cmd(const char *, char*);
+    command_register("meminfo", "prints physical and virtual memory usage", meminfo_cmd);
     command_register("ramdisk", "loads a ramdisk for xnu or linux", ramdisk_cmd);
     command_register("bootr", "boot raw image", pongo_boot_raw);
     command_register("spin", "spins 1 second", pongo_spin);
@@ -262,6 +341,7 @@ void shell_main() {
     command_register("physdump", "dumps a page of phys", phys_page_dump);
     command_register("shell", "starts uart & usb based shell", start_host_shell);
     command_register("spawn", "starts a usermode process", spawn_cmd);
+    command_register("ctxbench", "measures context switch cost between two usermode tasks", ctxbench_cmd);
     command_register("paging", "tests paging", paging_cmd);
     command_register("recursion", "tests stack guards", recursion_cmd);
     extern void linux_commands_register(void);
@@ -274,8 +354,8 @@ void shell_main() {
         Load USB Loader
     */
 
-    extern void modload_cmd();
-    command_register("modload", "loads module", modload_cmd);
+    extern void modload_cmd(const char* cmd, char* args);
+    command_register("modload", "loads module (from the module:[name] upload slot if given)", modload_cmd);
     command_init();
 
     xnu_init();
@@ -28,9 +28,9 @@
 #include <mach-o/loader.h>
 #include <mach-o/nlist.h>
 #include <mach-o/reloc.h>
+#include <lzma/lzmadec.h>
 
 #define UPLOADSZ (1024 * 1024)
-#define UPLOADSZ_MAX (1024 * 1024 * 128)
 
 uint8_t * loader_xfer_recv_data;
 uint32_t loader_xfer_recv_count;
@@ -38,12 +38,387 @@ uint32_t loader_xfer_recv_size;
 uint32_t loader_next_xfer_size;
 uint32_t loader_xfer_size;
 extern uint64_t vatophys(uint64_t kvaddr);
-char usbloader_is_waiting_xfer;
-void usbloader_xfer_done_cb(void* data, uint32_t size, uint32_t transferred) {
-    if (!usbloader_is_waiting_xfer) return;
-    cache_invalidate(loader_xfer_recv_data, loader_xfer_recv_count);
-    loader_xfer_recv_count = transferred;
-    usbloader_is_waiting_xfer = 0;
+struct pongo_future loader_xfer_done; // pending while a bulk upload is in flight, completes with the byte count
+
+/*
+
+    Name: upload buffers
+    Description: an upload buffer is a fixed UPLOADSZ_MAX window of kernel VA backed by individually allocated
+                 pages, so growing it only maps more pages: no contiguous region to find and nothing to copy.
+                 Released buffers give their pages back but keep their window for the next buffer.
+
+*/
+
+static struct upload_buffer* upload_buffer_freelist;
+static struct upload_buffer* upload_buffer_alloc() {
+    disable_interrupts();
+    struct upload_buffer* buf = upload_buffer_freelist;
+    if (buf) upload_buffer_freelist = buf->next;
+    enable_interrupts();
+    if (!buf) {
+        buf = malloc(sizeof(struct upload_buffer));
+        if (!buf) panic("upload_buffer_alloc: OOM");
+        buf->data = (uint8_t*)linear_kvm_alloc(UPLOADSZ_MAX);
+        buf->size = 0;
+        buf->page_count = 0;
+    }
+    buf->count = 0;
+    buf->next = NULL;
+    return buf;
+}
+/*
+
+    Name: upload_grow
+    Description: maps pages behind a buffer until it holds at least newsz bytes
+
+*/
+
+void upload_grow(struct upload_buffer* buf, uint32_t newsz) {
+    if (newsz > UPLOADSZ_MAX) panic("upload_grow");
+    uint32_t pages = (newsz + PAGE_MASK) / PAGE_SIZE;
+    while (buf->page_count < pages) {
+        uint64_t page = ppage_alloc();
+        vm_space_map_page_physical_prot(&kernel_vm_space, (uint64_t)buf->data + buf->page_count * PAGE_SIZE, page, PROT_READ|PROT_WRITE|PROT_KERN_ONLY);
+        disable_interrupts();
+        buf->pages[buf->page_count++] = page;
+        buf->size = buf->page_count * PAGE_SIZE;
+        enable_interrupts();
+    }
+}
+
+/*
+
+    Name: upload_release
+    Description: returns a buffer obtained from upload_take, its pages are freed
+
+*/
+
+void upload_release(struct upload_buffer* buf) {
+    if (!buf) return;
+    for (uint32_t i = 0; i < buf->page_count; i++) {
+        vm_space_map_page_physical_prot(&kernel_vm_space, (uint64_t)buf->data + i * PAGE_SIZE, 0, 0);
+    }
+    buf->page_count = 0;
+    buf->size = 0;
+    buf->count = 0;
+    disable_interrupts();
+    buf->next = upload_buffer_freelist;
+    upload_buffer_freelist = buf;
+    enable_interrupts();
+}
+
+/*
+
+    Name: upload slots
+    Description: the host can direct the next upload to a named slot ("kernel", "module:x", ...) with 0x21/5
+                 instead of the default buffer behind loader_xfer_recv_data. Every slot holds one buffer, which its
+                 consumer takes over with upload_take instead of copying the data out. The selection only lasts for
+                 one upload and doesn't survive a bus reset.
+
+*/
+
+struct upload_slot {
+    char name[UPLOAD_SLOT_NAME_MAX];
+    struct upload_buffer* buf;
+};
+static struct upload_slot upload_slots[UPLOAD_SLOTS];
+static struct upload_slot* upload_target; // where the next bulk upload goes, NULL for the default buffer
+static struct upload_buffer* loader_xfer_default; // backs loader_xfer_recv_data
+static struct upload_buffer* loader_xfer_buf; // the buffer being uploaded to
+
+static struct upload_slot* upload_slot_find(const char* name) {
+    for (int i = 0; i < UPLOAD_SLOTS; i++) {
+        if (upload_slots[i].name[0] && !strcmp(upload_slots[i].name, name)) return &upload_slots[i];
+    }
+    return NULL;
+}
+static bool upload_slot_busy(struct upload_slot* slot) {
+    return future_pending(&loader_xfer_done) && slot->buf == loader_xfer_buf;
+}
+
+// makes the default buffer the current loader_xfer_recv_data
+static void upload_set_default(struct upload_buffer* buf) {
+    disable_interrupts();
+    loader_xfer_default = buf;
+    loader_xfer_recv_data = buf->data;
+    loader_xfer_recv_size = buf->size;
+    loader_xfer_recv_count = buf->count;
+    enable_interrupts();
+}
+
+/*
+
+    Name: upload_ready
+    Description: whether the named slot (or the default buffer for NULL) holds a completed upload
+
+*/
+
+bool upload_ready(const char* name) {
+    if (!name) return loader_xfer_recv_count != 0;
+    struct upload_slot* slot = upload_slot_find(name);
+    return slot && slot->buf && slot->buf->count && !upload_slot_busy(slot);
+}
+
+/*
+
+    Name: upload_take
+    Description: hands the completed upload in the named slot (or the default buffer for NULL) over to the caller,
+                 who owns it from then on and gives it back with upload_release. Returns NULL if there's nothing.
+
+*/
+
+struct upload_buffer* upload_take(const char* name) {
+    struct upload_buffer* buf = NULL;
+    // held throughout so no upload can start into the buffer while it changes hands
+    disable_interrupts();
+    if (!name) {
+        if ((!future_pending(&loader_xfer_done) || loader_xfer_buf != loader_xfer_default) && loader_xfer_recv_count) {
+            buf = loader_xfer_default;
+            buf->count = loader_xfer_recv_count;
+            upload_set_default(upload_buffer_alloc());
+            resize_loader_xfer_data(UPLOADSZ);
+        }
+        enable_interrupts();
+        return buf;
+    }
+    struct upload_slot* slot = upload_slot_find(name);
+    if (slot && slot->buf && slot->buf->count && !upload_slot_busy(slot)) {
+        buf = slot->buf;
+        slot->buf = NULL;
+        if (upload_target != slot) slot->name[0] = 0;
+    }
+    enable_interrupts();
+    return buf;
+}
+
+// picks the slot for the next upload, an empty name goes back to the default buffer
+static bool upload_select(const void* data, uint32_t size) {
+    char name[UPLOAD_SLOT_NAME_MAX];
+    if (size >= sizeof(name)) return false;
+    memcpy(name, data, size);
+    name[size] = 0;
+    // a slot that was selected but never filled doesn't need to stay around
+    if (upload_target && !upload_target->buf) upload_target->name[0] = 0;
+    upload_target = NULL;
+    if (!name[0]) return true;
+    struct upload_slot* slot = upload_slot_find(name);
+    for (int i = 0; !slot && i < UPLOAD_SLOTS; i++) {
+        if (!upload_slots[i].name[0]) {
+            slot = &upload_slots[i];
+            strcpy(slot->name, name);
+        }
+    }
+    if (!slot) return false;
+    upload_target = slot;
+    return true;
+}
+
+/*
+
+    Name: upload segments
+    Description: bulk OUT is received segment by segment, a segment being a run of physically adjacent pages (capped
+                 so progress is reported regularly). When a segment completes, the next one is armed before the
+                 finished one is processed, so the controller is never left idle while we catch up.
+
+*/
+
+#define UPLOAD_SEGMENT_MAX (256 * 1024)
+static uint32_t loader_xfer_received; // progress of the upload in flight, published when it's done
+
+// length of the physically contiguous run starting at off, capped to the segment size and to what's left
+static uint32_t usbloader_segment_len(uint32_t off) {
+    struct upload_buffer* buf = loader_xfer_buf;
+    uint32_t page = off / PAGE_SIZE;
+    uint32_t len = PAGE_SIZE - (off & PAGE_MASK);
+    while (len < UPLOAD_SEGMENT_MAX && page + 1 < buf->page_count && buf->pages[page + 1] == buf->pages[page] + PAGE_SIZE) {
+        len += PAGE_SIZE;
+        page++;
+    }
+    if (len > UPLOAD_SEGMENT_MAX) len = UPLOAD_SEGMENT_MAX;
+    if (len > loader_xfer_size - off) len = loader_xfer_size - off;
+    return len;
+}
+static void usbloader_segment_done(void* data, uint32_t size, uint32_t transferred);
+static void usbloader_arm_segment(uint32_t off) {
+    struct upload_buffer* buf = loader_xfer_buf;
+    uint32_t phys = buf->pages[off / PAGE_SIZE] + (off & PAGE_MASK);
+    usb_out_transfer_dma(2, buf->data + off, phys, usbloader_segment_len(off), usbloader_segment_done);
+}
+static void usbloader_segment_done(void* data, uint32_t size, uint32_t transferred) {
+    loader_xfer_received += transferred;
+    // a short segment means the host ended the transfer early
+    bool last = transferred < size || loader_xfer_received >= loader_xfer_size;
+    if (!last) usbloader_arm_segment(loader_xfer_received);
+    // the next segment is already in flight, so this one can be handed on at leisure
+    cache_invalidate(data, transferred);
+    if (last) {
+        loader_xfer_buf->count = loader_xfer_received;
+        if (loader_xfer_buf == loader_xfer_default) loader_xfer_recv_count = loader_xfer_received;
+        future_complete(&loader_xfer_done, loader_xfer_received);
+    }
+}
+/*
+
+    Name: streaming decompression
+    Description: with wValue 1 on 0x21/1 the upload is an .lzma file that gets decoded while it arrives. Bulk OUT
+                 lands in a small ring of contiguous segments rather than in the target buffer; the unlzma task
+                 decodes each filled segment into the target buffer, mapping pages as the output grows, and hands
+                 the segment back, so the compressed image is never held in full. If the decoder falls behind, the
+                 ring fills up and the endpoint stays unarmed, which NAKs the host until a segment frees up.
+
+*/
+
+#define UPLOAD_MODE_LZMA 1
+#define UNLZMA_RING_SEGMENTS 4
+#define UNLZMA_OUT_STEP (1024 * 1024)
+static uint8_t loader_xfer_mode;
+static uint8_t* unlzma_ring;
+static uint32_t unlzma_ring_phys;
+static uint32_t unlzma_ring_len[UNLZMA_RING_SEGMENTS];
+static uint32_t unlzma_ring_head, unlzma_ring_tail; // free-running: DMA fills at head, the decoder drains at tail
+static bool unlzma_armed, unlzma_input_done, unlzma_failed, unlzma_active;
+static struct irq_bottom_half unlzma_bh;
+static unlzma_stream unlzma_state;
+
+static void unlzma_segment_done(void* data, uint32_t size, uint32_t transferred);
+// called with interrupts held
+static void unlzma_arm_segment() {
+    if (unlzma_armed || unlzma_input_done || unlzma_ring_head - unlzma_ring_tail >= UNLZMA_RING_SEGMENTS) return;
+    uint32_t off = (unlzma_ring_head % UNLZMA_RING_SEGMENTS) * UPLOAD_SEGMENT_MAX;
+    uint32_t len = loader_xfer_size - loader_xfer_received;
+    if (len > UPLOAD_SEGMENT_MAX) len = UPLOAD_SEGMENT_MAX;
+    unlzma_armed = true;
+    usb_out_transfer_dma(2, unlzma_ring + off, unlzma_ring_phys + off, len, unlzma_segment_done);
+}
+static void unlzma_segment_done(void* data, uint32_t size, uint32_t transferred) {
+    unlzma_armed = false;
+    loader_xfer_received += transferred;
+    unlzma_ring_len[unlzma_ring_head % UNLZMA_RING_SEGMENTS] = transferred;
+    unlzma_ring_head++;
+    if (transferred < size || loader_xfer_received >= loader_xfer_size) unlzma_input_done = true;
+    unlzma_arm_segment();
+    cache_invalidate(data, transferred);
+    irq_bottom_half_kick(&unlzma_bh);
+}
+static void unlzma_start_xfer() {
+    if (!unlzma_ring) {
+        unlzma_ring = alloc_contig(UNLZMA_RING_SEGMENTS * UPLOAD_SEGMENT_MAX);
+        unlzma_ring_phys = vatophys((uint64_t)unlzma_ring);
+    }
+    unlzma_stream_init(&unlzma_state, loader_xfer_buf->data, UPLOADSZ_MAX);
+    disable_interrupts();
+    unlzma_ring_head = unlzma_ring_tail = 0;
+    unlzma_armed = unlzma_input_done = unlzma_failed = false;
+    unlzma_active = true;
+    unlzma_arm_segment();
+    enable_interrupts();
+}
+static void unlzma_decode_segment(const uint8_t* src, size_t left) {
+    struct upload_buffer* out = loader_xfer_buf;
+    while (left && !unlzma_failed) {
+        size_t used = left;
+        if (unlzma_stream_feed(&unlzma_state, src, &used, out->size) != SZ_OK) {
+            unlzma_failed = true;
+            break;
+        }
+        src += used;
+        left -= used;
+        if (!left || unlzma_stream_finished(&unlzma_state)) break;
+        // out of room for the output, map some more
+        if (out->size >= UPLOADSZ_MAX) {
+            unlzma_failed = true;
+            break;
+        }
+        upload_grow(out, out->size + UNLZMA_OUT_STEP > UPLOADSZ_MAX ? UPLOADSZ_MAX : out->size + UNLZMA_OUT_STEP);
+    }
+}
+static void unlzma_finish() {
+    struct upload_buffer* out = loader_xfer_buf;
+    uint32_t size = unlzma_failed ? 0 : unlzma_stream_out(&unlzma_state);
+    if (unlzma_failed) fiprintf(stderr, "usbloader: lzma upload failed to decode\n");
+    unlzma_stream_free(&unlzma_state);
+    disable_interrupts();
+    unlzma_active = false;
+    out->count = size;
+    if (out == loader_xfer_default) {
+        loader_xfer_recv_size = out->size;
+        loader_xfer_recv_count = size;
+    }
+    future_complete(&loader_xfer_done, size);
+    enable_interrupts();
+}
+static void unlzma_main() {
+    while (1) {
+        irq_bottom_half_wait(&unlzma_bh);
+        while (unlzma_active) {
+            disable_interrupts();
+            bool have = unlzma_ring_tail != unlzma_ring_head;
+            bool done = unlzma_input_done;
+            enable_interrupts();
+            if (!have) {
+                if (done) unlzma_finish();
+                break;
+            }
+            uint32_t idx = unlzma_ring_tail % UNLZMA_RING_SEGMENTS;
+            unlzma_decode_segment(unlzma_ring + idx * UPLOAD_SEGMENT_MAX, unlzma_ring_len[idx]);
+            disable_interrupts();
+            unlzma_ring_tail++;
+            unlzma_arm_segment();
+            enable_interrupts();
+        }
+    }
+}
+
+static void usbloader_start_xfer() {
+    if (upload_target) {
+        if (!upload_target->buf) upload_target->buf = upload_buffer_alloc();
+        loader_xfer_buf = upload_target->buf;
+        upload_target = NULL; // the slot keeps its name until the upload is taken
+    } else {
+        loader_xfer_buf = loader_xfer_default;
+        loader_xfer_recv_count = 0;
+    }
+    loader_xfer_buf->count = 0;
+    loader_xfer_received = 0;
+    future_init(&loader_xfer_done);
+    if (loader_xfer_mode == UPLOAD_MODE_LZMA) {
+        // loader_xfer_size is the compressed size, the output is mapped as it's decoded
+        unlzma_start_xfer();
+        return;
+    }
+    upload_grow(loader_xfer_buf, loader_xfer_size);
+    if (loader_xfer_buf == loader_xfer_default) loader_xfer_recv_size = loader_xfer_buf->size;
+    usbloader_arm_segment(0);
+}
+
+/*
+
+    Name: usbloader_copy_contig
+    Description: for consumers that hand the upload to hardware or jump to it with the MMU off: returns a physically
+                 contiguous copy of the uploaded data (free it with free_contig), or NULL if nothing was uploaded.
+                 The copy is cleaned to the point of coherency, so its physical address can be handed out right away
+
+*/
+
+void* usbloader_copy_contig(uint32_t* size) {
+    if (!loader_xfer_recv_count) return NULL;
+    *size = loader_xfer_recv_count;
+    void* copy = alloc_contig(loader_xfer_recv_count);
+    memcpy(copy, loader_xfer_recv_data, loader_xfer_recv_count);
+    cache_clean(copy, loader_xfer_recv_count);
+    return copy;
+}
+
+/*
+
+    Name: usbloader_wait_upload
+    Description: waits for the bulk upload in flight (if any) and returns the number of bytes received
+
+*/
+
+uint32_t usbloader_wait_upload() {
+    future_await(&loader_xfer_done);
+    return loader_xfer_recv_count;
 }
 
 char cmd_buf[256];
@@ -53,27 +428,21 @@ extern void queue_rx_char(char inch);
 bool usb_write_stdin(const void *data, uint32_t size) {
     enable_interrupts();
     const char* datac = (const char*) data;
+    uint64_t gen = command_handler_generation();
     for (int i=0; i<size; i++) {
         if (!datac[i]) break;
         queue_rx_char(datac[i]);
     }
     if (should_wait_for_cmd_handler)
-        event_wait(&command_handler_iter);
+        command_wait_for_prompt(gen);
     disable_interrupts();
     return true;
 }
 
 void resize_loader_xfer_data(uint32_t newsz) {
     if (newsz > UPLOADSZ_MAX) panic("resize_loader_xfer_data");
-    disable_interrupts();
-    if (newsz > loader_xfer_recv_size) {
-        uint8_t* new_xfer_buffer = alloc_contig(newsz);
-        memcpy(new_xfer_buffer, loader_xfer_recv_data, loader_xfer_recv_count);
-        free_contig(loader_xfer_recv_data, loader_xfer_recv_size);
-        loader_xfer_recv_size = newsz;
-        loader_xfer_recv_data = new_xfer_buffer;
-    }
-    enable_interrupts();
+    upload_grow(loader_xfer_default, newsz);
+    loader_xfer_recv_size = loader_xfer_default->size;
 }
 bool reallocate_loader_xfer_data(const void* data, uint32_t size) {
     if (size != 4) panic("reallocate_loader_xfer_data");
@@ -81,21 +450,92 @@ bool reallocate_loader_xfer_data(const void* data, uint32_t size) {
     uint32_t newsz = *(uint32_t*)data;
     newsz += 0x1ff;
     newsz &= ~0x1ff;
-    if (newsz > UPLOADSZ_MAX) return false;
-    loader_xfer_recv_count = 0;
-    usbloader_is_waiting_xfer = 1;
-    resize_loader_xfer_data(newsz);
+    if (!newsz || newsz > UPLOADSZ_MAX) return false;
     loader_xfer_size = newsz;
-    usb_out_transfer_dma(2, loader_xfer_recv_data, vatophys((uint64_t)loader_xfer_recv_data), loader_xfer_size, usbloader_xfer_done_cb); // should resolve the VA rather than doing this, but oh well.
+    usbloader_start_xfer();
 
     return true;
 }
 
+/*
+
+    Name: stdout stream
+    Description: once the host asks for it (0x21/4, wValue 2), stdout goes into this ring instead of the buffer behind
+                 0xA1/1 and is DMA'd straight out of it on bulk endpoint 0x83 as soon as it's written. Head and tail are
+                 free-running; the bytes between tail and tail + in_flight belong to the controller until the transfer
+                 completes. Everything is only touched with interrupts held, which also keeps out the USB bottom half.
+
+*/
+
+#define STDOUT_STREAM_SIZE 0x10000 // power of two
+static uint8_t* stdout_stream;
+static uint32_t stdout_stream_phys;
+static uint32_t stdout_stream_head, stdout_stream_tail, stdout_stream_in_flight;
+static volatile bool stdout_streaming;
+
+static void usb_stdout_stream_kick();
+static void usb_stdout_stream_done() {
+    stdout_stream_tail += stdout_stream_in_flight;
+    stdout_stream_in_flight = 0;
+    usb_stdout_stream_kick();
+}
+static void usb_stdout_stream_kick() {
+    if (!stdout_streaming || stdout_stream_in_flight) return;
+    uint32_t avail = stdout_stream_head - stdout_stream_tail;
+    if (!avail) return;
+    uint32_t off = stdout_stream_tail & (STDOUT_STREAM_SIZE - 1);
+    uint32_t len = STDOUT_STREAM_SIZE - off;
+    if (len > avail) len = avail;
+    stdout_stream_in_flight = len;
+    usb_in_transfer_dma(0x83, stdout_stream + off, stdout_stream_phys + off, len, usb_stdout_stream_done);
+}
+
+bool usb_stdout_streaming() {
+    return stdout_streaming;
+}
+
+// returns how much of data fit, 0 if streaming is off or the host isn't keeping up
+size_t usb_stdout_stream_write(const char* data, size_t size) {
+    disable_interrupts();
+    if (!stdout_streaming) {
+        enable_interrupts();
+        return 0;
+    }
+    uint32_t space = STDOUT_STREAM_SIZE - (stdout_stream_head - stdout_stream_tail);
+    if (size > space) size = space;
+    uint32_t off = stdout_stream_head & (STDOUT_STREAM_SIZE - 1);
+    uint32_t first = STDOUT_STREAM_SIZE - off;
+    if (first > size) first = size;
+    memcpy(stdout_stream + off, data, first);
+    memcpy(stdout_stream, data + first, size - first);
+    stdout_stream_head += size;
+    usb_stdout_stream_kick();
+    enable_interrupts();
+    return size;
+}
+
+// called from usb_reset with interrupts held, the next host starts out uploading to the default buffer
+void usb_upload_target_reset() {
+    if (upload_target && !upload_target->buf) upload_target->name[0] = 0;
+    upload_target = NULL;
+}
+
+// called from usb_reset with interrupts held, the host has to opt in again
+void usb_stdout_stream_reset() {
+    stdout_streaming = false;
+    stdout_stream_in_flight = 0;
+    stdout_stream_tail = stdout_stream_head;
+}
+
 void usbloader_init() {
-    loader_xfer_recv_data = alloc_contig(UPLOADSZ);
+    upload_set_default(upload_buffer_alloc());
+    resize_loader_xfer_data(UPLOADSZ);
+    task_create("unlzma", unlzma_main);
     loader_xfer_size = UPLOADSZ;
-    loader_xfer_recv_size = UPLOADSZ;
     loader_xfer_recv_count = 0;
+    // slack past the end since bulk DMA buffers are rounded up to whole packets
+    stdout_stream = alloc_contig(STDOUT_STREAM_SIZE + BULK_EP_MAX_PACKET_SIZE);
+    stdout_stream_phys = vatophys((uint64_t)stdout_stream);
 } // fetch_stdoutbuf
 
 char stdoutbuf_copy[STDOUT_BUFLEN];
@@ -104,22 +544,29 @@ void usb_read_stdout_cb() {
 }
 bool ep0_device_request(struct setup_packet *setup) {
     if (setup->bmRequestType == 0x21) {
-        if (setup->bRequest == 1 && setup->wLength == 0) { // request bulk upload initialization
-            if (usbloader_is_waiting_xfer) return false;
-            loader_xfer_recv_count = 0;
-            usbloader_is_waiting_xfer = 1;
-            usb_out_transfer_dma(2, loader_xfer_recv_data, vatophys((uint64_t)loader_xfer_recv_data), loader_xfer_size, usbloader_xfer_done_cb); // should resolve the VA rather than doing this, but oh well.
+        if (setup->bRequest == 1 && setup->wLength == 0) { // request bulk upload initialization, wValue 1 for .lzma
+            if (future_pending(&loader_xfer_done)) return false;
+            loader_xfer_mode = setup->wValue == UPLOAD_MODE_LZMA ? UPLOAD_MODE_LZMA : 0;
+            usbloader_start_xfer();
             return true;
         }
-        if (setup->bRequest == 2 && setup->wLength == 0) { // discard loaded data
-            if (!usbloader_is_waiting_xfer)
-                loader_xfer_recv_count = 0;
+        if (setup->bRequest == 2 && setup->wLength == 0) { // discard loaded data (of the selected slot)
+            if (!future_pending(&loader_xfer_done)) {
+                if (upload_target) upload_release(upload_take(upload_target->name));
+                else loader_xfer_recv_count = 0;
+            }
             return true;
         }
         if (setup->bRequest == 3 && setup->wLength > 0 && setup->wLength <= 512) { // write to stdin
             ep0_begin_data_out_stage(usb_write_stdin);
             return true;
         }
+        if (setup->bRequest == 5 && setup->wLength < UPLOAD_SLOT_NAME_MAX) { // direct the next uploads to a named slot
+            if (future_pending(&loader_xfer_done)) return false;
+            if (!setup->wLength) return upload_select("", 0);
+            ep0_begin_data_out_stage(upload_select);
+            return true;
+        }
         if (setup->bRequest == 4) {
             if(setup->wValue == 0) // make it so next write to stdin will stall until command is over
             {
@@ -133,30 +580,40 @@ bool ep0_device_request(struct setup_packet *setup) {
                 set_stdout_blocking(true);
                 return true;
             }
-            if(setup->wValue == 0xffff) // reset all
+            if(setup->wValue == 2) // stream stdout over bulk endpoint 0x83 from now on
+            {
+                if (!stdout_stream) return false;
+                disable_interrupts();
+                stdout_streaming = true;
+                usb_stdout_stream_kick();
+                enable_interrupts();
+                return true;
+            }
+            if(setup->wValue == 3) // back to polling stdout with 0xA1/1
+            {
+                disable_interrupts();
+                stdout_streaming = false;
+                enable_interrupts();
+                return true;
+            }
+            if(setup->wValue == 0xffff) // reset all (blocking modes, streaming stays as it is)
             {
                 should_wait_for_cmd_handler = 0;
                 set_stdout_blocking(false);
                 return true;
             }
         }
-        if (setup->bRequest == 1 && setup->wLength == 4) { // request upload buffer size change
-            if (usbloader_is_waiting_xfer) return false;
+        if (setup->bRequest == 1 && setup->wLength == 4) { // request upload buffer size change, wValue 1 for .lzma
+            if (future_pending(&loader_xfer_done)) return false;
+            loader_xfer_mode = setup->wValue == UPLOAD_MODE_LZMA ? UPLOAD_MODE_LZMA : 0;
             ep0_begin_data_out_stage(reallocate_loader_xfer_data);
             return true;
         }
     } else if (setup->bmRequestType == 0xA1) {
         // IN request
         if (setup->bRequest == 1 && (setup->wLength == 512 || setup->wLength == 0x1000)) { // request bulk upload initialization
-            int xferlen = 0;
-            char *buf = stdoutbuf_copy;
-            fetch_stdoutbuf(buf, &xferlen);
-            if(xferlen > setup->wLength)
-            {
-                buf += xferlen - setup->wLength;
-                xferlen = setup->wLength;
-            }
-            ep0_begin_data_in_stage(buf, xferlen, usb_read_stdout_cb);
+            size_t xferlen = stdout_ring_read(stdoutbuf_copy, setup->wLength); // whatever doesn't fit stays for the next poll
+            ep0_begin_data_in_stage(stdoutbuf_copy, xferlen, usb_read_stdout_cb);
             return true;
         }
         if (setup->bRequest == 2 && setup->wLength == 1) { // check for async command completion status
@@ -164,6 +621,32 @@ bool ep0_device_request(struct setup_packet *setup) {
             ep0_begin_data_in_stage(&inprog, 1, usb_read_stdout_cb);
             return true;
         }
+        if (setup->bRequest == 3 && setup->wLength >= sizeof(struct pongo_meminfo)) { // fetch memory statistics
+            static struct pongo_meminfo meminfo;
+            pongo_meminfo_collect(&meminfo);
+            ep0_begin_data_in_stage(&meminfo, sizeof(meminfo), usb_read_stdout_cb);
+            return true;
+        }
+        if (setup->bRequest == 4 && setup->wLength >= sizeof(struct pongo_trace_header)) { // drain the trace ring
+            static char tracebuf[0x1000];
+            size_t len = pongo_trace_read(tracebuf, setup->wLength < sizeof(tracebuf) ? setup->wLength : sizeof(tracebuf));
+            ep0_begin_data_in_stage(tracebuf, len, usb_read_stdout_cb);
+            return true;
+        }
+        if (setup->bRequest == 5 && setup->wLength >= sizeof(struct pongo_profile_header)) { // profiler buckets, wValue is the cursor
+            static char profbuf[0x1000];
+            size_t len = pongo_profile_read(setup->wValue, profbuf, setup->wLength < sizeof(profbuf) ? setup->wLength : sizeof(profbuf));
+            ep0_begin_data_in_stage(profbuf, len, usb_read_stdout_cb);
+            return true;
+        }
+        if (setup->bRequest == 6 && setup->wLength >= sizeof(struct pongo_module_map_entry)) { // loaded module ranges
+            static struct pongo_module_map_entry modmap[0x1000 / sizeof(struct pongo_module_map_entry)];
+            size_t max = setup->wLength / sizeof(struct pongo_module_map_entry);
+            if (max > sizeof(modmap) / sizeof(modmap[0])) max = sizeof(modmap) / sizeof(modmap[0]);
+            size_t n = pongo_module_map(modmap, max);
+            ep0_begin_data_in_stage(modmap, n * sizeof(struct pongo_module_map_entry), usb_read_stdout_cb);
+            return true;
+        }
     }
     return false;
 }